@@ -1,32 +1,60 @@
 #include "mpc.h"
 #include <errno.h>
+#include <limits.h>
 #include <readline/history.h>
 #include <readline/readline.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 typedef struct lenv lenv;
 typedef struct lval lval;
+typedef struct lsym lsym;
+typedef struct lscope lscope;
+typedef struct lcode lcode;
+typedef struct lhamt lhamt;
 typedef enum ltype ltype;
+typedef enum lgc_kind lgc_kind;
 typedef lval *(*lbuiltin)(lenv *, lval *);
 
 static lval *lval_eval(lenv *, lval *);
+static lval *lval_apply(lenv *, lval *);
 static lval *lval_add(lval *, lval *);
 static lval *lval_pop(lval *, size_t);
 static lval *lval_take(lval *, size_t);
-static lval *lval_read(mpc_ast_t *);
+static lval *lval_read(char *, char *);
+static lval *lval_err(char *, ...);
 static void lval_delete(lval *);
 static void lval_print(lval *);
 static lval *lval_copy(lval *);
+static lval *lval_ref(lval *);
+static lval *lval_mut(lval *);
 static bool streq(char *, char *);
+static lsym *lsym_intern(char *);
 static lenv *lenv_new();
-static lenv *lenv_copy(lenv *);
 static void lenv_delete(lenv *);
+static bool lenv_hashed(lenv *);
+static size_t lenv_slots(lenv *);
+static lval **lenv_find(lenv *, lsym *);
 static lval *lenv_get(lenv *, lval *);
+static void lenv_set(lenv *, lsym *, lval *);
 static void lenv_put(lenv *, lval *, lval *);
 static void lenv_def(lenv *, lval *, lval *);
+static lval *lenv_lookup(lenv *, lval *);
+static lcode *lcode_compile(lval *);
+static void lcode_release(lcode *);
+static lcode *lcode_select(lcode *);
+static lval *lvm_run(lenv *, lcode *);
+static void lhamt_release(lhamt *);
+static lval *lhamt_collect(lhamt *, lval *, bool, bool);
+static size_t lhamt_hash(lhamt *, size_t);
+static bool lmap_eq(lval *, lval *);
+static void *gc_alloc(size_t, lgc_kind);
+static void gc_free(void *);
+static void gc_safepoint();
 
 enum ltype {
   LTYPE_NUM,
@@ -35,30 +63,207 @@ enum ltype {
   LTYPE_SEXP,
   LTYPE_QEXP,
   LTYPE_FUN,
+  LTYPE_DBL,
+  LTYPE_NVEC,
+  LTYPE_BIG,
+  LTYPE_VEC,
+  LTYPE_MAP,
+  LTYPE_STR,
+  LTYPE_BYTES,
 };
 
+/* Backing store shared by a vector and every view sliced from it. Slots
+ * from len up to cap are not yet visible to any view, so a view ending at
+ * len can be extended in place. */
+typedef struct lvbuf lvbuf;
+struct lvbuf {
+  size_t refs;
+  size_t len;
+  size_t cap;
+  lval **items;
+};
+
+/* Byte buffer shared by strings and byte strings and the slices taken
+ * from them. As with lvbuf, a value ending at len may be extended in
+ * place. */
+typedef struct lsbuf lsbuf;
+struct lsbuf {
+  size_t refs;
+  size_t len;
+  size_t cap;
+  char *data;
+};
+
+/* Persistent hash map: a hash array mapped trie consuming LHAMT_BITS of
+ * the key hash per level. A branch node holds one slot per set bit of
+ * bitmap, in bit order. Keys whose hashes are equal in every bit share a
+ * collision node below the last level, with bitmap 0 and one slot per
+ * entry. Nodes are immutable once built and shared between maps. */
+#define LHAMT_BITS 5
+#define LHAMT_MASK ((1u << LHAMT_BITS) - 1)
+#define LHAMT_HASH_BITS (sizeof(size_t) * 8)
+
+/* A slot holds an entry, or a child node when key is null. */
+typedef struct lhamt_slot lhamt_slot;
+struct lhamt_slot {
+  size_t hash;
+  lval *key;
+  union {
+    lval *val;
+    lhamt *node;
+  };
+};
+
+struct lhamt {
+  size_t refs;
+  uint32_t bitmap;
+  uint32_t count;
+  lhamt_slot slots[];
+};
+
+typedef struct lbig lbig;
+struct lbig {
+  bool neg;
+  size_t len;
+  uint32_t *d;
+};
+
+/* nlocal counts the live frames other than the global env that bind the
+ * symbol; while it is zero, every lookup of the symbol ends in the global
+ * env. defs counts the changes to its global binding. */
+struct lsym {
+  char *name;
+  size_t hash;
+  size_t nlocal;
+  size_t defs;
+};
+
+/* Bumped on every change to the global env. */
+static size_t lenv_version = 1;
+
+/* Frames of up to LENV_LINEAR_MAX bindings are packed arrays scanned in
+ * insertion order. Larger frames switch to open addressing over cap slots,
+ * with an empty slot marked by a null sym. */
+#define LENV_LINEAR_MAX 8
+
 struct lenv {
   lenv *par;
   size_t count;
-  char **syms;
+  size_t cap;
+  lsym **syms;
   lval **vals;
 };
 
+/* Instructions are packed as an opcode in the low byte and an operand in
+ * the remaining bits. */
+enum lopcode {
+  OP_CONST, /* push a copy of consts[arg] */
+  OP_LOAD,  /* push the value bound to the symbol consts[arg] */
+  OP_APPLY, /* pop arg values and evaluate them as an S-expression */
+  OP_TAIL,  /* OP_APPLY in tail position, run in the current frame */
+  OP_RET,   /* return the top of the stack */
+};
+
+#define OP_BITS 8
+#define OP_MAKE(op, arg) ((uint32_t)(op) | (uint32_t)(arg) << OP_BITS)
+#define OP_CODE(ins) ((ins) & ((1u << OP_BITS) - 1))
+#define OP_ARG(ins) ((ins) >> OP_BITS)
+
+/* Inline cache of an OP_LOAD site for a symbol bound in the global env.
+ * val is borrowed from the global env and valid while version matches. */
+typedef struct lic lic;
+struct lic {
+  size_t version;
+  lval *val;
+};
+
+/* A global binding that folded code relies on, as of defs. */
+typedef struct ldep ldep;
+struct ldep {
+  lsym *sym;
+  size_t defs;
+};
+
+/* Compiled lambda body, shared by every copy of the function. ics holds
+ * one inline cache per constant, used by OP_LOAD, and subs the code for
+ * any constant a tail eval or if has jumped into. Code compiled from a
+ * constant-folded body lists the bindings it folded in deps and carries
+ * the unfolded body's code as fallback. */
+struct lcode {
+  size_t refs;
+  size_t count;
+  size_t cap;
+  uint32_t *ops;
+  size_t nconsts;
+  lval **consts;
+  lic *ics;
+  lcode **subs;
+  size_t depth;
+  size_t ndeps;
+  ldep *deps;
+  lcode *fallback;
+};
+
+/* Lexical scope of the lambda being resolved, innermost first. */
+struct lscope {
+  lval *formals;
+  lscope *up;
+};
+
+/* Values are reference counted and shared freely; anything that modifies
+ * a value in place must first take a private copy with lval_mut. */
 struct lval {
   ltype type;
+  size_t refs;
   union {
     long num;
-    char *sym;
+    double dbl;
+    lbig big;
+    struct {
+      lhamt *hamt;
+      size_t hsize;
+    };
+    /* Strings and byte strings are a view of slen bytes of sbuf starting
+     * at soff. */
+    struct {
+      lsbuf *sbuf;
+      size_t soff;
+      size_t slen;
+    };
+    /* A vector is a view of vlen items of vbuf starting at voff. */
+    struct {
+      lvbuf *vbuf;
+      size_t voff;
+      size_t vlen;
+    };
+    /* A numeric vector holds len unboxed doubles. */
+    struct {
+      size_t len;
+      double *data;
+    };
+    struct {
+      lsym *sym;
+      int depth;
+      int slot;
+    };
     char *err;
+    /* A partially applied function has no formals, body or code of its
+     * own, only the target lambda and the Q-Expression of bound args. */
     struct {
-      lenv *env;
       lbuiltin builtin;
       lval *formals;
       lval *body;
+      lcode *code;
+      lval *target;
+      lval *bound;
     };
+    /* cell points count live elements into a cap-slot buffer at mem;
+     * slots before cell are free space left by popping the head. */
     struct {
       size_t count;
       lval **cell;
+      lval **mem;
+      size_t cap;
     };
   };
 };
@@ -77,35 +282,366 @@ static char *ltype_name(ltype t) {
     return "S-Expression";
   case LTYPE_QEXP:
     return "Q-Expression";
+  case LTYPE_DBL:
+    return "Float";
+  case LTYPE_NVEC:
+    return "Numeric Vector";
+  case LTYPE_BIG:
+    return "Bignum";
+  case LTYPE_VEC:
+    return "Vector";
+  case LTYPE_MAP:
+    return "Map";
+  case LTYPE_STR:
+    return "String";
+  case LTYPE_BYTES:
+    return "Bytes";
   default:
     return "Unknown";
   }
 }
 
-static bool has_tag(mpc_ast_t *a, char *tag) {
-  /* printf("has_tag(%s, %s)\n", a->tag, tag); */
-  char *pos = strstr(a->tag, tag);
-  if (pos == 0) {
-    return false;
+static bool streq(char *left, char *right) { return strcmp(left, right) == 0; }
+
+/* Every symbol name is interned once, so symbols compare by pointer. */
+static struct {
+  size_t count;
+  size_t cap;
+  lsym **syms;
+} symtab;
+
+static size_t str_hash(char *s) {
+  size_t h = 14695981039346656037UL;
+  for (; *s; s++) {
+    h = (h ^ (unsigned char)*s) * 1099511628211UL;
   }
-  size_t taglen = strlen(tag);
-  bool delim_left = pos == a->tag || *(pos - 1) == '|';
-  bool delim_right = *(pos + taglen) == 0 || *(pos + taglen) == '|';
-  /* printf("left: %d, right: %d, %s %s\n", delim_left, delim_right, a->tag,
-   * tag); */
-  return delim_left && delim_right;
+  return h;
 }
 
-static bool streq(char *left, char *right) { return strcmp(left, right) == 0; }
+static void symtab_grow() {
+  size_t cap = symtab.cap ? symtab.cap * 2 : 256;
+  lsym **syms = calloc(cap, sizeof(*syms));
+  for (size_t i = 0; i < symtab.cap; i++) {
+    lsym *s = symtab.syms[i];
+    if (s) {
+      size_t j = s->hash & (cap - 1);
+      while (syms[j]) {
+        j = (j + 1) & (cap - 1);
+      }
+      syms[j] = s;
+    }
+  }
+  free(symtab.syms);
+  symtab.syms = syms;
+  symtab.cap = cap;
+}
+
+static lsym *lsym_intern(char *name) {
+  if ((symtab.count + 1) * 4 > symtab.cap * 3) {
+    symtab_grow();
+  }
+  size_t h = str_hash(name);
+  size_t i = h & (symtab.cap - 1);
+  for (lsym *s; (s = symtab.syms[i]); i = (i + 1) & (symtab.cap - 1)) {
+    if (s->hash == h && streq(s->name, name)) {
+      return s;
+    }
+  }
+  lsym *s = malloc(sizeof(*s));
+  *s = (lsym){.name = strdup(name), .hash = h};
+  symtab.syms[i] = s;
+  symtab.count++;
+  return s;
+}
+
+/* Small fixed-size blocks are carved from SLAB_CHUNK-byte chunks and
+ * recycled through per-thread free lists, one per SLAB_ALIGN size class.
+ * Larger requests fall through to malloc. */
+#define SLAB_ALIGN 16
+#define SLAB_CLASSES 8
+#define SLAB_CHUNK (64 * 1024)
+
+typedef struct lslab_block lslab_block;
+struct lslab_block {
+  lslab_block *next;
+};
+
+static _Thread_local lslab_block *slab_free[SLAB_CLASSES];
+static _Thread_local lslab_block *slab_chunks;
+
+static size_t slab_class(size_t size) {
+  return (size + SLAB_ALIGN - 1) / SLAB_ALIGN - 1;
+}
+
+static void slab_refill(size_t c) {
+  size_t size = (c + 1) * SLAB_ALIGN;
+  char *chunk = malloc(SLAB_CHUNK);
+  ((lslab_block *)chunk)->next = slab_chunks;
+  slab_chunks = (lslab_block *)chunk;
+  /* Thread the list backwards so blocks are handed out in address order. */
+  size_t first = SLAB_ALIGN;
+  size_t n = (SLAB_CHUNK - first) / size;
+  for (size_t i = n; i-- > 0;) {
+    lslab_block *b = (lslab_block *)(chunk + first + i * size);
+    b->next = slab_free[c];
+    slab_free[c] = b;
+  }
+}
+
+static void *slab_alloc(size_t size) {
+  size_t c = slab_class(size);
+  if (c >= SLAB_CLASSES) {
+    return malloc(size);
+  }
+  if (!slab_free[c]) {
+    slab_refill(c);
+  }
+  lslab_block *b = slab_free[c];
+  slab_free[c] = b->next;
+  return b;
+}
+
+static void slab_release(void *p, size_t size) {
+  size_t c = slab_class(size);
+  if (c >= SLAB_CLASSES) {
+    free(p);
+    return;
+  }
+  lslab_block *b = p;
+  b->next = slab_free[c];
+  slab_free[c] = b;
+}
+
+/* Bump allocator for scratch memory whose lifetime is bounded by a single
+ * top-level evaluation. Allocations are released in stack order with
+ * arena_release and the whole arena is rewound after each REPL line;
+ * chunks are kept for reuse. */
+#define ARENA_CHUNK (64 * 1024)
+
+typedef struct larena_chunk larena_chunk;
+struct larena_chunk {
+  larena_chunk *next;
+  size_t size;
+  size_t used;
+  _Alignas(16) char data[];
+};
+
+typedef struct larena_mark larena_mark;
+struct larena_mark {
+  larena_chunk *chunk;
+  size_t used;
+};
+
+static _Thread_local struct {
+  larena_chunk *first;
+  larena_chunk *cur;
+} arena;
+
+static void *arena_alloc(size_t size) {
+  size = (size + 15) & ~(size_t)15;
+  larena_chunk *c = arena.cur;
+  while (!c || c->used + size > c->size) {
+    larena_chunk *next = c ? c->next : arena.first;
+    if (!next || next->size < size) {
+      size_t cap = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+      larena_chunk *n = malloc(sizeof(*n) + cap);
+      *n = (larena_chunk){.next = next, .size = cap};
+      if (c) {
+        c->next = n;
+      } else {
+        arena.first = n;
+      }
+      next = n;
+    }
+    c = next;
+    c->used = 0;
+  }
+  arena.cur = c;
+  void *p = c->data + c->used;
+  c->used += size;
+  return p;
+}
+
+static larena_mark arena_mark() {
+  return (larena_mark){arena.cur, arena.cur ? arena.cur->used : 0};
+}
+
+static void arena_release(larena_mark m) {
+  arena.cur = m.chunk;
+  if (m.chunk) {
+    m.chunk->used = m.used;
+  }
+}
+
+static void arena_reset() { arena_release((larena_mark){0}); }
+
+/* Every lval and lenv is allocated behind an lgc header linking it into
+ * the heap list, so the collector can find objects that reference counting
+ * alone never frees. Collection only runs at safe points where every live
+ * object is reachable from a registered root. */
+enum lgc_kind {
+  GC_VAL,
+  GC_ENV,
+};
+
+typedef struct lgc lgc;
+struct lgc {
+  lgc *prev;
+  lgc *next;
+  size_t size;
+  lgc_kind kind;
+  bool mark;
+};
+
+/* Number of live objects below which no collection is attempted. */
+#define GC_MIN_HEAP 4096
+
+typedef struct lvm_frame lvm_frame;
+struct lvm_frame {
+  lvm_frame *prev;
+  lval **stack;
+  size_t *sp;
+};
+
+static struct {
+  bool enabled;
+  lgc heap;
+  size_t objects;
+  size_t bytes;
+  size_t threshold;
+  lenv *root;
+  lvm_frame *frames;
+  size_t collections;
+  size_t freed;
+  double pause_last;
+  double pause_max;
+  double pause_total;
+} gc = {.heap = {.prev = &gc.heap, .next = &gc.heap}, .threshold = GC_MIN_HEAP};
+
+#define GC_HDR(p) ((lgc *)(p) - 1)
+
+static void *gc_alloc(size_t size, lgc_kind kind) {
+  lgc *h = slab_alloc(sizeof(*h) + size);
+  *h = (lgc){
+      .prev = &gc.heap, .next = gc.heap.next, .size = size, .kind = kind};
+  gc.heap.next->prev = h;
+  gc.heap.next = h;
+  gc.objects++;
+  gc.bytes += size;
+  return h + 1;
+}
+
+static void gc_free(void *p) {
+  lgc *h = GC_HDR(p);
+  h->prev->next = h->next;
+  h->next->prev = h->prev;
+  gc.objects--;
+  gc.bytes -= h->size;
+  slab_release(h, sizeof(*h) + h->size);
+}
+
+/* Numbers that fit in LFIX_BITS are immediates: the value is stored in the
+ * pointer itself, shifted left with the low bit set, and never allocated.
+ * Only numbers outside that range are boxed. */
+#define LFIX_BITS (sizeof(intptr_t) * 8 - 1)
+#define LFIX_MAX ((long)(((uintptr_t)1 << (LFIX_BITS - 1)) - 1))
+#define LFIX_MIN (-LFIX_MAX - 1)
+
+static bool lval_is_fix(lval *v) { return (uintptr_t)v & 1; }
+
+static ltype lval_type(lval *v) {
+  return lval_is_fix(v) ? LTYPE_NUM : v->type;
+}
+
+static long lval_numval(lval *v) {
+  return lval_is_fix(v) ? (long)((intptr_t)v >> 1) : v->num;
+}
 
 static lval *lval_num(long val) {
-  lval *ret = malloc(sizeof(lval));
-  *ret = (lval){.type = LTYPE_NUM, .num = val};
+  if (val >= LFIX_MIN && val <= LFIX_MAX) {
+    return (lval *)(((uintptr_t)val << 1) | 1);
+  }
+  lval *ret = gc_alloc(sizeof(lval), GC_VAL);
+  *ret = (lval){.type = LTYPE_NUM, .refs = 1, .num = val};
+  return ret;
+}
+
+static lval *lval_dbl(double val) {
+  lval *ret = gc_alloc(sizeof(lval), GC_VAL);
+  *ret = (lval){.type = LTYPE_DBL, .refs = 1, .dbl = val};
+  return ret;
+}
+
+/* The elements are left uninitialized. Returns an error rather than a
+ * vector when len doubles cannot be had. */
+static lval *lval_nvec(size_t len) {
+  double *data = 0;
+  if (len <= SIZE_MAX / sizeof(double)) {
+    data = malloc(sizeof(double) * (len ? len : 1));
+  }
+  if (!data) {
+    return lval_err("Cannot allocate a vector of %zu numbers", len);
+  }
+  lval *ret = gc_alloc(sizeof(lval), GC_VAL);
+  *ret = (lval){.type = LTYPE_NVEC, .refs = 1, .len = len, .data = data};
+  return ret;
+}
+
+static lvbuf *lvbuf_new(size_t cap) {
+  lvbuf *b = malloc(sizeof(*b));
+  *b = (lvbuf){.refs = 1, .cap = cap, .items = malloc(sizeof(lval *) * cap)};
+  return b;
+}
+
+static void lvbuf_release(lvbuf *b) {
+  if (--b->refs == 0) {
+    for (size_t i = 0; i < b->len; i++) {
+      lval_delete(b->items[i]);
+    }
+    free(b->items);
+    free(b);
+  }
+}
+
+/* Takes a reference to b. */
+static lval *lval_vec(lvbuf *b, size_t off, size_t len) {
+  lval *ret = gc_alloc(sizeof(lval), GC_VAL);
+  *ret = (lval){
+      .type = LTYPE_VEC, .refs = 1, .vbuf = b, .voff = off, .vlen = len};
+  return ret;
+}
+
+static lsbuf *lsbuf_new(size_t cap) {
+  lsbuf *b = malloc(sizeof(*b));
+  *b = (lsbuf){.refs = 1, .cap = cap, .data = malloc(cap ? cap : 1)};
+  return b;
+}
+
+static void lsbuf_release(lsbuf *b) {
+  if (--b->refs == 0) {
+    free(b->data);
+    free(b);
+  }
+}
+
+/* Takes a reference to b. */
+static lval *lval_sview(ltype t, lsbuf *b, size_t off, size_t len) {
+  lval *ret = gc_alloc(sizeof(lval), GC_VAL);
+  *ret = (lval){.type = t, .refs = 1, .sbuf = b, .soff = off, .slen = len};
   return ret;
 }
 
+static lval *lval_str(char *s, size_t len) {
+  lsbuf *b = lsbuf_new(len);
+  memcpy(b->data, s, len);
+  b->len = len;
+  return lval_sview(LTYPE_STR, b, 0, len);
+}
+
+static char *lval_sdata(lval *v) { return v->sbuf->data + v->soff; }
+
 static lval *lval_err(char *fmt, ...) {
-  lval *ret = malloc(sizeof(lval));
+  lval *ret = gc_alloc(sizeof(lval), GC_VAL);
   char err[512] = {0};
   va_list va = {0};
 
@@ -113,77 +649,105 @@ static lval *lval_err(char *fmt, ...) {
   vsnprintf(err, sizeof(err) - 1, fmt, va);
   va_end(va);
 
-  *ret = (lval){.type = LTYPE_ERR, .err = strdup(err)};
+  *ret = (lval){.type = LTYPE_ERR, .refs = 1, .err = strdup(err)};
 
   return ret;
 }
 
 static lval *lval_sym(char *sym) {
-  lval *ret = malloc(sizeof(lval));
-  *ret = (lval){.type = LTYPE_SYM, .sym = strdup(sym)};
+  lval *ret = gc_alloc(sizeof(lval), GC_VAL);
+  *ret = (lval){
+      .type = LTYPE_SYM, .refs = 1, .sym = lsym_intern(sym), .depth = -1};
   return ret;
 }
 
 static lval *lval_sexp() {
-  lval *ret = malloc(sizeof(lval));
-  *ret = (lval){.type = LTYPE_SEXP};
+  lval *ret = gc_alloc(sizeof(lval), GC_VAL);
+  *ret = (lval){.type = LTYPE_SEXP, .refs = 1};
   return ret;
 }
 
 static lval *lval_qexp() {
-  lval *ret = malloc(sizeof(lval));
-  *ret = (lval){.type = LTYPE_QEXP};
+  lval *ret = gc_alloc(sizeof(lval), GC_VAL);
+  *ret = (lval){.type = LTYPE_QEXP, .refs = 1};
   return ret;
 }
 
 static lval *lval_fun(lbuiltin fun) {
-  lval *ret = malloc(sizeof(lval));
-  *ret = (lval){.type = LTYPE_FUN, .builtin = fun};
+  lval *ret = gc_alloc(sizeof(lval), GC_VAL);
+  *ret = (lval){.type = LTYPE_FUN, .refs = 1, .builtin = fun};
   return ret;
 }
 
 static lval *lval_lambda(lval *formals, lval *body) {
-  lval *ret = malloc(sizeof(lval));
+  lval *ret = gc_alloc(sizeof(lval), GC_VAL);
   *ret = (lval){
       .type = LTYPE_FUN,
-      .env = lenv_new(),
+      .refs = 1,
       .formals = formals,
       .body = body,
   };
   return ret;
 }
 
+static lval *lval_partial(lval *target, lval *bound) {
+  lval *ret = gc_alloc(sizeof(lval), GC_VAL);
+  *ret = (lval){
+      .type = LTYPE_FUN,
+      .refs = 1,
+      .target = lval_ref(target),
+      .bound = bound,
+  };
+  ret->bound->type = LTYPE_QEXP;
+  return ret;
+}
+
 static void lval_delete(lval *val) {
-  if (val) {
+  if (val && !lval_is_fix(val) && --val->refs == 0) {
     switch (val->type) {
     case LTYPE_ERR:
       free(val->err);
       break;
-    case LTYPE_SYM:
-      free(val->sym);
+    case LTYPE_NVEC:
+      free(val->data);
+      break;
+    case LTYPE_BIG:
+      free(val->big.d);
+      break;
+    case LTYPE_VEC:
+      lvbuf_release(val->vbuf);
+      break;
+    case LTYPE_MAP:
+      lhamt_release(val->hamt);
+      break;
+    case LTYPE_STR:
+    case LTYPE_BYTES:
+      lsbuf_release(val->sbuf);
       break;
     case LTYPE_SEXP:
     case LTYPE_QEXP:
       for (size_t i = 0; i < val->count; i++) {
         lval_delete(val->cell[i]);
       }
-      free(val->cell);
+      free(val->mem);
       break;
     case LTYPE_FUN:
-      if (val->env) {
-        lenv_delete(val->env);
-      }
       if (val->formals) {
         lval_delete(val->formals);
       }
       if (val->body) {
         lval_delete(val->body);
       }
+      if (val->target) {
+        lval_delete(val->target);
+        lval_delete(val->bound);
+      }
+      lcode_release(val->code);
       break;
     default:
       break;
     }
-    free(val);
+    gc_free(val);
   }
 }
 
@@ -202,148 +766,2047 @@ static void lval_delete(lval *val) {
   LASSERT(args, args->cell[i]->count > 0, "%s got empty list at %zu", fn, i)
 
 #define LASSERT_TYPE(fn, args, i, expected_type)                               \
-  LASSERT(args, args->cell[i]->type == expected_type,                          \
+  LASSERT(args, lval_type(args->cell[i]) == expected_type,                     \
           "'%s' expected %s, got %s at index %zu", fn,                         \
-          ltype_name(expected_type), ltype_name(args->cell[i]->type), i)
+          ltype_name(expected_type), ltype_name(lval_type(args->cell[i])), i)
 
-static lval *builtin_op(lenv *e, lval *v, char *op) {
-  if (v->count == 0) {
-    lval_delete(v);
-    return lval_err("No args for %s", op);
+/* Integers that overflow a long are promoted to bignums: a sign and a
+ * little-endian magnitude of 32-bit limbs with no leading zero limbs, so
+ * zero has len 0. Results that fit a long again are demoted by lval_big. */
+#define LBIG_BASE ((uint64_t)1 << 32)
+
+/* Operands of at least this many limbs are multiplied by Karatsuba's
+ * method instead of the schoolbook loop. */
+#define LBIG_KARATSUBA 32
+
+static size_t lbig_trim(const uint32_t *d, size_t n) {
+  while (n > 0 && d[n - 1] == 0) {
+    n--;
   }
+  return n;
+}
 
-  for (size_t i = 0; i < v->count; i++) {
-    LASSERT_TYPE(op, v, i, LTYPE_NUM);
+static int lbig_cmp_mag(const uint32_t *a, size_t an, const uint32_t *b,
+                        size_t bn) {
+  if (an != bn) {
+    return an < bn ? -1 : 1;
   }
+  for (size_t i = an; i-- > 0;) {
+    if (a[i] != b[i]) {
+      return a[i] < b[i] ? -1 : 1;
+    }
+  }
+  return 0;
+}
 
-  lval *x = lval_pop(v, 0);
+/* r[0..rn) += a[0..an) with an <= rn, returning the carry out of r. */
+static uint32_t lbig_addto(uint32_t *r, size_t rn, const uint32_t *a,
+                           size_t an) {
+  uint64_t carry = 0;
+  for (size_t i = 0; i < rn && (i < an || carry); i++) {
+    carry += (uint64_t)r[i] + (i < an ? a[i] : 0);
+    r[i] = (uint32_t)carry;
+    carry >>= 32;
+  }
+  return (uint32_t)carry;
+}
 
-  if (streq(op, "-") && v->count == 0) {
-    x->num = -x->num;
+/* r[0..rn) -= a[0..an) with an <= rn, returning the borrow out of r. */
+static uint32_t lbig_subfrom(uint32_t *r, size_t rn, const uint32_t *a,
+                             size_t an) {
+  uint32_t borrow = 0;
+  for (size_t i = 0; i < rn && (i < an || borrow); i++) {
+    uint64_t x = (uint64_t)(i < an ? a[i] : 0) + borrow;
+    borrow = r[i] < x;
+    r[i] = (uint32_t)(r[i] - x);
   }
+  return borrow;
+}
 
-  while (v->count > 0) {
-    lval *y = lval_pop(v, 0);
-
-    if (streq(op, "+")) {
-      x->num += y->num;
-    } else if (streq(op, "-")) {
-      x->num -= y->num;
-    } else if (streq(op, "*")) {
-      x->num *= y->num;
-    } else if (streq(op, "/")) {
-      if (y->num == 0) {
-        lval_delete(y);
-        lval_delete(x);
-        lval_delete(v);
-        return lval_err("Division by zero: %ld/%ld", x->num, y->num);
+/* r[0..an+bn) = a * b, where r does not overlap a or b. */
+static void lbig_mul_mag(uint32_t *r, const uint32_t *a, size_t an,
+                         const uint32_t *b, size_t bn) {
+  if (an < bn) {
+    const uint32_t *t = a;
+    a = b;
+    b = t;
+    size_t tn = an;
+    an = bn;
+    bn = tn;
+  }
+  memset(r, 0, sizeof(*r) * (an + bn));
+  if (bn < LBIG_KARATSUBA) {
+    for (size_t i = 0; i < bn; i++) {
+      uint64_t carry = 0;
+      for (size_t j = 0; j < an; j++) {
+        carry += (uint64_t)b[i] * a[j] + r[i + j];
+        r[i + j] = (uint32_t)carry;
+        carry >>= 32;
       }
-      x->num /= y->num;
+      r[i + an] = (uint32_t)carry;
+    }
+    return;
+  }
+
+  size_t m = (an + 1) / 2;
+  if (bn <= m) {
+    /* Too unbalanced to split both at m: multiply b by bn-limb slices of
+     * a instead. */
+    uint32_t *t = malloc(sizeof(*t) * 2 * bn);
+    for (size_t i = 0; i < an; i += bn) {
+      size_t n = an - i < bn ? an - i : bn;
+      lbig_mul_mag(t, a + i, n, b, bn);
+      lbig_addto(r + i, an + bn - i, t, n + bn);
     }
+    free(t);
+    return;
   }
 
-  lval_delete(v);
-  return x;
+  /* With a = a1 B^m + a0 and b = b1 B^m + b0, a b is
+   * z2 B^2m + (z1 - z2 - z0) B^m + z0 where z0 = a0 b0, z2 = a1 b1 and
+   * z1 = (a0 + a1)(b0 + b1). */
+  size_t a1n = an - m, b1n = bn - m;
+  lbig_mul_mag(r, a, m, b, m);
+  lbig_mul_mag(r + 2 * m, a + m, a1n, b + m, b1n);
+
+  uint32_t *sa = malloc(sizeof(*sa) * (m + 1));
+  uint32_t *sb = malloc(sizeof(*sb) * (m + 1));
+  memcpy(sa, a, sizeof(*sa) * m);
+  memcpy(sb, b, sizeof(*sb) * m);
+  sa[m] = lbig_addto(sa, m, a + m, a1n);
+  sb[m] = lbig_addto(sb, m, b + m, b1n);
+
+  size_t zn = 2 * (m + 1);
+  uint32_t *z1 = malloc(sizeof(*z1) * zn);
+  lbig_mul_mag(z1, sa, m + 1, sb, m + 1);
+  lbig_subfrom(z1, zn, r, 2 * m);
+  lbig_subfrom(z1, zn, r + 2 * m, a1n + b1n);
+  lbig_addto(r + m, an + bn - m, z1, lbig_trim(z1, zn));
+  free(sa);
+  free(sb);
+  free(z1);
 }
 
-static lval *builtin_add(lenv *e, lval *v) { return builtin_op(e, v, "+"); }
-static lval *builtin_sub(lenv *e, lval *v) { return builtin_op(e, v, "-"); }
-static lval *builtin_mul(lenv *e, lval *v) { return builtin_op(e, v, "*"); }
-static lval *builtin_div(lenv *e, lval *v) { return builtin_op(e, v, "/"); }
+/* Divides a[0..an) in place by a single limb, returning the remainder. */
+static uint32_t lbig_divmod_limb(uint32_t *a, size_t an, uint32_t d) {
+  uint64_t rem = 0;
+  for (size_t i = an; i-- > 0;) {
+    uint64_t cur = rem << 32 | a[i];
+    a[i] = (uint32_t)(cur / d);
+    rem = cur % d;
+  }
+  return (uint32_t)rem;
+}
 
-static lval *builtin_head(lenv *e, lval *v) {
-  LASSERT_NUM("head", v, 1);
-  LASSERT_TYPE("head", v, 0, LTYPE_QEXP);
-  LASSERT_NEMPTY("head", v, 0);
-  lval *x = lval_take(v, 0);
-  while (x->count > 1) {
-    lval_delete(lval_pop(x, 1));
+/* Knuth's algorithm D: q[0..un-vn] = u / v, for un >= vn >= 2. */
+static void lbig_div_mag(uint32_t *q, const uint32_t *u, size_t un,
+                         const uint32_t *v, size_t vn) {
+  int s = __builtin_clz(v[vn - 1]);
+  uint32_t *nv = malloc(sizeof(*nv) * vn);
+  uint32_t *nu = malloc(sizeof(*nu) * (un + 1));
+  for (size_t i = vn - 1; i > 0; i--) {
+    nv[i] = v[i] << s | (s ? v[i - 1] >> (32 - s) : 0);
   }
-  return x;
+  nv[0] = v[0] << s;
+  nu[un] = s ? u[un - 1] >> (32 - s) : 0;
+  for (size_t i = un - 1; i > 0; i--) {
+    nu[i] = u[i] << s | (s ? u[i - 1] >> (32 - s) : 0);
+  }
+  nu[0] = u[0] << s;
+
+  for (size_t j = un - vn + 1; j-- > 0;) {
+    uint64_t num = (uint64_t)nu[j + vn] << 32 | nu[j + vn - 1];
+    uint64_t qhat = num / nv[vn - 1];
+    uint64_t rhat = num % nv[vn - 1];
+    while (qhat >= LBIG_BASE ||
+           qhat * nv[vn - 2] > (rhat << 32 | nu[j + vn - 2])) {
+      qhat--;
+      rhat += nv[vn - 1];
+      if (rhat >= LBIG_BASE) {
+        break;
+      }
+    }
+
+    int64_t borrow = 0, t;
+    for (size_t i = 0; i < vn; i++) {
+      uint64_t p = qhat * nv[i];
+      t = (int64_t)nu[i + j] - borrow - (int64_t)(p & 0xffffffff);
+      nu[i + j] = (uint32_t)t;
+      borrow = (int64_t)(p >> 32) - (t >> 32);
+    }
+    t = (int64_t)nu[j + vn] - borrow;
+    nu[j + vn] = (uint32_t)t;
+
+    q[j] = (uint32_t)qhat;
+    if (t < 0) {
+      q[j]--;
+      uint64_t carry = 0;
+      for (size_t i = 0; i < vn; i++) {
+        carry += (uint64_t)nu[i + j] + nv[i];
+        nu[i + j] = (uint32_t)carry;
+        carry >>= 32;
+      }
+      nu[j + vn] += (uint32_t)carry;
+    }
+  }
+  free(nv);
+  free(nu);
 }
 
-static lval *builtin_tail(lenv *e, lval *v) {
-  LASSERT_NUM("tail", v, 1);
-  LASSERT_TYPE("tail", v, 0, LTYPE_QEXP);
-  LASSERT_NEMPTY("tail", v, 0);
-  lval *x = lval_take(v, 0);
-  lval_delete(lval_pop(x, 0));
-  return x;
+static lbig lbig_alloc(size_t len) {
+  return (lbig){.len = len, .d = calloc(len ? len : 1, sizeof(uint32_t))};
 }
 
-static lval *builtin_list(lenv *e, lval *v) {
-  v->type = LTYPE_QEXP;
-  return v;
+static lbig lbig_from_long(long x) {
+  unsigned long m = x < 0 ? -(unsigned long)x : (unsigned long)x;
+  lbig r = lbig_alloc(2);
+  r.neg = x < 0;
+  r.d[0] = (uint32_t)m;
+  r.d[1] = (uint32_t)(m >> 32);
+  r.len = lbig_trim(r.d, 2);
+  return r;
 }
 
-static lval *builtin_eval(lenv *e, lval *v) {
-  LASSERT_NUM("eval", v, 1);
-  LASSERT_TYPE("eval", v, 0, LTYPE_QEXP);
-  lval *x = lval_take(v, 0);
-  x->type = LTYPE_SEXP;
-  return lval_eval(e, x);
+static lbig lbig_add(lbig *a, lbig *b, bool negate_b) {
+  bool bneg = b->neg != negate_b;
+  if (a->neg == bneg) {
+    size_t n = a->len > b->len ? a->len : b->len;
+    lbig r = lbig_alloc(n + 1);
+    r.neg = a->neg;
+    memcpy(r.d, a->d, sizeof(*r.d) * a->len);
+    lbig_addto(r.d, n + 1, b->d, b->len);
+    r.len = lbig_trim(r.d, n + 1);
+    return r;
+  }
+  bool swap = lbig_cmp_mag(a->d, a->len, b->d, b->len) < 0;
+  lbig *x = swap ? b : a, *y = swap ? a : b;
+  lbig r = lbig_alloc(x->len);
+  r.neg = swap ? bneg : a->neg;
+  memcpy(r.d, x->d, sizeof(*r.d) * x->len);
+  lbig_subfrom(r.d, x->len, y->d, y->len);
+  r.len = lbig_trim(r.d, x->len);
+  return r;
 }
 
-static lval *lval_join(lval *x, lval *y) {
-  while (y->count > 0) {
-    x = lval_add(x, lval_pop(y, 0));
+static lbig lbig_mul(lbig *a, lbig *b) {
+  if (a->len == 0 || b->len == 0) {
+    return lbig_alloc(0);
   }
-  lval_delete(y);
-  return x;
+  lbig r = lbig_alloc(a->len + b->len);
+  r.neg = a->neg != b->neg;
+  lbig_mul_mag(r.d, a->d, a->len, b->d, b->len);
+  r.len = lbig_trim(r.d, a->len + b->len);
+  return r;
 }
 
-static lval *lval_call(lenv *e, lval *f, lval *a) {
-  if (f->builtin) {
-    return f->builtin(e, a);
+/* Truncating division, as for long; b must be non-zero. */
+static lbig lbig_div(lbig *a, lbig *b) {
+  if (lbig_cmp_mag(a->d, a->len, b->d, b->len) < 0) {
+    return lbig_alloc(0);
   }
-  for (size_t i = 0; i < f->formals->count; i++) {
-    lenv_put(f->env, f->formals->cell[i], a->cell[i]);
+  lbig r = lbig_alloc(a->len - b->len + 1);
+  r.neg = a->neg != b->neg;
+  if (b->len == 1) {
+    memcpy(r.d, a->d, sizeof(*r.d) * a->len);
+    lbig_divmod_limb(r.d, a->len, b->d[0]);
+  } else {
+    lbig_div_mag(r.d, a->d, a->len, b->d, b->len);
   }
-  lval_delete(a);
-  f->env->par = e;
-  return builtin_eval(f->env, lval_add(lval_sexp(), lval_copy(f->body)));
+  r.len = lbig_trim(r.d, a->len - b->len + 1);
+  return r;
 }
 
-static lval *builtin_join(lenv *e, lval *v) {
-  for (size_t i = 0; i < v->count; i++) {
-    LASSERT_TYPE("join", v, i, LTYPE_QEXP);
+static int lbig_cmp(lbig *a, lbig *b) {
+  if (a->neg != b->neg) {
+    return a->neg ? -1 : 1;
   }
-  lval *x = lval_pop(v, 0);
-  while (v->count > 0) {
-    x = lval_join(x, lval_pop(v, 0));
+  int c = lbig_cmp_mag(a->d, a->len, b->d, b->len);
+  return a->neg ? -c : c;
+}
+
+/* Converts a finite double holding an integer, from its IEEE 754 bits. */
+static lbig lbig_from_double(double x) {
+  uint64_t bits;
+  memcpy(&bits, &x, sizeof(bits));
+  int exp = (int)(bits >> 52 & 0x7ff) - 1075;
+  uint64_t m = (bits & ((1ULL << 52) - 1)) | 1ULL << 52;
+  if (x == 0) {
+    return lbig_alloc(0);
   }
-  lval_delete(v);
-  return x;
+  if (exp < 0) {
+    m >>= -exp;
+    exp = 0;
+  }
+  size_t w = exp / 32;
+  lbig r = lbig_alloc(w + 3);
+  r.neg = x < 0;
+  uint64_t lo = (m & 0xffffffff) << exp % 32, hi = (m >> 32) << exp % 32;
+  r.d[w] = (uint32_t)lo;
+  hi += lo >> 32;
+  r.d[w + 1] = (uint32_t)hi;
+  r.d[w + 2] = (uint32_t)(hi >> 32);
+  r.len = lbig_trim(r.d, w + 3);
+  return r;
 }
 
-static lval *builtin_var(lenv *e, lval *v, char *fn) {
-  LASSERT(v, v->count > 0, "no args for '%s'", fn);
-  LASSERT_TYPE(fn, v, 0, LTYPE_QEXP);
-  lval *symlist = v->cell[0];
-  for (size_t i = 0; i < symlist->count; i++) {
-    LASSERT(v, symlist->cell[i]->type == LTYPE_SYM,
-            "first '%s' arg must be a list of symbols, got %s at %zu", fn,
-            ltype_name(symlist->cell[i]->type), i);
+static double lbig_to_double(lbig *a) {
+  double x = 0;
+  for (size_t i = a->len; i-- > 0;) {
+    x = x * (double)LBIG_BASE + a->d[i];
   }
-  LASSERT(v, symlist->count == v->count - 1,
-          "'%s' expected exactly %zu values, got %zu", symlist->count, fn,
-          v->count - 1);
-  for (size_t i = 0; i < symlist->count; i++) {
-    if (streq(fn, "def")) {
-      lenv_def(e, symlist->cell[i], v->cell[i + 1]);
-    } else if (streq(fn, "=")) {
-      lenv_put(e, symlist->cell[i], v->cell[i + 1]);
-    } else {
-      exit(1);
+  return a->neg ? -x : x;
+}
+
+/* Parses an optionally signed string of decimal digits. */
+static lbig lbig_parse(char *s) {
+  bool neg = *s == '-';
+  s += neg;
+  size_t digits = strlen(s);
+  lbig r = lbig_alloc(digits / 9 + 1);
+  r.len = 0;
+  while (*s) {
+    uint32_t chunk = 0, scale = 1;
+    for (int i = 0; i < 9 && *s; i++, s++) {
+      chunk = chunk * 10 + (*s - '0');
+      scale *= 10;
+    }
+    uint64_t carry = chunk;
+    for (size_t i = 0; i < r.len; i++) {
+      carry += (uint64_t)r.d[i] * scale;
+      r.d[i] = (uint32_t)carry;
+      carry >>= 32;
+    }
+    if (carry) {
+      r.d[r.len++] = (uint32_t)carry;
     }
   }
-  lval_delete(v);
-  return lval_sexp();
+  r.neg = neg && r.len > 0;
+  return r;
 }
 
-static lval *builtin_def(lenv *e, lval *v) { return builtin_var(e, v, "def"); }
-
-static lval *builtin_put(lenv *e, lval *v) { return builtin_var(e, v, "="); }
+static void lbig_print(lbig *a) {
+  uint32_t *t = malloc(sizeof(*t) * (a->len ? a->len : 1));
+  memcpy(t, a->d, sizeof(*t) * a->len);
+  size_t n = a->len;
+  uint32_t *chunks = malloc(sizeof(*chunks) * (a->len * 10 / 9 + 2));
+  size_t nchunks = 0;
+  do {
+    chunks[nchunks++] = lbig_divmod_limb(t, n, 1000000000);
+    n = lbig_trim(t, n);
+  } while (n > 0);
+  printf("%s%u", a->neg ? "-" : "", chunks[nchunks - 1]);
+  for (size_t i = nchunks - 1; i-- > 0;) {
+    printf("%09u", chunks[i]);
+  }
+  free(chunks);
+  free(t);
+}
+
+/* Takes ownership of a. */
+static lval *lval_big(lbig a) {
+  if (a.len <= 2) {
+    uint64_t m = a.len > 0 ? a.d[0] : 0;
+    if (a.len == 2) {
+      m |= (uint64_t)a.d[1] << 32;
+    }
+    if (m <= (uint64_t)LONG_MAX || (a.neg && m == (uint64_t)LONG_MAX + 1)) {
+      free(a.d);
+      return lval_num(a.neg ? (long)(0 - m) : (long)m);
+    }
+  }
+  lval *ret = gc_alloc(sizeof(lval), GC_VAL);
+  *ret = (lval){.type = LTYPE_BIG, .refs = 1, .big = a};
+  return ret;
+}
+
+/* Returns a bignum copy of the integer v. */
+static lbig lval_bigval(lval *v) {
+  if (lval_type(v) == LTYPE_NUM) {
+    return lbig_from_long(lval_numval(v));
+  }
+  lbig r = lbig_alloc(v->big.len);
+  r.neg = v->big.neg;
+  memcpy(r.d, v->big.d, sizeof(*r.d) * v->big.len);
+  return r;
+}
+
+enum larith {
+  LARITH_ADD,
+  LARITH_SUB,
+  LARITH_MUL,
+  LARITH_DIV,
+};
+
+static char *larith_names[] = {
+    [LARITH_ADD] = "+",
+    [LARITH_SUB] = "-",
+    [LARITH_MUL] = "*",
+    [LARITH_DIV] = "/",
+};
+
+/* Operands are summed LARITH_BLOCK at a time. */
+#define LARITH_BLOCK 4096
+
+/* The n-ary folds read operands straight from the cell array, and return
+ * false if the result overflows a long. The sum has no branch per element:
+ * the high and low 32 bits of each operand go into separate 64-bit
+ * accumulators, which cannot overflow within a block, so the loop over
+ * immediates vectorises. Blocks are combined in 128 bits and the total is
+ * checked once. */
+static bool larith_sum(lval **cell, size_t n, bool fix, long *acc) {
+  __int128 total = 0;
+  for (size_t i = 0; i < n; i += LARITH_BLOCK) {
+    size_t end = n - i < LARITH_BLOCK ? n : i + LARITH_BLOCK;
+    int64_t hi = 0;
+    uint64_t lo = 0;
+    if (fix) {
+      for (size_t j = i; j < end; j++) {
+        int64_t x = (intptr_t)cell[j] >> 1;
+        hi += x >> 32;
+        lo += (uint32_t)x;
+      }
+    } else {
+      for (size_t j = i; j < end; j++) {
+        int64_t x = lval_numval(cell[j]);
+        hi += x >> 32;
+        lo += (uint32_t)x;
+      }
+    }
+    total += (__int128)hi * (int64_t)LBIG_BASE + lo;
+  }
+  if (total < LONG_MIN || total > LONG_MAX) {
+    return false;
+  }
+  *acc = (long)total;
+  return true;
+}
+
+/* Subtraction is checked a step at a time, since the sum of the operands
+ * can overflow where the running difference does not. */
+static bool larith_difference(lval **cell, size_t n, bool fix, long *acc) {
+  for (size_t i = 0; i < n; i++) {
+    long x = fix ? (intptr_t)cell[i] >> 1 : lval_numval(cell[i]);
+    if (__builtin_sub_overflow(*acc, x, acc)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool larith_product(lval **cell, size_t n, bool fix, long *acc) {
+  *acc = 1;
+  for (size_t i = 0; i < n; i++) {
+    long x = fix ? (intptr_t)cell[i] >> 1 : lval_numval(cell[i]);
+    if (__builtin_mul_overflow(*acc, x, acc)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static lval *larith_big(lval *v, enum larith op) {
+  lbig x = lval_bigval(v->cell[0]);
+  if (v->count == 1 && op == LARITH_SUB) {
+    x.neg = !x.neg && x.len > 0;
+  }
+  for (size_t i = 1; i < v->count; i++) {
+    lbig y = lval_bigval(v->cell[i]);
+    lbig r;
+    switch (op) {
+    case LARITH_ADD:
+      r = lbig_add(&x, &y, false);
+      break;
+    case LARITH_SUB:
+      r = lbig_add(&x, &y, true);
+      break;
+    case LARITH_MUL:
+      r = lbig_mul(&x, &y);
+      break;
+    case LARITH_DIV:
+      if (y.len == 0) {
+        free(x.d);
+        free(y.d);
+        lval_delete(v);
+        return lval_err("Division by zero");
+      }
+      r = lbig_div(&x, &y);
+      break;
+    }
+    free(x.d);
+    free(y.d);
+    x = r;
+  }
+  lval_delete(v);
+  return lval_big(x);
+}
+
+/* Integer arithmetic stays on longs until a step overflows, and then
+ * starts over with bignums. */
+static lval *larith_long(lval *v, enum larith op, bool fix) {
+  long x = lval_numval(v->cell[0]);
+  lval **rest = v->cell + 1;
+  size_t n = v->count - 1;
+  long y;
+  bool ok = true;
+
+  switch (op) {
+  case LARITH_ADD:
+    ok = larith_sum(rest, n, fix, &y) && !__builtin_add_overflow(x, y, &x);
+    break;
+  case LARITH_SUB:
+    if (n == 0) {
+      ok = !__builtin_sub_overflow(0, x, &x);
+    } else {
+      ok = larith_difference(rest, n, fix, &x);
+    }
+    break;
+  case LARITH_MUL:
+    ok = larith_product(rest, n, fix, &y) && !__builtin_mul_overflow(x, y, &x);
+    break;
+  case LARITH_DIV:
+    for (size_t i = 0; i < n; i++) {
+      long d = lval_numval(rest[i]);
+      if (d == 0) {
+        lval_delete(v);
+        return lval_err("Division by zero: %ld/%ld", x, d);
+      }
+      if (x == LONG_MIN && d == -1) {
+        ok = false;
+        break;
+      }
+      x /= d;
+    }
+    break;
+  }
+
+  if (!ok) {
+    return larith_big(v, op);
+  }
+  lval_delete(v);
+  return lval_num(x);
+}
+
+static double lval_dblval(lval *v) {
+  switch (lval_type(v)) {
+  case LTYPE_DBL:
+    return v->dbl;
+  case LTYPE_BIG:
+    return lbig_to_double(&v->big);
+  default:
+    return (double)lval_numval(v);
+  }
+}
+
+static double larith_apply(enum larith op, double x, double y) {
+  switch (op) {
+  case LARITH_ADD:
+    return x + y;
+  case LARITH_SUB:
+    return x - y;
+  case LARITH_MUL:
+    return x * y;
+  case LARITH_DIV:
+    return x / y;
+  }
+  return 0;
+}
+
+/* Float arithmetic follows IEEE 754, so division by zero gives an
+ * infinity rather than an error. */
+static lval *larith_double(lval *v, enum larith op) {
+  double x = lval_dblval(v->cell[0]);
+  if (v->count == 1 && op == LARITH_SUB) {
+    x = -x;
+  }
+  for (size_t i = 1; i < v->count; i++) {
+    x = larith_apply(op, x, lval_dblval(v->cell[i]));
+  }
+  lval_delete(v);
+  return lval_dbl(x);
+}
+
+/* Element-wise kernels over numeric vectors. An operand flagged as scalar
+ * is a single value broadcast to every element. Each kernel set is
+ * compiled once for the baseline target, which is SSE2 on x86-64, and once
+ * more with AVX2 where the compiler can target it; lvec_init picks a set at
+ * startup. */
+typedef double lvec4 __attribute__((vector_size(4 * sizeof(double))));
+
+#define LVEC_KERNELS(isa, attr)                                                \
+  attr static void lvec_map_##isa(enum larith op, double *out,                 \
+                                  const double *a, bool as, const double *b,   \
+                                  bool bs, size_t n) {                         \
+    if (n == 0) {                                                              \
+      return;                                                                  \
+    }                                                                          \
+    lvec4 sa = {a[0], a[0], a[0], a[0]};                                       \
+    lvec4 sb = {b[0], b[0], b[0], b[0]};                                       \
+    size_t i = 0;                                                              \
+    for (; i + 4 <= n; i += 4) {                                               \
+      lvec4 x = sa, y = sb;                                                    \
+      if (!as) {                                                               \
+        memcpy(&x, a + i, sizeof(x));                                          \
+      }                                                                        \
+      if (!bs) {                                                               \
+        memcpy(&y, b + i, sizeof(y));                                          \
+      }                                                                        \
+      switch (op) {                                                            \
+      case LARITH_ADD:                                                         \
+        x += y;                                                                \
+        break;                                                                 \
+      case LARITH_SUB:                                                         \
+        x -= y;                                                                \
+        break;                                                                 \
+      case LARITH_MUL:                                                         \
+        x *= y;                                                                \
+        break;                                                                 \
+      case LARITH_DIV:                                                         \
+        x /= y;                                                                \
+        break;                                                                 \
+      }                                                                        \
+      memcpy(out + i, &x, sizeof(x));                                          \
+    }                                                                          \
+    for (; i < n; i++) {                                                       \
+      out[i] = larith_apply(op, a[as ? 0 : i], b[bs ? 0 : i]);                 \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  attr static double lvec_dot_##isa(const double *a, const double *b,          \
+                                    bool bs, size_t n) {                       \
+    if (n == 0) {                                                              \
+      return 0;                                                                \
+    }                                                                          \
+    lvec4 acc = {0}, sb = {b[0], b[0], b[0], b[0]};                            \
+    size_t i = 0;                                                              \
+    for (; i + 4 <= n; i += 4) {                                               \
+      lvec4 x, y = sb;                                                         \
+      memcpy(&x, a + i, sizeof(x));                                            \
+      if (!bs) {                                                               \
+        memcpy(&y, b + i, sizeof(y));                                          \
+      }                                                                        \
+      acc += x * y;                                                            \
+    }                                                                          \
+    double r = (acc[0] + acc[1]) + (acc[2] + acc[3]);                          \
+    for (; i < n; i++) {                                                       \
+      r += a[i] * b[bs ? 0 : i];                                               \
+    }                                                                          \
+    return r;                                                                  \
+  }
+
+LVEC_KERNELS(base, )
+#if defined(__x86_64__) || defined(__i386__)
+LVEC_KERNELS(avx2, __attribute__((target("avx2"))))
+#endif
+
+static struct {
+  void (*map)(enum larith, double *, const double *, bool, const double *,
+              bool, size_t);
+  double (*dot)(const double *, const double *, bool, size_t);
+} lvec = {lvec_map_base, lvec_dot_base};
+
+static void lvec_init() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    lvec.map = lvec_map_avx2;
+    lvec.dot = lvec_dot_avx2;
+  }
+#endif
+}
+
+/* Scalar operands are broadcast against the vectors, which must all have
+ * the same length. */
+static lval *larith_vector(lval *v, enum larith op) {
+  size_t n = 0;
+  for (size_t i = 0, first = 1; i < v->count; i++) {
+    lval *x = v->cell[i];
+    if (lval_type(x) != LTYPE_NVEC) {
+      continue;
+    }
+    LASSERT(v, first || x->len == n,
+            "'%s' vectors differ in length: %zu and %zu", larith_names[op], n,
+            x->len);
+    n = x->len;
+    first = 0;
+  }
+
+  lval *r = lval_nvec(n);
+  if (lval_type(r) == LTYPE_ERR) {
+    lval_delete(v);
+    return r;
+  }
+  if (v->count == 1) {
+    if (op != LARITH_SUB) {
+      lval_delete(r);
+      return lval_take(v, 0);
+    }
+    double zero = 0;
+    lvec.map(op, r->data, &zero, true, v->cell[0]->data, false, n);
+    lval_delete(v);
+    return r;
+  }
+
+  double x, y;
+  lval *first = v->cell[0];
+  bool xs = lval_type(first) != LTYPE_NVEC;
+  const double *a = xs ? (x = lval_dblval(first), &x) : first->data;
+  for (size_t i = 1; i < v->count; i++) {
+    lval *next = v->cell[i];
+    bool ys = lval_type(next) != LTYPE_NVEC;
+    const double *b = ys ? (y = lval_dblval(next), &y) : next->data;
+    lvec.map(op, r->data, a, xs, b, ys, n);
+    a = r->data;
+    xs = false;
+  }
+  lval_delete(v);
+  return r;
+}
+
+/* Operands are promoted to the widest kind among them: integers, then
+ * bignums, then floats, then numeric vectors. Returns -1 for non-numbers. */
+static int larith_rank(ltype t) {
+  switch (t) {
+  case LTYPE_NUM:
+    return 0;
+  case LTYPE_BIG:
+    return 1;
+  case LTYPE_DBL:
+    return 2;
+  case LTYPE_NVEC:
+    return 3;
+  default:
+    return -1;
+  }
+}
+
+static lval *builtin_op(lenv *e, lval *v, enum larith op) {
+  char *name = larith_names[op];
+  if (v->count == 0) {
+    lval_delete(v);
+    return lval_err("No args for %s", name);
+  }
+
+  bool fix = true;
+  ltype kind = LTYPE_NUM;
+  for (size_t i = 0; i < v->count; i++) {
+    ltype t = lval_type(v->cell[i]);
+    LASSERT(v, larith_rank(t) >= 0,
+            "'%s' expected Number, got %s at index %zu", name, ltype_name(t),
+            i);
+    if (larith_rank(t) > larith_rank(kind)) {
+      kind = t;
+    }
+    fix = fix && lval_is_fix(v->cell[i]);
+  }
+
+  switch (kind) {
+  case LTYPE_NVEC:
+    return larith_vector(v, op);
+  case LTYPE_DBL:
+    return larith_double(v, op);
+  case LTYPE_BIG:
+    return larith_big(v, op);
+  default:
+    return larith_long(v, op, fix);
+  }
+}
+
+static lval *builtin_add(lenv *e, lval *v) {
+  return builtin_op(e, v, LARITH_ADD);
+}
+
+static lval *builtin_sub(lenv *e, lval *v) {
+  return builtin_op(e, v, LARITH_SUB);
+}
+
+static lval *builtin_mul(lenv *e, lval *v) {
+  return builtin_op(e, v, LARITH_MUL);
+}
+
+static lval *builtin_div(lenv *e, lval *v) {
+  return builtin_op(e, v, LARITH_DIV);
+}
+
+static lval *builtin_head(lenv *e, lval *v) {
+  LASSERT_NUM("head", v, 1);
+  LASSERT_TYPE("head", v, 0, LTYPE_QEXP);
+  LASSERT_NEMPTY("head", v, 0);
+  lval *x = lval_mut(lval_take(v, 0));
+  while (x->count > 1) {
+    lval_delete(lval_pop(x, x->count - 1));
+  }
+  return x;
+}
+
+static lval *builtin_tail(lenv *e, lval *v) {
+  LASSERT_NUM("tail", v, 1);
+  LASSERT_TYPE("tail", v, 0, LTYPE_QEXP);
+  LASSERT_NEMPTY("tail", v, 0);
+  lval *x = lval_mut(lval_take(v, 0));
+  lval_delete(lval_pop(x, 0));
+  return x;
+}
+
+static lval *builtin_list(lenv *e, lval *v) {
+  v->type = LTYPE_QEXP;
+  return v;
+}
+
+/* eval and if both end by evaluating a Q-Expression, which the VM does in
+ * place when they are called in tail position. These return that
+ * Q-Expression, or an error. */
+static lval *eval_target(lval *v) {
+  LASSERT_NUM("eval", v, 1);
+  LASSERT_TYPE("eval", v, 0, LTYPE_QEXP);
+  return lval_take(v, 0);
+}
+
+static lval *if_target(lval *v) {
+  LASSERT_NUM("if", v, 3);
+  LASSERT_TYPE("if", v, 0, LTYPE_NUM);
+  LASSERT_TYPE("if", v, 1, LTYPE_QEXP);
+  LASSERT_TYPE("if", v, 2, LTYPE_QEXP);
+  return lval_take(v, lval_numval(v->cell[0]) ? 1 : 2);
+}
+
+static lval *lval_eval_qexp(lenv *e, lval *x) {
+  if (lval_type(x) == LTYPE_ERR) {
+    return x;
+  }
+  x = lval_mut(x);
+  x->type = LTYPE_SEXP;
+  return lval_eval(e, x);
+}
+
+static lval *builtin_eval(lenv *e, lval *v) {
+  return lval_eval_qexp(e, eval_target(v));
+}
+
+static lval *builtin_if(lenv *e, lval *v) {
+  return lval_eval_qexp(e, if_target(v));
+}
+
+static bool lval_is_real(lval *v) {
+  ltype t = lval_type(v);
+  return t == LTYPE_NUM || t == LTYPE_BIG || t == LTYPE_DBL;
+}
+
+/* Three-way comparison of the integer x with the finite double d. d is
+ * split at its floor, which is an integer and is compared exactly. */
+static int lval_cmp_int_dbl(lval *x, double d) {
+  double fl = d;
+  if (d > -0x1p63 && d < 0x1p63) {
+    fl = (double)(long)d;
+    fl -= fl > d;
+  }
+  int c;
+  if (lval_type(x) == LTYPE_NUM && fl >= -0x1p63 && fl < 0x1p63) {
+    long a = lval_numval(x), b = (long)fl;
+    c = (a > b) - (a < b);
+  } else {
+    lbig a = lval_bigval(x), b = lbig_from_double(fl);
+    c = lbig_cmp(&a, &b);
+    free(a.d);
+    free(b.d);
+  }
+  if (fl == d) {
+    return c;
+  }
+  return c <= 0 ? -1 : 1;
+}
+
+/* Three-way comparison of two integers or floats. Integers are compared
+ * with each other and with floats exactly, so that == is transitive.
+ * Returns 2 when either is NaN. */
+static int lval_cmp_real(lval *x, lval *y) {
+  ltype tx = lval_type(x), ty = lval_type(y);
+  if (tx == LTYPE_NUM && ty == LTYPE_NUM) {
+    long a = lval_numval(x), b = lval_numval(y);
+    return (a > b) - (a < b);
+  }
+  if (tx != LTYPE_DBL && ty != LTYPE_DBL) {
+    lbig a = lval_bigval(x), b = lval_bigval(y);
+    int c = lbig_cmp(&a, &b);
+    free(a.d);
+    free(b.d);
+    return c;
+  }
+  if (tx != ty) {
+    double d = tx == LTYPE_DBL ? x->dbl : y->dbl;
+    lval *n = tx == LTYPE_DBL ? y : x;
+    if (d != d) {
+      return 2;
+    }
+    int c = isinf(d) ? (d > 0 ? -1 : 1) : lval_cmp_int_dbl(n, d);
+    return tx == LTYPE_DBL ? -c : c;
+  }
+  double a = x->dbl, b = y->dbl;
+  if (a != a || b != b) {
+    return 2;
+  }
+  return (a > b) - (a < b);
+}
+
+static bool lval_eq(lval *x, lval *y) {
+  if (lval_is_real(x) && lval_is_real(y)) {
+    return lval_cmp_real(x, y) == 0;
+  }
+  if (lval_type(x) != lval_type(y)) {
+    return false;
+  }
+  switch (lval_type(x)) {
+  case LTYPE_NUM:
+  case LTYPE_BIG:
+  case LTYPE_DBL:
+    return lval_cmp_real(x, y) == 0;
+  case LTYPE_VEC:
+    if (x->vlen != y->vlen) {
+      return false;
+    }
+    for (size_t i = 0; i < x->vlen; i++) {
+      if (!lval_eq(x->vbuf->items[x->voff + i],
+                   y->vbuf->items[y->voff + i])) {
+        return false;
+      }
+    }
+    return true;
+  case LTYPE_MAP:
+    return lmap_eq(x, y);
+  case LTYPE_STR:
+  case LTYPE_BYTES:
+    return x->slen == y->slen &&
+           memcmp(lval_sdata(x), lval_sdata(y), x->slen) == 0;
+  case LTYPE_NVEC:
+    if (x->len != y->len) {
+      return false;
+    }
+    for (size_t i = 0; i < x->len; i++) {
+      if (x->data[i] != y->data[i]) {
+        return false;
+      }
+    }
+    return true;
+  case LTYPE_SYM:
+    return x->sym == y->sym;
+  case LTYPE_ERR:
+    return streq(x->err, y->err);
+  case LTYPE_FUN:
+    if (x->builtin || y->builtin) {
+      return x->builtin == y->builtin;
+    }
+    if (x->target || y->target) {
+      return x->target && y->target && lval_eq(x->target, y->target) &&
+             lval_eq(x->bound, y->bound);
+    }
+    return lval_eq(x->formals, y->formals) && lval_eq(x->body, y->body);
+  case LTYPE_SEXP:
+  case LTYPE_QEXP:
+    if (x->count != y->count) {
+      return false;
+    }
+    for (size_t i = 0; i < x->count; i++) {
+      if (!lval_eq(x->cell[i], y->cell[i])) {
+        return false;
+      }
+    }
+    return true;
+  }
+  return false;
+}
+
+static lval *builtin_cmp(lenv *e, lval *v, char *op) {
+  LASSERT_NUM(op, v, 2);
+  bool r;
+  if (streq(op, "==") || streq(op, "!=")) {
+    r = lval_eq(v->cell[0], v->cell[1]) == streq(op, "==");
+  } else {
+    for (size_t i = 0; i < 2; i++) {
+      ltype t = lval_type(v->cell[i]);
+      LASSERT(v, lval_is_real(v->cell[i]),
+              "'%s' expected Number, got %s at index %zu", op, ltype_name(t),
+              i);
+    }
+    int c = lval_cmp_real(v->cell[0], v->cell[1]);
+    if (c == 2) {
+      r = false;
+    } else if (streq(op, ">")) {
+      r = c > 0;
+    } else if (streq(op, "<")) {
+      r = c < 0;
+    } else if (streq(op, ">=")) {
+      r = c >= 0;
+    } else {
+      r = c <= 0;
+    }
+  }
+  lval_delete(v);
+  return lval_num(r);
+}
+
+static lval *builtin_gt(lenv *e, lval *v) { return builtin_cmp(e, v, ">"); }
+static lval *builtin_lt(lenv *e, lval *v) { return builtin_cmp(e, v, "<"); }
+static lval *builtin_ge(lenv *e, lval *v) { return builtin_cmp(e, v, ">="); }
+static lval *builtin_le(lenv *e, lval *v) { return builtin_cmp(e, v, "<="); }
+static lval *builtin_eq(lenv *e, lval *v) { return builtin_cmp(e, v, "=="); }
+static lval *builtin_ne(lenv *e, lval *v) { return builtin_cmp(e, v, "!="); }
+
+static lval *builtin_nvec(lenv *e, lval *v) {
+  for (size_t i = 0; i < v->count; i++) {
+    ltype t = lval_type(v->cell[i]);
+    LASSERT(v, lval_is_real(v->cell[i]),
+            "'nvec' expected Number, got %s at index %zu", ltype_name(t), i);
+  }
+  lval *r = lval_nvec(v->count);
+  if (lval_type(r) == LTYPE_ERR) {
+    lval_delete(v);
+    return r;
+  }
+  for (size_t i = 0; i < v->count; i++) {
+    r->data[i] = lval_dblval(v->cell[i]);
+  }
+  lval_delete(v);
+  return r;
+}
+
+static lval *builtin_iota(lenv *e, lval *v) {
+  LASSERT_NUM("iota", v, 1);
+  LASSERT_TYPE("iota", v, 0, LTYPE_NUM);
+  long n = lval_numval(v->cell[0]);
+  LASSERT(v, n >= 0, "'iota' expected a non-negative length, got %ld", n);
+  lval_delete(v);
+  lval *r = lval_nvec(n);
+  for (long i = 0; lval_type(r) == LTYPE_NVEC && i < n; i++) {
+    r->data[i] = i;
+  }
+  return r;
+}
+
+static lval *builtin_sum(lenv *e, lval *v) {
+  LASSERT_NUM("sum", v, 1);
+  LASSERT_TYPE("sum", v, 0, LTYPE_NVEC);
+  double one = 1;
+  lval *x = v->cell[0];
+  double r = lvec.dot(x->data, &one, true, x->len);
+  lval_delete(v);
+  return lval_dbl(r);
+}
+
+static lval *builtin_dot(lenv *e, lval *v) {
+  LASSERT_NUM("dot", v, 2);
+  LASSERT_TYPE("dot", v, 0, LTYPE_NVEC);
+  LASSERT_TYPE("dot", v, 1, LTYPE_NVEC);
+  lval *x = v->cell[0], *y = v->cell[1];
+  LASSERT(v, x->len == y->len, "'dot' vectors differ in length: %zu and %zu",
+          x->len, y->len);
+  double r = lvec.dot(x->data, y->data, false, x->len);
+  lval_delete(v);
+  return lval_dbl(r);
+}
+
+static lval *builtin_vec(lenv *e, lval *v) {
+  lvbuf *b = lvbuf_new(v->count ? v->count : 1);
+  for (size_t i = 0; i < v->count; i++) {
+    b->items[b->len++] = lval_ref(v->cell[i]);
+  }
+  lval *r = lval_vec(b, 0, b->len);
+  lval_delete(v);
+  return r;
+}
+
+static lval *builtin_len(lenv *e, lval *v) {
+  LASSERT_NUM("len", v, 1);
+  lval *x = v->cell[0];
+  size_t n;
+  switch (lval_type(x)) {
+  case LTYPE_VEC:
+    n = x->vlen;
+    break;
+  case LTYPE_NVEC:
+    n = x->len;
+    break;
+  case LTYPE_QEXP:
+    n = x->count;
+    break;
+  case LTYPE_MAP:
+    n = x->hsize;
+    break;
+  case LTYPE_STR:
+  case LTYPE_BYTES:
+    n = x->slen;
+    break;
+  default:
+    LASSERT(v, false, "'len' expected Vector, got %s",
+            ltype_name(lval_type(x)));
+  }
+  lval_delete(v);
+  return lval_num(n);
+}
+
+/* Reads an index or bound argument into *i, which must not exceed max. */
+static bool lvec_index(lval *v, size_t arg, size_t max, size_t *i) {
+  if (lval_type(v->cell[arg]) != LTYPE_NUM) {
+    return false;
+  }
+  long n = lval_numval(v->cell[arg]);
+  if (n < 0 || (size_t)n > max) {
+    return false;
+  }
+  *i = n;
+  return true;
+}
+
+static lval *builtin_nth(lenv *e, lval *v) {
+  LASSERT_NUM("nth", v, 2);
+  lval *x = v->cell[0];
+  ltype t = lval_type(x);
+  size_t n;
+  switch (t) {
+  case LTYPE_VEC:
+    n = x->vlen;
+    break;
+  case LTYPE_NVEC:
+    n = x->len;
+    break;
+  case LTYPE_STR:
+  case LTYPE_BYTES:
+    n = x->slen;
+    break;
+  default:
+    LASSERT(v, false, "'nth' expected Vector, got %s at index 0",
+            ltype_name(t));
+  }
+  size_t i;
+  LASSERT(v, n > 0 && lvec_index(v, 1, n - 1, &i),
+          "'nth' index must be a Number below %zu", n);
+  lval *r;
+  switch (t) {
+  case LTYPE_VEC:
+    r = lval_ref(x->vbuf->items[x->voff + i]);
+    break;
+  case LTYPE_NVEC:
+    r = lval_dbl(x->data[i]);
+    break;
+  case LTYPE_STR:
+    x->sbuf->refs++;
+    r = lval_sview(LTYPE_STR, x->sbuf, x->soff + i, 1);
+    break;
+  default:
+    r = lval_num((unsigned char)lval_sdata(x)[i]);
+    break;
+  }
+  lval_delete(v);
+  return r;
+}
+
+/* The slice shares the store of the value it is taken from. Strings are
+ * sliced by byte offsets. */
+static lval *builtin_slice(lenv *e, lval *v) {
+  LASSERT_NUM("slice", v, 3);
+  lval *x = v->cell[0];
+  ltype t = lval_type(x);
+  LASSERT(v, t == LTYPE_VEC || t == LTYPE_STR || t == LTYPE_BYTES,
+          "'slice' expected Vector, got %s at index 0", ltype_name(t));
+  size_t n = t == LTYPE_VEC ? x->vlen : x->slen;
+  size_t start, end;
+  LASSERT(v, lvec_index(v, 1, n, &start) && lvec_index(v, 2, n, &end) &&
+                 start <= end,
+          "'slice' bounds must be Numbers with 0 <= start <= end <= %zu", n);
+  lval *r;
+  if (t == LTYPE_VEC) {
+    x->vbuf->refs++;
+    r = lval_vec(x->vbuf, x->voff + start, end - start);
+  } else {
+    x->sbuf->refs++;
+    r = lval_sview(t, x->sbuf, x->soff + start, end - start);
+  }
+  lval_delete(v);
+  return r;
+}
+
+/* Returns a vector with y appended. When the vector ends at the end of its
+ * store, y goes into the next free slot and the result shares the store;
+ * otherwise the items are first copied to a fresh store. */
+static lval *builtin_push(lenv *e, lval *v) {
+  LASSERT_NUM("push", v, 2);
+  LASSERT_TYPE("push", v, 0, LTYPE_VEC);
+  lval *x = v->cell[0];
+  lvbuf *b = x->vbuf;
+  size_t off = x->voff;
+  if (off + x->vlen == b->len) {
+    if (b->len == b->cap) {
+      b->cap *= 2;
+      b->items = realloc(b->items, sizeof(*b->items) * b->cap);
+    }
+    b->refs++;
+  } else {
+    b = lvbuf_new(x->vlen * 2 + 1);
+    for (size_t i = 0; i < x->vlen; i++) {
+      b->items[b->len++] = lval_ref(x->vbuf->items[off + i]);
+    }
+    off = 0;
+  }
+  b->items[b->len++] = lval_ref(v->cell[1]);
+  lval *r = lval_vec(b, off, x->vlen + 1);
+  lval_delete(v);
+  return r;
+}
+
+static size_t lhash_mix(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/* Consistent with lval_eq: numbers that compare equal hash alike, so all
+ * of them are hashed by their value as a double. */
+static size_t lval_hash(lval *v) {
+  size_t h = lval_type(v);
+  switch (lval_type(v)) {
+  case LTYPE_NUM:
+  case LTYPE_BIG:
+  case LTYPE_DBL: {
+    double d = lval_dblval(v);
+    uint64_t bits = 0;
+    if (d == d && d != 0) {
+      memcpy(&bits, &d, sizeof(bits));
+    }
+    return lhash_mix(bits);
+  }
+  case LTYPE_SYM:
+    return v->sym->hash;
+  case LTYPE_ERR:
+    return str_hash(v->err);
+  case LTYPE_FUN:
+    if (v->builtin) {
+      return lhash_mix((uintptr_t)v->builtin);
+    }
+    if (v->target) {
+      return lhash_mix(lval_hash(v->target) ^ lval_hash(v->bound));
+    }
+    return lhash_mix(lval_hash(v->formals) ^ lval_hash(v->body));
+  case LTYPE_SEXP:
+  case LTYPE_QEXP:
+    for (size_t i = 0; i < v->count; i++) {
+      h = lhash_mix(h * 31 + lval_hash(v->cell[i]));
+    }
+    return h;
+  case LTYPE_VEC:
+    for (size_t i = 0; i < v->vlen; i++) {
+      h = lhash_mix(h * 31 + lval_hash(v->vbuf->items[v->voff + i]));
+    }
+    return h;
+  case LTYPE_NVEC:
+    for (size_t i = 0; i < v->len; i++) {
+      uint64_t bits = 0;
+      if (v->data[i] != 0) {
+        memcpy(&bits, &v->data[i], sizeof(bits));
+      }
+      h = lhash_mix(h * 31 + bits);
+    }
+    return h;
+  case LTYPE_MAP:
+    return lhamt_hash(v->hamt, 0);
+  case LTYPE_STR:
+  case LTYPE_BYTES:
+    for (size_t i = 0; i < v->slen; i++) {
+      h = (h ^ (unsigned char)lval_sdata(v)[i]) * 1099511628211UL;
+    }
+    return lhash_mix(h);
+  }
+  return h;
+}
+
+static lhamt *lhamt_new(size_t count) {
+  lhamt *n = malloc(sizeof(*n) + sizeof(*n->slots) * count);
+  n->refs = 1;
+  n->bitmap = 0;
+  n->count = count;
+  return n;
+}
+
+static void lhamt_release(lhamt *n) {
+  if (!n || --n->refs > 0) {
+    return;
+  }
+  for (size_t i = 0; i < n->count; i++) {
+    lhamt_slot *s = &n->slots[i];
+    if (s->key) {
+      lval_delete(s->key);
+      lval_delete(s->val);
+    } else {
+      lhamt_release(s->node);
+    }
+  }
+  free(n);
+}
+
+static lhamt_slot lhamt_entry(size_t hash, lval *key, lval *val) {
+  return (lhamt_slot){.hash = hash, .key = lval_ref(key), .val = lval_ref(val)};
+}
+
+static lhamt_slot lhamt_child(lhamt *node) {
+  return (lhamt_slot){.node = node};
+}
+
+/* Copies n with slot i replaced (delta 0), inserted (delta 1) or removed
+ * (delta -1). The other slots are shared; a replaced or inserted slot i is
+ * left for the caller to fill. */
+static lhamt *lhamt_edit(lhamt *n, size_t i, int delta) {
+  lhamt *r = lhamt_new(n->count + delta);
+  r->bitmap = n->bitmap;
+  for (size_t j = 0; j < n->count; j++) {
+    if (j == i && delta <= 0) {
+      continue;
+    }
+    lhamt_slot s = n->slots[j];
+    if (s.key) {
+      lval_ref(s.key);
+      lval_ref(s.val);
+    } else {
+      s.node->refs++;
+    }
+    r->slots[j + (delta > 0 && j >= i) - (delta < 0 && j > i)] = s;
+  }
+  return r;
+}
+
+static size_t lhamt_index(lhamt *n, uint32_t bit) {
+  return __builtin_popcount(n->bitmap & (bit - 1));
+}
+
+static uint32_t lhamt_bit(size_t hash, size_t shift) {
+  return 1u << ((hash >> shift) & LHAMT_MASK);
+}
+
+static lval *lhamt_get(lhamt *n, size_t hash, lval *key) {
+  for (size_t shift = 0; n; shift += LHAMT_BITS) {
+    if (shift >= LHAMT_HASH_BITS) {
+      for (size_t i = 0; i < n->count; i++) {
+        if (lval_eq(n->slots[i].key, key)) {
+          return n->slots[i].val;
+        }
+      }
+      return 0;
+    }
+    uint32_t bit = lhamt_bit(hash, shift);
+    if (!(n->bitmap & bit)) {
+      return 0;
+    }
+    lhamt_slot *s = &n->slots[lhamt_index(n, bit)];
+    if (!s->key) {
+      n = s->node;
+    } else if (s->hash == hash && lval_eq(s->key, key)) {
+      return s->val;
+    } else {
+      return 0;
+    }
+  }
+  return 0;
+}
+
+/* Returns a new trie with e added or replaced, sharing every node off the
+ * path to it. n may be null for the empty trie. */
+static lhamt *lhamt_assoc(lhamt *n, size_t shift, lhamt_slot e, bool *added) {
+  if (!n) {
+    lhamt *r = lhamt_new(1);
+    r->bitmap = shift < LHAMT_HASH_BITS ? lhamt_bit(e.hash, shift) : 0;
+    r->slots[0] = lhamt_entry(e.hash, e.key, e.val);
+    *added = true;
+    return r;
+  }
+  if (shift >= LHAMT_HASH_BITS) {
+    size_t i = 0;
+    while (i < n->count && !lval_eq(n->slots[i].key, e.key)) {
+      i++;
+    }
+    *added = i == n->count;
+    lhamt *r = lhamt_edit(n, i, *added);
+    r->slots[i] = lhamt_entry(e.hash, e.key, e.val);
+    return r;
+  }
+
+  uint32_t bit = lhamt_bit(e.hash, shift);
+  size_t i = lhamt_index(n, bit);
+  if (!(n->bitmap & bit)) {
+    lhamt *r = lhamt_edit(n, i, 1);
+    r->bitmap |= bit;
+    r->slots[i] = lhamt_entry(e.hash, e.key, e.val);
+    *added = true;
+    return r;
+  }
+  lhamt_slot *s = &n->slots[i];
+  lhamt_slot repl;
+  if (!s->key) {
+    repl = lhamt_child(lhamt_assoc(s->node, shift + LHAMT_BITS, e, added));
+  } else if (s->hash == e.hash && lval_eq(s->key, e.key)) {
+    repl = lhamt_entry(e.hash, e.key, e.val);
+    *added = false;
+  } else {
+    /* Two keys share this slot: push both down a level. */
+    bool ignored;
+    lhamt *one = lhamt_assoc(0, shift + LHAMT_BITS, *s, &ignored);
+    repl = lhamt_child(lhamt_assoc(one, shift + LHAMT_BITS, e, added));
+    lhamt_release(one);
+  }
+  lhamt *r = lhamt_edit(n, i, 0);
+  r->slots[i] = repl;
+  return r;
+}
+
+/* Returns a new trie without key, or a new reference to n when key is
+ * absent; null when the trie becomes empty. A node left holding a single
+ * entry is replaced by that entry in its parent, so the shape of a trie
+ * depends only on its contents. */
+static lhamt *lhamt_dissoc(lhamt *n, size_t shift, size_t hash, lval *key,
+                           bool *removed) {
+  *removed = false;
+  size_t i;
+  lhamt_slot repl = {0};
+  if (shift >= LHAMT_HASH_BITS) {
+    for (i = 0; i < n->count && !lval_eq(n->slots[i].key, key); i++) {
+    }
+    *removed = i < n->count;
+  } else {
+    uint32_t bit = lhamt_bit(hash, shift);
+    if (!(n->bitmap & bit)) {
+      n->refs++;
+      return n;
+    }
+    i = lhamt_index(n, bit);
+    lhamt_slot *s = &n->slots[i];
+    if (!s->key) {
+      lhamt *child =
+          lhamt_dissoc(s->node, shift + LHAMT_BITS, hash, key, removed);
+      if (!*removed) {
+        lhamt_release(child);
+      } else if (child && child->count == 1 && child->slots[0].key) {
+        lhamt_slot *c = &child->slots[0];
+        repl = lhamt_entry(c->hash, c->key, c->val);
+        lhamt_release(child);
+      } else if (child) {
+        repl = lhamt_child(child);
+      }
+    } else {
+      *removed = s->hash == hash && lval_eq(s->key, key);
+    }
+  }
+
+  if (!*removed) {
+    n->refs++;
+    return n;
+  }
+  if (repl.key || repl.node) {
+    lhamt *r = lhamt_edit(n, i, 0);
+    r->slots[i] = repl;
+    return r;
+  }
+  if (n->count == 1) {
+    return 0;
+  }
+  lhamt *r = lhamt_edit(n, i, -1);
+  if (shift < LHAMT_HASH_BITS) {
+    r->bitmap &= ~lhamt_bit(hash, shift);
+  }
+  return r;
+}
+
+/* Appends the keys, the values or both of every entry to q. */
+static lval *lhamt_collect(lhamt *n, lval *q, bool keys, bool vals) {
+  for (size_t i = 0; n && i < n->count; i++) {
+    lhamt_slot *s = &n->slots[i];
+    if (!s->key) {
+      q = lhamt_collect(s->node, q, keys, vals);
+      continue;
+    }
+    if (keys) {
+      q = lval_add(q, lval_ref(s->key));
+    }
+    if (vals) {
+      q = lval_add(q, lval_ref(s->val));
+    }
+  }
+  return q;
+}
+
+/* Order independent, since equal maps may differ in collision order. */
+static size_t lhamt_hash(lhamt *n, size_t h) {
+  for (size_t i = 0; n && i < n->count; i++) {
+    lhamt_slot *s = &n->slots[i];
+    if (s->key) {
+      h += lhash_mix(s->hash ^ lval_hash(s->val));
+    } else {
+      h = lhamt_hash(s->node, h);
+    }
+  }
+  return h;
+}
+
+static lval *lval_map(lhamt *root, size_t size) {
+  lval *ret = gc_alloc(sizeof(lval), GC_VAL);
+  *ret = (lval){.type = LTYPE_MAP, .refs = 1, .hamt = root, .hsize = size};
+  return ret;
+}
+
+static bool lmap_eq(lval *x, lval *y) {
+  if (x->hsize != y->hsize) {
+    return false;
+  }
+  lval *keys = lhamt_collect(x->hamt, lval_qexp(), true, false);
+  bool eq = true;
+  for (size_t i = 0; eq && i < keys->count; i++) {
+    lval *k = keys->cell[i];
+    lval *a = lhamt_get(x->hamt, lval_hash(k), k);
+    lval *b = lhamt_get(y->hamt, lval_hash(k), k);
+    eq = b && lval_eq(a, b);
+  }
+  lval_delete(keys);
+  return eq;
+}
+
+static lval *lmap_assoc(lval *m, lval *k, lval *v) {
+  bool added;
+  lhamt_slot e = {.hash = lval_hash(k), .key = k, .val = v};
+  lval *r = lval_map(lhamt_assoc(m->hamt, 0, e, &added), m->hsize);
+  r->hsize += added;
+  return r;
+}
+
+/* Takes a Q-Expression of alternating keys and values. */
+static lval *builtin_map(lenv *e, lval *v) {
+  LASSERT_NUM("map", v, 1);
+  LASSERT_TYPE("map", v, 0, LTYPE_QEXP);
+  lval *kvs = v->cell[0];
+  LASSERT(v, kvs->count % 2 == 0,
+          "'map' expected alternating keys and values, got %zu items",
+          kvs->count);
+  lval *m = lval_map(0, 0);
+  for (size_t i = 0; i < kvs->count; i += 2) {
+    lval *next = lmap_assoc(m, kvs->cell[i], kvs->cell[i + 1]);
+    lval_delete(m);
+    m = next;
+  }
+  lval_delete(v);
+  return m;
+}
+
+static lval *builtin_assoc(lenv *e, lval *v) {
+  LASSERT(v, v->count > 0 && v->count % 2 == 1,
+          "'assoc' expected a map and alternating keys and values");
+  LASSERT_TYPE("assoc", v, 0, LTYPE_MAP);
+  lval *m = lval_ref(v->cell[0]);
+  for (size_t i = 1; i < v->count; i += 2) {
+    lval *next = lmap_assoc(m, v->cell[i], v->cell[i + 1]);
+    lval_delete(m);
+    m = next;
+  }
+  lval_delete(v);
+  return m;
+}
+
+static lval *builtin_dissoc(lenv *e, lval *v) {
+  LASSERT(v, v->count > 0, "'dissoc' expected a map");
+  LASSERT_TYPE("dissoc", v, 0, LTYPE_MAP);
+  lval *m = lval_ref(v->cell[0]);
+  for (size_t i = 1; i < v->count && m->hamt; i++) {
+    bool removed;
+    lval *k = v->cell[i];
+    lhamt *root = lhamt_dissoc(m->hamt, 0, lval_hash(k), k, &removed);
+    lval *next = lval_map(root, m->hsize - removed);
+    lval_delete(m);
+    m = next;
+  }
+  lval_delete(v);
+  return m;
+}
+
+/* The optional third arg is returned for a missing key, which is
+ * otherwise an error. */
+static lval *builtin_get(lenv *e, lval *v) {
+  LASSERT(v, v->count == 2 || v->count == 3,
+          "'get' expected 2 or 3 args, got %zu", v->count);
+  LASSERT_TYPE("get", v, 0, LTYPE_MAP);
+  lval *k = v->cell[1];
+  lval *x = lhamt_get(v->cell[0]->hamt, lval_hash(k), k);
+  if (!x && v->count == 3) {
+    x = v->cell[2];
+  }
+  LASSERT(v, x, "'get' key not found");
+  lval_ref(x);
+  lval_delete(v);
+  return x;
+}
+
+static lval *lmap_collect(lval *v, char *fn, bool keys, bool vals) {
+  LASSERT_NUM(fn, v, 1);
+  LASSERT_TYPE(fn, v, 0, LTYPE_MAP);
+  lval *q = lhamt_collect(v->cell[0]->hamt, lval_qexp(), keys, vals);
+  lval_delete(v);
+  return q;
+}
+
+/* keys, vals and pairs list the entries in the same order. */
+static lval *builtin_keys(lenv *e, lval *v) {
+  return lmap_collect(v, "keys", true, false);
+}
+
+static lval *builtin_vals(lenv *e, lval *v) {
+  return lmap_collect(v, "vals", false, true);
+}
+
+static lval *builtin_pairs(lenv *e, lval *v) {
+  return lmap_collect(v, "pairs", true, true);
+}
+
+/* Appends the rest of the args to the first, which must all be strings or
+ * all byte strings. The bytes are written straight after the first arg
+ * when it ends at the end of its buffer, so building a string by repeated
+ * concat takes amortised linear time. */
+static lval *builtin_concat(lenv *e, lval *v) {
+  LASSERT(v, v->count > 0, "'concat' expected at least one arg");
+  ltype t = lval_type(v->cell[0]);
+  LASSERT(v, t == LTYPE_STR || t == LTYPE_BYTES,
+          "'concat' expected String, got %s at index 0", ltype_name(t));
+  size_t total = 0;
+  for (size_t i = 0; i < v->count; i++) {
+    LASSERT_TYPE("concat", v, i, t);
+    total += v->cell[i]->slen;
+  }
+
+  lval *x = v->cell[0];
+  lsbuf *b = x->sbuf;
+  size_t off = x->soff;
+  if (off + x->slen == b->len) {
+    if (off + total > b->cap) {
+      b->cap = (off + total) * 2;
+      b->data = realloc(b->data, b->cap);
+    }
+    b->refs++;
+  } else {
+    b = lsbuf_new(total * 2);
+    memcpy(b->data, lval_sdata(x), x->slen);
+    b->len = x->slen;
+    off = 0;
+  }
+  for (size_t i = 1; i < v->count; i++) {
+    lval *y = v->cell[i];
+    memcpy(b->data + b->len, lval_sdata(y), y->slen);
+    b->len += y->slen;
+  }
+  lval *r = lval_sview(t, b, off, total);
+  lval_delete(v);
+  return r;
+}
+
+/* Conversions between strings and byte strings share the buffer. */
+static lval *lval_sconvert(lval *v, char *fn, ltype from, ltype to) {
+  LASSERT_NUM(fn, v, 1);
+  LASSERT_TYPE(fn, v, 0, from);
+  lval *x = v->cell[0];
+  x->sbuf->refs++;
+  lval *r = lval_sview(to, x->sbuf, x->soff, x->slen);
+  lval_delete(v);
+  return r;
+}
+
+static lval *builtin_bytes(lenv *e, lval *v) {
+  return lval_sconvert(v, "bytes", LTYPE_STR, LTYPE_BYTES);
+}
+
+static lval *builtin_string(lenv *e, lval *v) {
+  return lval_sconvert(v, "string", LTYPE_BYTES, LTYPE_STR);
+}
+
+/* Reads the whole file named by a string and evaluates its expressions in
+ * order. Errors raised by an expression are printed and loading goes on;
+ * a syntax error anywhere in the file stops it before anything runs, and
+ * is printed as is at top level or returned from a nested load. At top
+ * level the forms still to run are registered as a VM frame so the
+ * collector can run between them; a nested load never collects. */
+static lval *lval_load(lenv *e, char *path, bool top) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    return lval_err("Could not load %s: %s", path, strerror(errno));
+  }
+  size_t len = 0, cap = 4096;
+  char *src = malloc(cap);
+  for (size_t n; (n = fread(src + len, 1, cap - len - 1, f)) > 0;) {
+    len += n;
+    if (cap - len == 1) {
+      cap *= 2;
+      src = realloc(src, cap);
+    }
+  }
+  fclose(f);
+  src[len] = 0;
+
+  lval *exprs = lval_read(path, src);
+  free(src);
+  if (lval_type(exprs) == LTYPE_ERR && top) {
+    puts(exprs->err);
+    lval_delete(exprs);
+    return lval_sexp();
+  }
+  if (lval_type(exprs) == LTYPE_ERR) {
+    return exprs;
+  }
+  size_t one = 1;
+  lvm_frame frame = {.prev = gc.frames, .stack = &exprs, .sp = &one};
+  if (top) {
+    gc.frames = &frame;
+  }
+  while (exprs->count > 0) {
+    lval *x = lval_eval(e, lval_pop(exprs, 0));
+    if (lval_type(x) == LTYPE_ERR) {
+      lval_print(x);
+      printf("\n");
+    }
+    lval_delete(x);
+    if (top) {
+      arena_reset();
+      gc_safepoint();
+    }
+  }
+  if (top) {
+    gc.frames = frame.prev;
+  }
+  lval_delete(exprs);
+  return lval_sexp();
+}
+
+static lval *builtin_load(lenv *e, lval *v) {
+  LASSERT_NUM("load", v, 1);
+  LASSERT_TYPE("load", v, 0, LTYPE_STR);
+  lval *name = v->cell[0];
+  char *path = malloc(name->slen + 1);
+  memcpy(path, lval_sdata(name), name->slen);
+  path[name->slen] = 0;
+  lval_delete(v);
+  lval *x = lval_load(e, path, false);
+  free(path);
+  return x;
+}
+
+static lval *lval_join(lval *x, lval *y) {
+  y = lval_mut(y);
+  while (y->count > 0) {
+    x = lval_add(x, lval_pop(y, 0));
+  }
+  lval_delete(y);
+  return x;
+}
+
+static lval *lval_target(lval *f) { return f->target ? f->target : f; }
+
+static bool lsym_is_rest(lval *formal) {
+  static lsym *rest;
+  if (!rest) {
+    rest = lsym_intern("&");
+  }
+  return formal->sym == rest;
+}
+
+/* Functions carry no environment of their own: every call binds its
+ * formals into a fresh activation frame whose parent is the caller's.
+ * Formals after '&' collect the remaining args as a Q-Expression. With
+ * fewer args than required formals the call instead returns a partial
+ * application that shares the target function and holds only the args.
+ * Returns 0 and sets *act when the body should run, otherwise the value of
+ * the call. */
+static lval *lval_bind(lenv *e, lval *f, lval *a, lenv **act) {
+  if (f->target) {
+    a = lval_join(lval_mut(lval_ref(f->bound)), a);
+    f = f->target;
+  }
+  lval *formals = f->formals;
+  size_t required = 0;
+  while (required < formals->count && !lsym_is_rest(formals->cell[required])) {
+    required++;
+  }
+  bool variadic = required < formals->count;
+  if (a->count < required) {
+    return lval_partial(f, a);
+  }
+  if (!variadic && a->count > required) {
+    lval *err = lval_err("Function passed too many args, got %zu, expected %zu",
+                         a->count, required);
+    lval_delete(a);
+    return err;
+  }
+  *act = lenv_new();
+  (*act)->par = e;
+  for (size_t i = 0; i < required; i++) {
+    lenv_put(*act, formals->cell[i], a->cell[i]);
+  }
+  if (variadic) {
+    lval *rest = lval_qexp();
+    for (size_t i = required; i < a->count; i++) {
+      rest = lval_add(rest, lval_ref(a->cell[i]));
+    }
+    lenv_put(*act, formals->cell[required + 1], rest);
+    lval_delete(rest);
+  }
+  lval_delete(a);
+  return 0;
+}
+
+static lval *lval_call(lenv *e, lval *f, lval *a) {
+  if (f->builtin) {
+    return f->builtin(e, a);
+  }
+  lenv *act;
+  lval *ret = lval_bind(e, f, a, &act);
+  if (!ret) {
+    ret = lvm_run(act, lcode_select(lval_target(f)->code));
+    lenv_delete(act);
+  }
+  return ret;
+}
+
+static lval *builtin_join(lenv *e, lval *v) {
+  for (size_t i = 0; i < v->count; i++) {
+    LASSERT_TYPE("join", v, i, LTYPE_QEXP);
+  }
+  lval *x = lval_mut(lval_pop(v, 0));
+  while (v->count > 0) {
+    x = lval_join(x, lval_pop(v, 0));
+  }
+  lval_delete(v);
+  return x;
+}
+
+static lval *builtin_var(lenv *e, lval *v, char *fn) {
+  LASSERT(v, v->count > 0, "no args for '%s'", fn);
+  LASSERT_TYPE(fn, v, 0, LTYPE_QEXP);
+  lval *symlist = v->cell[0];
+  for (size_t i = 0; i < symlist->count; i++) {
+    LASSERT(v, lval_type(symlist->cell[i]) == LTYPE_SYM,
+            "first '%s' arg must be a list of symbols, got %s at %zu", fn,
+            ltype_name(lval_type(symlist->cell[i])), i);
+  }
+  LASSERT(v, symlist->count == v->count - 1,
+          "'%s' expected exactly %zu values, got %zu", symlist->count, fn,
+          v->count - 1);
+  for (size_t i = 0; i < symlist->count; i++) {
+    if (streq(fn, "def")) {
+      lenv_def(e, symlist->cell[i], v->cell[i + 1]);
+    } else if (streq(fn, "=")) {
+      lenv_put(e, symlist->cell[i], v->cell[i + 1]);
+    } else {
+      exit(1);
+    }
+  }
+  lval_delete(v);
+  return lval_sexp();
+}
+
+static lval *builtin_def(lenv *e, lval *v) { return builtin_var(e, v, "def"); }
+
+static lval *builtin_put(lenv *e, lval *v) { return builtin_var(e, v, "="); }
+
+static bool lval_is_lambda_form(lval *v) {
+  ltype t = lval_type(v);
+  return (t == LTYPE_SEXP || t == LTYPE_QEXP) && v->count == 3 &&
+         lval_type(v->cell[0]) == LTYPE_SYM &&
+         streq(v->cell[0]->sym->name, "\\") &&
+         lval_type(v->cell[1]) == LTYPE_QEXP &&
+         lval_type(v->cell[2]) == LTYPE_QEXP;
+}
+
+/* Annotates every symbol in v that names a formal of an enclosing lambda
+ * with its (depth, slot) coordinates. Formals are bound in order into a
+ * fresh frame, so slot i of the frame depth hops up holds formal i. */
+static lval *lval_resolve(lval *v, lscope *sc) {
+  switch (lval_type(v)) {
+  case LTYPE_SYM:
+    v = lval_mut(v);
+    v->depth = -1;
+    for (int depth = 0; sc; sc = sc->up, depth++) {
+      for (size_t i = 0, slot = 0; i < sc->formals->count; i++) {
+        lval *formal = sc->formals->cell[i];
+        if (lsym_is_rest(formal)) {
+          continue;
+        }
+        if (formal->sym == v->sym) {
+          v->depth = depth;
+          v->slot = slot;
+          return v;
+        }
+        slot++;
+      }
+    }
+    break;
+  case LTYPE_SEXP:
+  case LTYPE_QEXP:
+    v = lval_mut(v);
+    if (lval_is_lambda_form(v)) {
+      v->cell[0] = lval_resolve(v->cell[0], sc);
+      v->cell[2] =
+          lval_resolve(v->cell[2], &(lscope){.formals = v->cell[1], .up = sc});
+      break;
+    }
+    for (size_t i = 0; i < v->count; i++) {
+      v->cell[i] = lval_resolve(v->cell[i], sc);
+    }
+    break;
+  default:
+    break;
+  }
+  return v;
+}
+
+/* Constant folding state: the global env and the bindings folded so far. */
+typedef struct lfold lfold;
+struct lfold {
+  lenv *env;
+  size_t ndeps;
+  ldep *deps;
+};
+
+static void lfold_dep(lfold *fo, lsym *sym) {
+  for (size_t i = 0; i < fo->ndeps; i++) {
+    if (fo->deps[i].sym == sym) {
+      return;
+    }
+  }
+  fo->deps = realloc(fo->deps, sizeof(*fo->deps) * (fo->ndeps + 1));
+  fo->deps[fo->ndeps++] = (ldep){.sym = sym, .defs = sym->defs};
+}
+
+/* The builtin a call to f would run if it is free of side effects and
+ * f currently resolves to the global env, otherwise 0. */
+static lbuiltin lfold_builtin(lfold *fo, lval *f) {
+  if (lval_type(f) != LTYPE_SYM || f->depth >= 0 || f->sym->nlocal) {
+    return 0;
+  }
+  lval **slot = lenv_find(fo->env, f->sym);
+  if (!slot || lval_type(*slot) != LTYPE_FUN) {
+    return 0;
+  }
+  static const lbuiltin pure[] = {
+      builtin_add,  builtin_sub, builtin_mul, builtin_div, builtin_head,
+      builtin_tail, builtin_list, builtin_join, builtin_gt, builtin_lt,
+      builtin_ge,   builtin_le,  builtin_eq,  builtin_ne,  builtin_if,
+  };
+  for (size_t i = 0; i < sizeof(pure) / sizeof(*pure); i++) {
+    if ((*slot)->builtin == pure[i]) {
+      return pure[i];
+    }
+  }
+  return 0;
+}
+
+static lval *lval_fold(lval *, lfold *);
+static lval *lval_fold_body(lval *, lfold *);
+
+/* Folds the elements of v, returning v itself if none of them changed. */
+static lval *lval_fold_args(lval *v, lfold *fo) {
+  for (size_t i = 0; i < v->count; i++) {
+    lval *x = lval_fold(lval_ref(v->cell[i]), fo);
+    if (x == v->cell[i]) {
+      lval_delete(x);
+      continue;
+    }
+    v = lval_mut(v);
+    lval_delete(v->cell[i]);
+    v->cell[i] = x;
+  }
+  return v;
+}
+
+/* Folds the branches of an if, and prunes the one not taken when the
+ * condition is a literal. */
+static lval *lval_fold_if(lval *v, lfold *fo) {
+  if (v->count != 4) {
+    return v;
+  }
+  bool changed = false;
+  for (size_t i = 2; i < 4; i++) {
+    if (lval_type(v->cell[i]) != LTYPE_QEXP) {
+      continue;
+    }
+    lval *x = lval_fold_body(lval_ref(v->cell[i]), fo);
+    if (x == v->cell[i]) {
+      lval_delete(x);
+      continue;
+    }
+    v = lval_mut(v);
+    lval_delete(v->cell[i]);
+    v->cell[i] = x;
+    changed = true;
+  }
+  if (lval_type(v->cell[1]) == LTYPE_NUM &&
+      lval_type(v->cell[2]) == LTYPE_QEXP &&
+      lval_type(v->cell[3]) == LTYPE_QEXP) {
+    lfold_dep(fo, v->cell[0]->sym);
+    lval *x = lval_mut(lval_ref(v->cell[lval_numval(v->cell[1]) ? 2 : 3]));
+    lval_delete(v);
+    x->type = LTYPE_SEXP;
+    return x;
+  }
+  if (changed) {
+    lfold_dep(fo, v->cell[0]->sym);
+  }
+  return v;
+}
+
+/* Evaluates the call v at definition time if it applies a pure builtin to
+ * literals and succeeds. Errors are left for the call to raise at run
+ * time. */
+static lval *lval_fold_apply(lval *v, lfold *fo) {
+  if (v->count < 2) {
+    return v;
+  }
+  lbuiltin b = lfold_builtin(fo, v->cell[0]);
+  if (!b) {
+    return v;
+  }
+  if (b == builtin_if) {
+    return lval_fold_if(v, fo);
+  }
+  lval *args = lval_sexp();
+  for (size_t i = 1; i < v->count; i++) {
+    ltype t = lval_type(v->cell[i]);
+    if (!lval_is_real(v->cell[i]) && t != LTYPE_QEXP) {
+      lval_delete(args);
+      return v;
+    }
+    args = lval_add(args, lval_ref(v->cell[i]));
+  }
+  lval *x = b(fo->env, args);
+  if (lval_type(x) == LTYPE_ERR) {
+    lval_delete(x);
+    return v;
+  }
+  lfold_dep(fo, v->cell[0]->sym);
+  lval_delete(v);
+  return x;
+}
+
+static lval *lval_fold(lval *v, lfold *fo) {
+  if (lval_type(v) != LTYPE_SEXP || lval_is_lambda_form(v)) {
+    return v;
+  }
+  return lval_fold_apply(lval_fold_args(v, fo), fo);
+}
+
+/* A body runs as an S-expression of its elements, so a body folded to a
+ * single value x becomes {x}. */
+static lval *lval_fold_body(lval *body, lfold *fo) {
+  body = lval_fold_args(body, fo);
+  lval *x = lval_fold_apply(body, fo);
+  if (x == body) {
+    return body;
+  }
+  if (lval_type(x) == LTYPE_SEXP) {
+    x = lval_mut(x);
+    x->type = LTYPE_QEXP;
+    return x;
+  }
+  return lval_add(lval_qexp(), x);
+}
 
 static lval *builtin_lambda(lenv *e, lval *v) {
   LASSERT_NUM("\\", v, 2);
@@ -352,26 +2815,45 @@ static lval *builtin_lambda(lenv *e, lval *v) {
 
   lval *first = v->cell[0];
   for (size_t i = 0; i < first->count; i++) {
-    LASSERT(v, first->cell[i]->type == LTYPE_SYM,
+    LASSERT(v, lval_type(first->cell[i]) == LTYPE_SYM,
             "'lambda' formals must be a list of symbols, got %s at %zu",
-            ltype_name(first->cell[i]->type), i);
+            ltype_name(lval_type(first->cell[i])), i);
+    LASSERT(v, !lsym_is_rest(first->cell[i]) || i + 2 == first->count,
+            "'lambda' '&' must be followed by exactly one symbol");
   }
 
   lval *formals = lval_pop(v, 0);
   lval *body = lval_pop(v, 0);
   lval_delete(v);
-  return lval_lambda(formals, body);
+  body = lval_resolve(body, &(lscope){.formals = formals});
+  lval *f = lval_lambda(formals, body);
+
+  while (e->par) {
+    e = e->par;
+  }
+  lfold fo = {.env = e};
+  lval *folded = lval_fold_body(lval_ref(body), &fo);
+  f->code = lcode_compile(folded);
+  lval_delete(folded);
+  if (fo.ndeps) {
+    f->code->ndeps = fo.ndeps;
+    f->code->deps = fo.deps;
+    f->code->fallback = lcode_compile(body);
+  }
+  return f;
 }
 
 static lval *lval_pop(lval *v, size_t i) {
   lval *c = v->cell[i];
-  memmove(&v->cell[i], &v->cell[i + 1], sizeof(*v->cell) * (v->count - i - 1));
-  v->count--;
-  if (v->count > 0) {
-    v->cell = realloc(v->cell, sizeof(*c->cell) * v->count);
+  if (i == 0) {
+    v->cell++;
   } else {
-    free(v->cell);
-    v->cell = 0;
+    memmove(&v->cell[i], &v->cell[i + 1],
+            sizeof(*v->cell) * (v->count - i - 1));
+  }
+  v->count--;
+  if (v->count == 0) {
+    v->cell = v->mem;
   }
   return c;
 }
@@ -383,11 +2865,17 @@ static lval *lval_take(lval *v, size_t i) {
 }
 
 static lval *lval_eval_sexp(lenv *e, lval *v) {
+  v = lval_mut(v);
   for (size_t i = 0; i < v->count; i++) {
     v->cell[i] = lval_eval(e, v->cell[i]);
   }
+  return lval_apply(e, v);
+}
+
+/* Applies an S-expression whose children have already been evaluated. */
+static lval *lval_apply(lenv *e, lval *v) {
   for (size_t i = 0; i < v->count; i++) {
-    if (v->cell[i]->type == LTYPE_ERR) {
+    if (lval_type(v->cell[i]) == LTYPE_ERR) {
       return lval_take(v, i);
     }
   }
@@ -398,24 +2886,42 @@ static lval *lval_eval_sexp(lenv *e, lval *v) {
     return lval_take(v, 0);
   }
   lval *f = lval_pop(v, 0);
-  if (f->type != LTYPE_FUN) {
+  if (lval_type(f) != LTYPE_FUN) {
+    lval *err = lval_err("Not a function: %s", ltype_name(lval_type(f)));
     lval_delete(v);
     lval_delete(f);
-    return lval_err("Not a function: %s", ltype_name(f->type));
+    return err;
   }
   lval *ret = lval_call(e, f, v);
   lval_delete(f);
   return ret;
 }
 
+/* Fast path for symbols resolved to the frame they are looked up in: the
+ * binding sits at a known slot, which is checked by pointer only. Symbols
+ * bound further out are searched for by name, since making sure no nearer
+ * frame shadows them would cost as much as the search. */
+static lval *lenv_get_addr(lenv *e, lval *k) {
+  if (k->depth == 0 && !lenv_hashed(e) && (size_t)k->slot < e->count &&
+      e->syms[k->slot] == k->sym) {
+    return lval_ref(e->vals[k->slot]);
+  }
+  return 0;
+}
+
+static lval *lenv_lookup(lenv *e, lval *k) {
+  lval *x = lenv_get_addr(e, k);
+  return x ? x : lenv_get(e, k);
+}
+
 static lval *lval_eval_sym(lenv *e, lval *v) {
-  lval *x = lenv_get(e, v);
+  lval *x = lenv_lookup(e, v);
   lval_delete(v);
   return x;
 }
 
 static lval *lval_eval(lenv *e, lval *v) {
-  switch (v->type) {
+  switch (lval_type(v)) {
   case LTYPE_SEXP:
     return lval_eval_sexp(e, v);
   case LTYPE_SYM:
@@ -425,27 +2931,380 @@ static lval *lval_eval(lenv *e, lval *v) {
   }
 }
 
-static void lval_print_exp(lval *v, char open, char end) {
-  putchar(open);
-  for (size_t i = 0; i < v->count; i++) {
-    lval_print(v->cell[i]);
-    if (i < v->count - 1) {
-      printf(" ");
+static size_t lcode_const(lcode *c, lval *v) {
+  c->consts = realloc(c->consts, sizeof(*c->consts) * (c->nconsts + 1));
+  c->consts[c->nconsts] = lval_ref(v);
+  return c->nconsts++;
+}
+
+static void lcode_emit(lcode *c, enum lopcode op, size_t arg) {
+  if (c->count == c->cap) {
+    c->cap = c->cap ? c->cap * 2 : 16;
+    c->ops = realloc(c->ops, sizeof(*c->ops) * c->cap);
+  }
+  c->ops[c->count++] = OP_MAKE(op, arg);
+}
+
+/* Emits code leaving the value of v on the stack, given sp values below. */
+static void lcode_compile_val(lcode *c, lval *v, size_t sp) {
+  switch (lval_type(v)) {
+  case LTYPE_SYM:
+    lcode_emit(c, OP_LOAD, lcode_const(c, v));
+    break;
+  case LTYPE_SEXP:
+    for (size_t i = 0; i < v->count; i++) {
+      lcode_compile_val(c, v->cell[i], sp + i);
+    }
+    lcode_emit(c, OP_APPLY, v->count);
+    sp += v->count;
+    break;
+  default:
+    lcode_emit(c, OP_CONST, lcode_const(c, v));
+    break;
+  }
+  if (sp + 1 > c->depth) {
+    c->depth = sp + 1;
+  }
+}
+
+/* A body is evaluated as an S-expression of its elements. */
+static lcode *lcode_compile(lval *body) {
+  lcode *c = malloc(sizeof(*c));
+  *c = (lcode){.refs = 1};
+  lval sexp = *body;
+  sexp.type = LTYPE_SEXP;
+  lcode_compile_val(c, &sexp, 0);
+  if (OP_CODE(c->ops[c->count - 1]) == OP_APPLY) {
+    c->ops[c->count - 1] = OP_MAKE(OP_TAIL, OP_ARG(c->ops[c->count - 1]));
+  }
+  lcode_emit(c, OP_RET, 0);
+  c->ics = calloc(c->nconsts, sizeof(*c->ics));
+  return c;
+}
+
+static lcode *lcode_retain(lcode *c) {
+  if (c) {
+    c->refs++;
+  }
+  return c;
+}
+
+static void lcode_release(lcode *c) {
+  if (c && --c->refs == 0) {
+    for (size_t i = 0; i < c->nconsts; i++) {
+      lval_delete(c->consts[i]);
+    }
+    for (size_t i = 0; c->subs && i < c->nconsts; i++) {
+      lcode_release(c->subs[i]);
+    }
+    free(c->consts);
+    free(c->ics);
+    free(c->subs);
+    lcode_release(c->fallback);
+    free(c->ops);
+    free(c->deps);
+    free(c);
+  }
+}
+
+/* Constants are never modified in place, so a branch that is one of c's
+ * constants is compiled once and kept for every later jump into it. */
+static lcode *lcode_branch(lcode *c, lval *x) {
+  for (size_t i = 0; i < c->nconsts; i++) {
+    if (c->consts[i] == x) {
+      if (!c->subs) {
+        c->subs = calloc(c->nconsts, sizeof(*c->subs));
+      }
+      if (!c->subs[i]) {
+        c->subs[i] = lcode_compile(x);
+      }
+      return lcode_retain(c->subs[i]);
+    }
+  }
+  return lcode_compile(x);
+}
+
+/* Folded code stands only while the bindings it folded are untouched and
+ * unshadowed. */
+static lcode *lcode_select(lcode *c) {
+  for (size_t i = 0; i < c->ndeps; i++) {
+    ldep *d = &c->deps[i];
+    if (d->sym->nlocal || d->sym->defs != d->defs) {
+      return c->fallback;
+    }
+  }
+  return c;
+}
+
+/* Inline cache miss: a symbol no local frame binds is looked up straight
+ * in the global env and the site is cached against the env version. */
+static lval *lvm_load(lenv *e, lval *k, lic *ic) {
+  if (k->sym->nlocal) {
+    return lenv_lookup(e, k);
+  }
+  while (e->par) {
+    e = e->par;
+  }
+  lval **slot = lenv_find(e, k->sym);
+  if (!slot) {
+    return lval_err("Unbound symbol %s", k->sym->name);
+  }
+  *ic = (lic){.version = lenv_version, .val = *slot};
+  return lval_ref(*slot);
+}
+
+static lval *lvm_args(lval **stack, size_t n) {
+  lval *v = lval_sexp();
+  if (n > 0) {
+    v->count = n;
+    v->cap = n;
+    v->cell = v->mem = malloc(sizeof(*v->cell) * n);
+    memcpy(v->cell, stack, sizeof(*v->cell) * n);
+  }
+  return v;
+}
+
+static bool lformals_bind(lval *formals, lsym *sym) {
+  for (size_t i = 0; i < formals->count; i++) {
+    if (formals->cell[i]->sym == sym) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Whether a frame binding formals would shadow every binding in frame e.
+ * Lookups are dynamic, so code run from a tail call can reach e through
+ * eval or through any function it calls, not just through its own
+ * symbols. */
+static bool lenv_shadowed(lenv *e, lval *formals) {
+  for (size_t i = 0; i < lenv_slots(e); i++) {
+    if (e->syms[i] && !lformals_bind(formals, e->syms[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Copies the bindings of frame e that formals do not shadow into frame to,
+ * replacing older bindings of the same names. */
+static void lenv_carry(lenv *to, lenv *e, lval *formals) {
+  for (size_t i = 0; i < lenv_slots(e); i++) {
+    if (e->syms[i] && !lformals_bind(formals, e->syms[i])) {
+      lenv_set(to, e->syms[i], e->vals[i]);
+    }
+  }
+}
+
+/* Runs compiled code in frame e. A lambda or eval/if applied in tail
+ * position replaces the running code instead of recursing, so tail-recursive
+ * loops use constant C stack. The activation frame being left is deleted.
+ * Its bindings the callee's formals do not shadow are still visible to
+ * dynamic lookups, so they move into the carry frame, which sits between
+ * the callee's frame and the rest of the chain. The newest binding of a
+ * name wins, as it would have in a chain of the frames left, so carry only
+ * grows with the number of distinct names. */
+static lval *lvm_run(lenv *e, lcode *c) {
+  larena_mark mark = arena_mark();
+  lenv *act = 0, *carry = 0;
+  lcode *owned = 0;
+  lval **stack;
+  size_t sp;
+  lvm_frame frame = {.prev = gc.frames, .sp = &sp};
+  gc.frames = &frame;
+
+enter:
+  arena_release(mark);
+  stack = arena_alloc(sizeof(*stack) * c->depth);
+  frame.stack = stack;
+  sp = 0;
+  for (uint32_t *pc = c->ops;; pc++) {
+    uint32_t arg = OP_ARG(*pc);
+    switch (OP_CODE(*pc)) {
+    case OP_CONST:
+      stack[sp++] = lval_ref(c->consts[arg]);
+      break;
+    case OP_LOAD: {
+      lic *ic = &c->ics[arg];
+      if (ic->version == lenv_version && !c->consts[arg]->sym->nlocal) {
+        stack[sp++] = lval_ref(ic->val);
+      } else {
+        stack[sp++] = lvm_load(e, c->consts[arg], ic);
+      }
+      break;
+    }
+    case OP_APPLY: {
+      sp -= arg;
+      stack[sp] = lval_apply(e, lvm_args(&stack[sp], arg));
+      sp++;
+      break;
+    }
+    case OP_TAIL: {
+      sp -= arg;
+      lval *v = lvm_args(&stack[sp], arg);
+      lval *f = arg > 1 ? v->cell[0] : 0;
+      for (size_t i = 0; f && i < arg; i++) {
+        if (lval_type(v->cell[i]) == LTYPE_ERR) {
+          f = 0;
+        }
+      }
+      if (!f || lval_type(f) != LTYPE_FUN ||
+          (f->builtin && f->builtin != builtin_eval &&
+           f->builtin != builtin_if)) {
+        stack[sp++] = lval_apply(e, v);
+        break;
+      }
+      f = lval_pop(v, 0);
+      if (f->builtin) {
+        lval *x = f->builtin == builtin_eval ? eval_target(v) : if_target(v);
+        lval_delete(f);
+        if (lval_type(x) == LTYPE_ERR) {
+          stack[sp++] = x;
+          break;
+        }
+        lcode *code = lcode_branch(c, x);
+        lval_delete(x);
+        lcode_release(owned);
+        c = owned = code;
+        goto enter;
+      }
+      lcode *code = lcode_select(lval_target(f)->code);
+      lval *formals = lval_target(f)->formals;
+      bool carried = act && !lenv_shadowed(act, formals);
+      if (carried && !carry) {
+        carry = lenv_new();
+        carry->par = act->par;
+      }
+      lenv *next;
+      lval *x = lval_bind(carried ? carry : act ? act->par : e, f, v, &next);
+      if (x) {
+        lval_delete(f);
+        stack[sp++] = x;
+        break;
+      }
+      if (carried) {
+        lenv_carry(carry, act, formals);
+      }
+      lenv_delete(act);
+      e = act = next;
+      lcode_retain(code);
+      lval_delete(f);
+      lcode_release(owned);
+      c = owned = code;
+      goto enter;
+    }
+    case OP_RET: {
+      lval *ret = stack[sp - 1];
+      gc.frames = frame.prev;
+      arena_release(mark);
+      lcode_release(owned);
+      lenv_delete(act);
+      lenv_delete(carry);
+      return ret;
+    }
+    }
+  }
+}
+
+static void lval_print_exp(lval *v, char open, char end) {
+  putchar(open);
+  for (size_t i = 0; i < v->count; i++) {
+    lval_print(v->cell[i]);
+    if (i < v->count - 1) {
+      printf(" ");
+    }
+  }
+  putchar(end);
+}
+
+/* Prints the shortest form that reads back as d, keeping a decimal point
+ * so that it does not read back as an integer. */
+static void ldbl_print(double d) {
+  char buf[32];
+  for (int prec = 15; prec <= 17; prec++) {
+    snprintf(buf, sizeof(buf), "%.*g", prec, d);
+    if (strtod(buf, 0) == d) {
+      break;
+    }
+  }
+  if (buf[strspn(buf, "-0123456789")] == 0) {
+    strcat(buf, ".0");
+  }
+  fputs(buf, stdout);
+}
+
+/* Prints a string literal that reads back as s. */
+static void lstr_print(char *s, size_t len) {
+  static const char raw[] = "\a\b\f\n\r\t\v\\\"";
+  static const char esc[] = "abfnrtv\\\"";
+  putchar('"');
+  for (size_t i = 0; i < len; i++) {
+    char *c = s[i] ? strchr(raw, s[i]) : 0;
+    if (c) {
+      putchar('\\');
+      putchar(esc[c - raw]);
+    } else if (s[i] == 0) {
+      printf("\\0");
+    } else {
+      putchar(s[i]);
     }
   }
-  putchar(end);
+  putchar('"');
 }
 
 static void lval_print(lval *v) {
-  switch (v->type) {
+  switch (lval_type(v)) {
   case LTYPE_NUM:
-    printf("%ld", v->num);
+    printf("%ld", lval_numval(v));
+    break;
+  case LTYPE_DBL:
+    ldbl_print(v->dbl);
+    break;
+  case LTYPE_BIG:
+    lbig_print(&v->big);
+    break;
+  case LTYPE_VEC:
+    putchar('[');
+    for (size_t i = 0; i < v->vlen; i++) {
+      if (i > 0) {
+        putchar(' ');
+      }
+      lval_print(v->vbuf->items[v->voff + i]);
+    }
+    putchar(']');
+    break;
+  case LTYPE_STR:
+    lstr_print(lval_sdata(v), v->slen);
+    break;
+  case LTYPE_BYTES:
+    printf("#b\"");
+    for (size_t i = 0; i < v->slen; i++) {
+      printf("%02x", (unsigned char)lval_sdata(v)[i]);
+    }
+    putchar('"');
+    break;
+  case LTYPE_MAP: {
+    lval *kvs = lhamt_collect(v->hamt, lval_qexp(), true, true);
+    putchar('#');
+    lval_print(kvs);
+    lval_delete(kvs);
+    break;
+  }
+  case LTYPE_NVEC:
+    printf("#[");
+    for (size_t i = 0; i < v->len; i++) {
+      if (i > 0) {
+        putchar(' ');
+      }
+      ldbl_print(v->data[i]);
+    }
+    putchar(']');
     break;
   case LTYPE_ERR:
     printf("error: %s", v->err);
     break;
   case LTYPE_SYM:
-    printf("%s", v->sym);
+    printf("%s", v->sym->name);
     break;
   case LTYPE_SEXP:
     lval_print_exp(v, '(', ')');
@@ -456,6 +3315,12 @@ static void lval_print(lval *v) {
   case LTYPE_FUN:
     if (v->builtin) {
       printf("<builtin>");
+    } else if (v->target) {
+      printf("(<partial> ");
+      lval_print(v->target);
+      putchar(' ');
+      lval_print(v->bound);
+      putchar(')');
     } else {
       printf("(\\ ");
       lval_print(v->formals);
@@ -467,35 +3332,83 @@ static void lval_print(lval *v) {
   }
 }
 
+static lval *lval_ref(lval *v) {
+  if (!lval_is_fix(v)) {
+    v->refs++;
+  }
+  return v;
+}
+
+/* Shallow copy: children are shared with v. */
 static lval *lval_copy(lval *v) {
-  lval *ret = malloc(sizeof(lval));
-  *ret = (lval){.type = v->type};
+  if (lval_is_fix(v)) {
+    return v;
+  }
+  lval *ret = gc_alloc(sizeof(lval), GC_VAL);
+  *ret = (lval){.type = v->type, .refs = 1};
 
   switch (v->type) {
   case LTYPE_NUM:
     ret->num = v->num;
     break;
+  case LTYPE_DBL:
+    ret->dbl = v->dbl;
+    break;
+  case LTYPE_BIG:
+    ret->big = lval_bigval(v);
+    break;
+  case LTYPE_VEC:
+    ret->vbuf = v->vbuf;
+    ret->voff = v->voff;
+    ret->vlen = v->vlen;
+    ret->vbuf->refs++;
+    break;
+  case LTYPE_STR:
+  case LTYPE_BYTES:
+    ret->sbuf = v->sbuf;
+    ret->soff = v->soff;
+    ret->slen = v->slen;
+    ret->sbuf->refs++;
+    break;
+  case LTYPE_MAP:
+    ret->hamt = v->hamt;
+    ret->hsize = v->hsize;
+    if (ret->hamt) {
+      ret->hamt->refs++;
+    }
+    break;
+  case LTYPE_NVEC:
+    ret->len = v->len;
+    ret->data = malloc(sizeof(double) * (v->len ? v->len : 1));
+    memcpy(ret->data, v->data, sizeof(double) * v->len);
+    break;
   case LTYPE_FUN:
     if (v->builtin) {
       ret->builtin = v->builtin;
+    } else if (v->target) {
+      ret->target = lval_ref(v->target);
+      ret->bound = lval_ref(v->bound);
     } else {
-      ret->formals = lval_copy(v->formals);
-      ret->body = lval_copy(v->body);
-      ret->env = lenv_copy(v->env);
+      ret->formals = lval_ref(v->formals);
+      ret->body = lval_ref(v->body);
+      ret->code = lcode_retain(v->code);
     }
     break;
   case LTYPE_SYM:
-    ret->sym = strdup(v->sym);
+    ret->sym = v->sym;
+    ret->depth = v->depth;
+    ret->slot = v->slot;
     break;
   case LTYPE_ERR:
-    ret->err = v->err;
+    ret->err = strdup(v->err);
     break;
   case LTYPE_SEXP:
   case LTYPE_QEXP:
     ret->count = v->count;
-    ret->cell = malloc(sizeof(*ret->cell) * ret->count);
+    ret->cap = v->count;
+    ret->cell = ret->mem = malloc(sizeof(*ret->cell) * ret->count);
     for (size_t i = 0; i < v->count; i++) {
-      ret->cell[i] = lval_copy(v->cell[i]);
+      ret->cell[i] = lval_ref(v->cell[i]);
     }
     break;
   }
@@ -503,68 +3416,321 @@ static lval *lval_copy(lval *v) {
   return ret;
 }
 
-static lval *lval_read_num(mpc_ast_t *a) {
+/* Copy-on-write: returns v itself if it is the only reference, otherwise
+ * drops that reference in exchange for a private copy. */
+static lval *lval_mut(lval *v) {
+  if (lval_is_fix(v) || v->refs == 1) {
+    return v;
+  }
+  lval *ret = lval_copy(v);
+  lval_delete(v);
+  return ret;
+}
+
+static lval *lval_read_num(char *s) {
   errno = 0;
-  long num = strtol(a->contents, 0, 10);
-  if (errno == EINVAL || errno == ERANGE) {
-    return lval_err("Not a number: %s", a->contents);
+  if (strchr(s, '.')) {
+    /* strtod also sets ERANGE on underflow, where the result is a denormal
+     * or zero and is kept; only an overflow to infinity is rejected. */
+    double d = strtod(s, 0);
+    if (errno == ERANGE && fabs(d) == HUGE_VAL) {
+      return lval_err("Not a number: %s", s);
+    }
+    return lval_dbl(d);
+  }
+  long num = strtol(s, 0, 10);
+  if (errno == ERANGE) {
+    return lval_big(lbig_parse(s));
+  }
+  if (errno == EINVAL) {
+    return lval_err("Not a number: %s", s);
   }
   return lval_num(num);
 }
 
 static lval *lval_add(lval *v, lval *c) {
-  v->count++;
-  v->cell = realloc(v->cell, sizeof(*v->cell) * v->count);
-  v->cell[v->count - 1] = c;
+  size_t head = v->cell - v->mem;
+  if (head + v->count == v->cap) {
+    if (head > v->count) {
+      memmove(v->mem, v->cell, sizeof(*v->cell) * v->count);
+      v->cell = v->mem;
+    } else {
+      v->cap = v->cap ? v->cap * 2 : 4;
+      v->mem = realloc(v->mem, sizeof(*v->mem) * v->cap);
+      v->cell = v->mem + head;
+    }
+  }
+  v->cell[v->count++] = c;
   return v;
 }
 
-static lval *lval_read_children(lval *v, mpc_ast_t *a) {
-  for (size_t i = 0; i < a->children_num; i++) {
-    lval *c = lval_read(a->children[i]);
-    if (c) {
-      v = lval_add(v, c);
+/* The reader builds values straight from the source text in one pass.
+ * tok holds a NUL-terminated copy of the token being converted and depth
+ * counts the lists open around it. On a syntax error err is set to an
+ * error laid out as mpc printed them, "file:row:col: error: expected ...",
+ * and reading stops. */
+typedef struct lreader lreader;
+struct lreader {
+  char *filename;
+  char *src;
+  char *pos;
+  char *tok;
+  size_t tokcap;
+  int depth;
+  lval *err;
+};
+
+#define LREAD_EXPR "number, string, symbol, '('"
+
+/* Lists nest by recursion, so deeper input is refused rather than
+ * overflowing the C stack. */
+#define LREAD_MAX_DEPTH 1000
+
+static bool lread_is_digit(char c) { return c >= '0' && c <= '9'; }
+
+static bool lread_is_sym(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         lread_is_digit(c) || (c && strchr("_+-*/\\=<>!&", c));
+}
+
+static void lread_skip(lreader *r) {
+  for (;;) {
+    char c = *r->pos;
+    if (c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' ||
+        c == '\f') {
+      r->pos++;
+    } else if (c == ';') {
+      while (*r->pos && *r->pos != '\n') {
+        r->pos++;
+      }
+    } else {
+      return;
     }
   }
-  return v;
 }
 
-static lval *lval_read(mpc_ast_t *a) {
-  if (has_tag(a, "number")) {
-    return lval_read_num(a);
+static char *lread_token(lreader *r, char *start, char *end) {
+  size_t n = end - start;
+  if (n + 1 > r->tokcap) {
+    r->tokcap = (n + 1) * 2;
+    r->tok = realloc(r->tok, r->tokcap);
+  }
+  memcpy(r->tok, start, n);
+  r->tok[n] = 0;
+  r->pos = end;
+  return r->tok;
+}
+
+static lval *lread_fail(lreader *r, char *at, char *msg) {
+  size_t row = 1, col = 1;
+  for (char *p = r->src; p < at; p++) {
+    if (*p == '\n') {
+      row++;
+      col = 1;
+    } else {
+      col++;
+    }
+  }
+  r->err = lval_err("%s:%zu:%zu: error: %s", r->filename, row, col, msg);
+  return 0;
+}
+
+static lval *lread_error(lreader *r, char *at, char *expected) {
+  char quoted[4] = {'\'', *at, '\''};
+  char *found = quoted;
+  switch (*at) {
+  case 0:
+    found = "end of input";
+    break;
+  case ' ':
+    found = "space";
+    break;
+  case '\n':
+    found = "newline";
+    break;
+  case '\t':
+    found = "tab";
+    break;
+  }
+  char msg[256];
+  snprintf(msg, sizeof(msg), "expected %s at %s", expected, found);
+  return lread_fail(r, at, msg);
+}
+
+static lval *lread_expr(lreader *r);
+
+static lval *lread_list(lreader *r, lval *v, char close) {
+  if (r->depth == LREAD_MAX_DEPTH) {
+    lval_delete(v);
+    return lread_fail(r, r->pos - 1, "Maximum recursion depth exceeded!");
+  }
+  r->depth++;
+  for (;;) {
+    lread_skip(r);
+    if (*r->pos == close) {
+      r->pos++;
+      r->depth--;
+      return v;
+    }
+    lval *x = *r->pos ? lread_expr(r)
+                      : lread_error(r, r->pos,
+                                    close == ')' ? LREAD_EXPR ", '{' or ')'"
+                                                 : LREAD_EXPR ", '{' or '}'");
+    if (!x) {
+      lval_delete(v);
+      return 0;
+    }
+    v = lval_add(v, x);
+  }
+}
+
+/* The escapes are those lstr_print writes plus \' and \0. They are
+ * decoded in place into the token buffer and the length is counted, so a
+ * \0 survives; '0' maps to raw's terminator. */
+static lval *lread_string(lreader *r) {
+  char *p = r->pos + 1;
+  while (*p != '"') {
+    if (!*p) {
+      return lread_error(r, p, "'\"'");
+    }
+    p += p[0] == '\\' && p[1] ? 2 : 1;
   }
-  if (has_tag(a, "symbol")) {
-    return lval_sym(a->contents);
+  static const char esc[] = "abfnrtv\\\"'0";
+  static const char raw[] = "\a\b\f\n\r\t\v\\\"'";
+  char *s = lread_token(r, r->pos + 1, p), *o = s;
+  for (char *q = s; *q; q++) {
+    char *c = q[0] == '\\' && q[1] ? strchr(esc, q[1]) : 0;
+    *o++ = c ? raw[c - esc] : *q;
+    q += c != 0;
   }
-  if (has_tag(a, "qexp")) {
-    return lval_read_children(lval_qexp(), a);
+  r->pos = p + 1;
+  return lval_str(s, o - s);
+}
+
+static lval *lread_expr(lreader *r) {
+  char *p = r->pos;
+  switch (*p) {
+  case '(':
+    r->pos++;
+    return lread_list(r, lval_sexp(), ')');
+  case '{':
+    r->pos++;
+    return lread_list(r, lval_qexp(), '}');
+  case '"':
+    return lread_string(r);
   }
-  if (has_tag(a, ">") || has_tag(a, "sexp")) {
-    return lval_read_children(lval_sexp(), a);
+
+  /* Numbers are tried first, as -?[0-9]+(\.[0-9]+)?, so "-" alone and
+   * "-x" are symbols. */
+  p += *p == '-';
+  if (lread_is_digit(*p)) {
+    while (lread_is_digit(*p)) {
+      p++;
+    }
+    if (p[0] == '.' && lread_is_digit(p[1])) {
+      for (p++; lread_is_digit(*p); p++) {
+      }
+    }
+    return lval_read_num(lread_token(r, r->pos, p));
   }
-  return 0;
+
+  for (p = r->pos; lread_is_sym(*p); p++) {
+  }
+  if (p == r->pos) {
+    return lread_error(r, p, LREAD_EXPR " or '{'");
+  }
+  return lval_sym(lread_token(r, r->pos, p));
+}
+
+/* Reads every expression in src into an S-Expression, or returns the
+ * first syntax error. */
+static lval *lval_read(char *filename, char *src) {
+  lreader r = {.filename = filename, .src = src, .pos = src};
+  lval *v = lval_sexp();
+  for (lread_skip(&r); *r.pos; lread_skip(&r)) {
+    lval *x = lread_expr(&r);
+    if (!x) {
+      lval_delete(v);
+      v = r.err;
+      break;
+    }
+    v = lval_add(v, x);
+  }
+  free(r.tok);
+  return v;
 }
 
 static lenv *lenv_new() {
-  lenv *e = malloc(sizeof(*e));
+  lenv *e = gc_alloc(sizeof(*e), GC_ENV);
   *e = (lenv){0};
   return e;
 }
 
-static lenv *lenv_copy(lenv *e) {
-  lenv *c = lenv_new();
-  *c = (lenv){.par = e->par};
-  for (size_t i = 0; i < e->count; i++) {
-    lenv_put(c, lval_sym(e->syms[i]), e->vals[i]);
+static bool lenv_hashed(lenv *e) { return e->cap > LENV_LINEAR_MAX; }
+
+static size_t lenv_slots(lenv *e) {
+  return lenv_hashed(e) ? e->cap : e->count;
+}
+
+static lval **lenv_find(lenv *e, lsym *k) {
+  if (!lenv_hashed(e)) {
+    for (size_t i = 0; i < e->count; i++) {
+      if (e->syms[i] == k) {
+        return &e->vals[i];
+      }
+    }
+    return 0;
   }
-  return c;
+  for (size_t i = k->hash & (e->cap - 1); e->syms[i];
+       i = (i + 1) & (e->cap - 1)) {
+    if (e->syms[i] == k) {
+      return &e->vals[i];
+    }
+  }
+  return 0;
+}
+
+static void lenv_insert(lenv *e, lsym *k, lval *v) {
+  size_t i = e->count;
+  if (lenv_hashed(e)) {
+    for (i = k->hash & (e->cap - 1); e->syms[i]; i = (i + 1) & (e->cap - 1)) {
+    }
+  }
+  e->syms[i] = k;
+  e->vals[i] = v;
+  e->count++;
+}
+
+static void lenv_grow(lenv *e) {
+  if (e->cap < LENV_LINEAR_MAX) {
+    e->cap = e->cap ? e->cap * 2 : 2;
+    e->syms = realloc(e->syms, sizeof(*e->syms) * e->cap);
+    e->vals = realloc(e->vals, sizeof(*e->vals) * e->cap);
+    return;
+  }
+  lenv old = *e;
+  e->count = 0;
+  e->cap = e->cap < 4 * LENV_LINEAR_MAX ? 4 * LENV_LINEAR_MAX : e->cap * 2;
+  e->syms = calloc(e->cap, sizeof(*e->syms));
+  e->vals = malloc(sizeof(*e->vals) * e->cap);
+  for (size_t i = 0; i < lenv_slots(&old); i++) {
+    if (old.syms[i]) {
+      lenv_insert(e, old.syms[i], old.vals[i]);
+    }
+  }
+  free(old.syms);
+  free(old.vals);
 }
 
 static void lenv_delete(lenv *e) {
   if (e) {
-    for (size_t i = 0; i < e->count; i++) {
-      free(e->syms[i]);
-      lval_delete(e->vals[i]);
+    for (size_t i = 0; i < lenv_slots(e); i++) {
+      if (e->syms[i]) {
+        if (e->par) {
+          e->syms[i]->nlocal--;
+        }
+        lval_delete(e->vals[i]);
+      }
     }
     if (e->syms) {
       free(e->syms);
@@ -572,40 +3738,48 @@ static void lenv_delete(lenv *e) {
     if (e->vals) {
       free(e->vals);
     }
-    free(e);
+    gc_free(e);
   }
 }
 
 static lval *lenv_get(lenv *e, lval *k) {
-  if (k->type != LTYPE_SYM) {
-    return lval_err("Not a symbol: %s", ltype_name(k->type));
+  if (lval_type(k) != LTYPE_SYM) {
+    return lval_err("Not a symbol: %s", ltype_name(lval_type(k)));
   }
-  for (size_t i = 0; i < e->count; i++) {
-    if (streq(e->syms[i], k->sym)) {
-      return lval_copy(e->vals[i]);
+  for (; e; e = e->par) {
+    lval **slot = lenv_find(e, k->sym);
+    if (slot) {
+      return lval_ref(*slot);
     }
   }
+  return lval_err("Unbound symbol %s", k->sym->name);
+}
+
+static void lenv_set(lenv *e, lsym *sym, lval *v) {
+  if (!e->par) {
+    lenv_version++;
+    sym->defs++;
+  }
+  lval **slot = lenv_find(e, sym);
+  if (slot) {
+    lval_delete(*slot);
+    *slot = lval_ref(v);
+    return;
+  }
+  if (lenv_hashed(e) ? (e->count + 1) * 2 > e->cap : e->count == e->cap) {
+    lenv_grow(e);
+  }
   if (e->par) {
-    return lenv_get(e->par, k);
+    sym->nlocal++;
   }
-  return lval_err("Unbound symbol %s", k->sym);
+  lenv_insert(e, sym, lval_ref(v));
 }
 
 static void lenv_put(lenv *e, lval *k, lval *v) {
-  if (k->type != LTYPE_SYM) {
+  if (lval_type(k) != LTYPE_SYM) {
     return;
   }
-  for (size_t i = 0; i < e->count; i++) {
-    if (streq(e->syms[i], k->sym)) {
-      e->vals[i] = lval_copy(v);
-      return;
-    }
-  }
-  e->count++;
-  e->syms = realloc(e->syms, sizeof(*e->syms) * e->count);
-  e->vals = realloc(e->vals, sizeof(*e->vals) * e->count);
-  e->syms[e->count - 1] = strdup(k->sym);
-  e->vals[e->count - 1] = lval_copy(v);
+  lenv_set(e, k->sym, v);
 }
 
 static void lenv_def(lenv *e, lval *k, lval *v) {
@@ -615,6 +3789,259 @@ static void lenv_def(lenv *e, lval *k, lval *v) {
   lenv_put(e, k, v);
 }
 
+static bool gc_visit(void *p) {
+  if (!p || lval_is_fix(p) || GC_HDR(p)->mark) {
+    return false;
+  }
+  GC_HDR(p)->mark = true;
+  return true;
+}
+
+static void gc_mark_env(lenv *e);
+
+static void gc_mark_val(lval *);
+
+static void gc_mark_code(lcode *c) {
+  for (; c; c = c->fallback) {
+    for (size_t i = 0; i < c->nconsts; i++) {
+      gc_mark_val(c->consts[i]);
+      if (c->subs) {
+        gc_mark_code(c->subs[i]);
+      }
+    }
+  }
+}
+
+static void gc_mark_hamt(lhamt *n) {
+  for (size_t i = 0; n && i < n->count; i++) {
+    lhamt_slot *s = &n->slots[i];
+    if (s->key) {
+      gc_mark_val(s->key);
+      gc_mark_val(s->val);
+    } else {
+      gc_mark_hamt(s->node);
+    }
+  }
+}
+
+static void gc_mark_val(lval *v) {
+  if (!gc_visit(v)) {
+    return;
+  }
+  switch (v->type) {
+  case LTYPE_SEXP:
+  case LTYPE_QEXP:
+    for (size_t i = 0; i < v->count; i++) {
+      gc_mark_val(v->cell[i]);
+    }
+    break;
+  case LTYPE_FUN:
+    gc_mark_val(v->formals);
+    gc_mark_val(v->body);
+    gc_mark_val(v->target);
+    gc_mark_val(v->bound);
+    gc_mark_code(v->code);
+    break;
+  case LTYPE_VEC:
+    /* Items outside the view stay reachable through the shared store. */
+    for (size_t i = 0; i < v->vbuf->len; i++) {
+      gc_mark_val(v->vbuf->items[i]);
+    }
+    break;
+  case LTYPE_MAP:
+    gc_mark_hamt(v->hamt);
+    break;
+  default:
+    break;
+  }
+}
+
+static void gc_mark_env(lenv *e) {
+  for (; gc_visit(e); e = e->par) {
+    for (size_t i = 0; i < lenv_slots(e); i++) {
+      if (e->syms[i]) {
+        gc_mark_val(e->vals[i]);
+      }
+    }
+  }
+}
+
+/* Drops the reference an unreachable object holds on p if p survives. */
+static void gc_unref(lval *p) {
+  if (p && !lval_is_fix(p) && GC_HDR(p)->mark) {
+    p->refs--;
+  }
+}
+
+static void gc_unlink_code(lcode *c) {
+  if (!c || --c->refs > 0) {
+    return;
+  }
+  for (size_t i = 0; i < c->nconsts; i++) {
+    gc_unref(c->consts[i]);
+    if (c->subs) {
+      gc_unlink_code(c->subs[i]);
+    }
+  }
+  gc_unlink_code(c->fallback);
+  free(c->consts);
+  free(c->ics);
+  free(c->subs);
+  free(c->ops);
+  free(c->deps);
+  free(c);
+}
+
+static void gc_unlink_hamt(lhamt *n) {
+  if (!n || --n->refs > 0) {
+    return;
+  }
+  for (size_t i = 0; i < n->count; i++) {
+    lhamt_slot *s = &n->slots[i];
+    if (s->key) {
+      gc_unref(s->key);
+      gc_unref(s->val);
+    } else {
+      gc_unlink_hamt(s->node);
+    }
+  }
+  free(n);
+}
+
+static void gc_unlink(lgc *h) {
+  if (h->kind == GC_ENV) {
+    lenv *e = (lenv *)(h + 1);
+    for (size_t i = 0; i < lenv_slots(e); i++) {
+      if (e->syms[i]) {
+        gc_unref(e->vals[i]);
+      }
+    }
+    return;
+  }
+  lval *v = (lval *)(h + 1);
+  switch (v->type) {
+  case LTYPE_SEXP:
+  case LTYPE_QEXP:
+    for (size_t i = 0; i < v->count; i++) {
+      gc_unref(v->cell[i]);
+    }
+    break;
+  case LTYPE_FUN:
+    gc_unref(v->formals);
+    gc_unref(v->body);
+    gc_unref(v->target);
+    gc_unref(v->bound);
+    gc_unlink_code(v->code);
+    break;
+  case LTYPE_VEC:
+    if (--v->vbuf->refs == 0) {
+      for (size_t i = 0; i < v->vbuf->len; i++) {
+        gc_unref(v->vbuf->items[i]);
+      }
+      free(v->vbuf->items);
+      free(v->vbuf);
+    }
+    break;
+  case LTYPE_MAP:
+    gc_unlink_hamt(v->hamt);
+    break;
+  default:
+    break;
+  }
+}
+
+static void gc_release(lgc *h) {
+  if (h->kind == GC_ENV) {
+    lenv *e = (lenv *)(h + 1);
+    for (size_t i = 0; e->par && i < lenv_slots(e); i++) {
+      if (e->syms[i]) {
+        e->syms[i]->nlocal--;
+      }
+    }
+    free(e->syms);
+    free(e->vals);
+  } else {
+    lval *v = (lval *)(h + 1);
+    if (v->type == LTYPE_ERR) {
+      free(v->err);
+    } else if (v->type == LTYPE_SEXP || v->type == LTYPE_QEXP) {
+      free(v->mem);
+    } else if (v->type == LTYPE_NVEC) {
+      free(v->data);
+    } else if (v->type == LTYPE_BIG) {
+      free(v->big.d);
+    } else if (v->type == LTYPE_STR || v->type == LTYPE_BYTES) {
+      lsbuf_release(v->sbuf);
+    }
+  }
+  gc_free(h + 1);
+}
+
+static double gc_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Must only be called when every live value is reachable from gc.root or a
+ * registered VM frame, i.e. between top-level evaluations of the REPL or of
+ * a file named on the command line. */
+static void gc_collect() {
+  double start = gc_now();
+  gc_mark_env(gc.root);
+  for (lvm_frame *f = gc.frames; f; f = f->prev) {
+    for (size_t i = 0; i < *f->sp; i++) {
+      gc_mark_val(f->stack[i]);
+    }
+  }
+  for (lgc *h = gc.heap.next; h != &gc.heap; h = h->next) {
+    if (!h->mark) {
+      gc_unlink(h);
+    }
+  }
+  for (lgc *h = gc.heap.next, *next; h != &gc.heap; h = next) {
+    next = h->next;
+    if (h->mark) {
+      h->mark = false;
+    } else {
+      gc_release(h);
+      gc.freed++;
+    }
+  }
+  gc.collections++;
+  gc.pause_last = gc_now() - start;
+  gc.pause_total += gc.pause_last;
+  if (gc.pause_last > gc.pause_max) {
+    gc.pause_max = gc.pause_last;
+  }
+}
+
+static void gc_safepoint() {
+  if (gc.enabled && gc.objects > gc.threshold) {
+    gc_collect();
+    gc.threshold = gc.objects * 2;
+    if (gc.threshold < GC_MIN_HEAP) {
+      gc.threshold = GC_MIN_HEAP;
+    }
+  }
+}
+
+/* Takes an empty Q-Expression, since a call needs at least one argument. */
+static lval *builtin_gc_stats(lenv *e, lval *v) {
+  LASSERT_NUM("gc-stats", v, 1);
+  LASSERT_TYPE("gc-stats", v, 0, LTYPE_QEXP);
+  lval_delete(v);
+  lval *x = lval_qexp();
+  x = lval_add(x, lval_num(gc.objects));
+  x = lval_add(x, lval_num(gc.bytes));
+  x = lval_add(x, lval_num(gc.collections));
+  x = lval_add(x, lval_num(gc.freed));
+  x = lval_add(x, lval_num(gc.pause_last * 1e6));
+  x = lval_add(x, lval_num(gc.pause_max * 1e6));
+  x = lval_add(x, lval_num(gc.pause_total * 1e6));
+  return x;
+}
+
 static void lenv_add_builtin(lenv *e, char *name, lbuiltin fun) {
   lval *k = lval_sym(name);
   lval *v = lval_fun(fun);
@@ -636,38 +4063,76 @@ static void lenv_add_builtins(lenv *e) {
   lenv_add_builtin(e, "-", builtin_sub);
   lenv_add_builtin(e, "*", builtin_mul);
   lenv_add_builtin(e, "/", builtin_div);
+  lenv_add_builtin(e, "gc-stats", builtin_gc_stats);
+  lenv_add_builtin(e, "if", builtin_if);
+  lenv_add_builtin(e, ">", builtin_gt);
+  lenv_add_builtin(e, "<", builtin_lt);
+  lenv_add_builtin(e, ">=", builtin_ge);
+  lenv_add_builtin(e, "<=", builtin_le);
+  lenv_add_builtin(e, "==", builtin_eq);
+  lenv_add_builtin(e, "!=", builtin_ne);
+  lenv_add_builtin(e, "nvec", builtin_nvec);
+  lenv_add_builtin(e, "iota", builtin_iota);
+  lenv_add_builtin(e, "sum", builtin_sum);
+  lenv_add_builtin(e, "dot", builtin_dot);
+  lenv_add_builtin(e, "vec", builtin_vec);
+  lenv_add_builtin(e, "len", builtin_len);
+  lenv_add_builtin(e, "nth", builtin_nth);
+  lenv_add_builtin(e, "slice", builtin_slice);
+  lenv_add_builtin(e, "push", builtin_push);
+  lenv_add_builtin(e, "map", builtin_map);
+  lenv_add_builtin(e, "assoc", builtin_assoc);
+  lenv_add_builtin(e, "dissoc", builtin_dissoc);
+  lenv_add_builtin(e, "get", builtin_get);
+  lenv_add_builtin(e, "keys", builtin_keys);
+  lenv_add_builtin(e, "vals", builtin_vals);
+  lenv_add_builtin(e, "pairs", builtin_pairs);
+  lenv_add_builtin(e, "concat", builtin_concat);
+  lenv_add_builtin(e, "bytes", builtin_bytes);
+  lenv_add_builtin(e, "string", builtin_string);
+  lenv_add_builtin(e, "load", builtin_load);
 }
 
 int main(int argc, char **argv) {
-  mpc_parser_t *Number = mpc_new("number");
-  mpc_parser_t *Symbol = mpc_new("symbol");
-  mpc_parser_t *Sexp = mpc_new("sexp");
-  mpc_parser_t *Qexp = mpc_new("qexp");
-  mpc_parser_t *Expr = mpc_new("expr");
-  mpc_parser_t *Lispy = mpc_new("lispy");
-
-  mpca_lang(MPCA_LANG_DEFAULT,
-            "number: /-?[0-9]+/ ;\n"
-            "symbol: /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;\n"
-            "sexp: '(' <expr>* ')' ;\n"
-            "qexp: '{' <expr>* '}' ;\n"
-            "expr: <number> | <symbol> | <sexp> | <qexp> ;\n"
-            "lispy: /^/ <expr>* /$/ ;\n",
-            Number, Symbol, Sexp, Qexp, Expr, Lispy);
-
-  mpc_result_t r = {0};
+  for (int i = 1; i < argc; i++) {
+    if (streq(argv[i], "--gc")) {
+      gc.enabled = true;
+    }
+  }
+
+  lvec_init();
   lenv *e = lenv_new();
+  gc.root = e;
 
   lenv_add_builtins(e);
 
-  while (1) {
+  /* Files named on the command line are loaded in place of the REPL. */
+  bool files = false;
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--", 2) == 0) {
+      continue;
+    }
+    files = true;
+    lval *x = lval_load(e, argv[i], true);
+    if (lval_type(x) == LTYPE_ERR) {
+      lval_print(x);
+      printf("\n");
+    }
+    lval_delete(x);
+  }
+
+  while (!files) {
     char *input = readline("lispy> ");
+    if (!input) {
+      break;
+    }
     add_history(input);
 
-    if (mpc_parse("<stdin>", input, Lispy, &r)) {
-      mpc_ast_t *a = r.output;
-      lval *v = lval_read(a);
-
+    lval *v = lval_read("<stdin>", input);
+    if (lval_type(v) == LTYPE_ERR) {
+      puts(v->err);
+      lval_delete(v);
+    } else {
       lval_print(v);
       printf("\n");
 
@@ -676,15 +4141,21 @@ int main(int argc, char **argv) {
       printf("\n");
 
       lval_delete(x);
-      mpc_ast_delete(a);
-    } else {
-      mpc_err_print(r.error);
-      mpc_err_delete(r.error);
     }
+    free(input);
+    arena_reset();
+    gc_safepoint();
+  }
+
+  if (gc.enabled) {
+    fprintf(stderr,
+            "gc: %zu objects, %zu bytes live, %zu collections, %zu freed, "
+            "pause max %.3fms total %.3fms\n",
+            gc.objects, gc.bytes, gc.collections, gc.freed,
+            gc.pause_max * 1e3, gc.pause_total * 1e3);
   }
 
   lenv_delete(e);
-  mpc_cleanup(6, Number, Symbol, Sexp, Qexp, Expr, Lispy);
 
   return 0;
 }
@@ -1,5 +1,10 @@
 #include "mpc.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MPC_SPAN_X86
+#include <immintrin.h>
+#endif
+
 /*
 ** State Type
 */
@@ -33,7 +38,8 @@ static mpc_state_t mpc_state_new(void) {
 ** String is easy. The whole contents are
 ** loaded into a buffer and scanned through.
 ** The cursor can jump around at will making
-** backtracking easy.
+** backtracking easy. A borrowed String scans
+** the caller's buffer directly with no copy.
 **
 ** The second is a File which is also somewhat
 ** easy. The contents are never loaded into
@@ -75,6 +81,34 @@ typedef struct {
   char mem[64];
 } mpc_mem_t;
 
+/*
+** Memo entries are keyed on the parser, the
+** input position and three flags: suppress,
+** backtrack, and state.term, which is set once
+** end of input has been matched. These are the
+** only other inputs that change how a parser
+** behaves at a position.
+** The state after the parser ran is recorded so
+** a hit can jump straight to it.
+*/
+
+enum {
+  MPC_MEMO_SLOTS_MIN = 256,
+  MPC_MEMO_BYTES_DEFAULT = 16 * 1024 * 1024
+};
+
+typedef struct {
+  mpc_parser_t *p;
+  long pos;
+  int flags;
+  int success;
+  int kept;
+  mpc_state_t state;
+  char last;
+  mpc_dtor_t dx;
+  mpc_result_t r;
+} mpc_memo_entry_t;
+
 typedef struct {
 
   int type;
@@ -82,8 +116,11 @@ typedef struct {
   mpc_state_t state;
 
   char *string;
+  size_t length;
   char *buffer;
   FILE *file;
+  int borrowed;
+  int spans;
 
   int suppress;
   int backtrack;
@@ -98,6 +135,12 @@ typedef struct {
   char mem_full[MPC_INPUT_MEM_NUM];
   mpc_mem_t mem[MPC_INPUT_MEM_NUM];
 
+  mpc_memo_t memo;
+  size_t memo_slots;
+  size_t memo_num;
+  mpc_memo_entry_t *memo_table;
+  long depth_fails;
+
 } mpc_input_t;
 
 static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
@@ -110,10 +153,13 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
 
   i->state = mpc_state_new();
 
-  i->string = malloc(strlen(string) + 1);
+  i->length = strlen(string);
+  i->string = malloc(i->length + 1);
   strcpy(i->string, string);
   i->buffer = NULL;
   i->file = NULL;
+  i->borrowed = 0;
+  i->spans = 0;
 
   i->suppress = 0;
   i->backtrack = 1;
@@ -126,6 +172,13 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
+  memset(&i->memo, 0, sizeof(mpc_memo_t));
+  i->memo.max_bytes = MPC_MEMO_BYTES_DEFAULT;
+  i->memo_slots = 0;
+  i->memo_num = 0;
+  i->memo_table = NULL;
+  i->depth_fails = 0;
+
   return i;
 }
 
@@ -139,11 +192,14 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
 
   i->state = mpc_state_new();
 
+  i->length = length;
   i->string = malloc(length + 1);
   strncpy(i->string, string, length);
   i->string[length] = '\0';
   i->buffer = NULL;
   i->file = NULL;
+  i->borrowed = 0;
+  i->spans = 0;
 
   i->suppress = 0;
   i->backtrack = 1;
@@ -156,6 +212,58 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
+  memset(&i->memo, 0, sizeof(mpc_memo_t));
+  i->memo.max_bytes = MPC_MEMO_BYTES_DEFAULT;
+  i->memo_slots = 0;
+  i->memo_num = 0;
+  i->memo_table = NULL;
+  i->depth_fails = 0;
+
+  return i;
+
+}
+
+/*
+** Borrowed input reads straight from the caller's
+** buffer. It need not be NUL terminated; reads past
+** `length` see '\0' just as they would on a copy.
+*/
+
+static mpc_input_t *mpc_input_new_borrowed(const char *filename, const char *string, size_t length) {
+
+  mpc_input_t *i = malloc(sizeof(mpc_input_t));
+
+  i->filename = malloc(strlen(filename) + 1);
+  strcpy(i->filename, filename);
+  i->type = MPC_INPUT_STRING;
+
+  i->state = mpc_state_new();
+
+  i->length = length;
+  i->string = (char*)string;
+  i->buffer = NULL;
+  i->file = NULL;
+  i->borrowed = 1;
+  i->spans = 0;
+
+  i->suppress = 0;
+  i->backtrack = 1;
+  i->marks_num = 0;
+  i->marks_slots = MPC_INPUT_MARKS_MIN;
+  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
+  i->lasts = malloc(sizeof(char) * i->marks_slots);
+  i->last = '\0';
+
+  i->mem_index = 0;
+  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+
+  memset(&i->memo, 0, sizeof(mpc_memo_t));
+  i->memo.max_bytes = MPC_MEMO_BYTES_DEFAULT;
+  i->memo_slots = 0;
+  i->memo_num = 0;
+  i->memo_table = NULL;
+  i->depth_fails = 0;
+
   return i;
 
 }
@@ -171,8 +279,11 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->state = mpc_state_new();
 
   i->string = NULL;
+  i->length = 0;
   i->buffer = NULL;
   i->file = pipe;
+  i->borrowed = 0;
+  i->spans = 0;
 
   i->suppress = 0;
   i->backtrack = 1;
@@ -185,6 +296,13 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
+  memset(&i->memo, 0, sizeof(mpc_memo_t));
+  i->memo.max_bytes = MPC_MEMO_BYTES_DEFAULT;
+  i->memo_slots = 0;
+  i->memo_num = 0;
+  i->memo_table = NULL;
+  i->depth_fails = 0;
+
   return i;
 
 }
@@ -199,8 +317,11 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->state = mpc_state_new();
 
   i->string = NULL;
+  i->length = 0;
   i->buffer = NULL;
   i->file = file;
+  i->borrowed = 0;
+  i->spans = 0;
 
   i->suppress = 0;
   i->backtrack = 1;
@@ -213,14 +334,35 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
+  memset(&i->memo, 0, sizeof(mpc_memo_t));
+  i->memo.max_bytes = MPC_MEMO_BYTES_DEFAULT;
+  i->memo_slots = 0;
+  i->memo_num = 0;
+  i->memo_table = NULL;
+  i->depth_fails = 0;
+
   return i;
 }
 
+static void mpc_input_memo_clear(mpc_input_t *i) {
+  size_t j;
+  mpc_memo_entry_t *m;
+  for (j = 0; j < i->memo_slots; j++) {
+    m = &i->memo_table[j];
+    if (!m->p) { continue; }
+    if (!m->kept) { continue; }
+    if (m->success && m->r.output) { m->dx(m->r.output); }
+    if (!m->success && m->r.error) { mpc_err_delete(m->r.error); }
+  }
+  free(i->memo_table);
+}
+
 static void mpc_input_delete(mpc_input_t *i) {
 
   free(i->filename);
+  mpc_input_memo_clear(i);
 
-  if (i->type == MPC_INPUT_STRING) { free(i->string); }
+  if (i->type == MPC_INPUT_STRING && !i->borrowed) { free(i->string); }
   if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
 
   free(i->marks);
@@ -373,7 +515,8 @@ static char mpc_input_getc(mpc_input_t *i) {
 
   switch (i->type) {
 
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_STRING:
+      return (size_t)i->state.pos < i->length ? i->string[i->state.pos] : '\0';
     case MPC_INPUT_FILE: c = fgetc(i->file); return c;
     case MPC_INPUT_PIPE:
 
@@ -396,7 +539,8 @@ static char mpc_input_peekc(mpc_input_t *i) {
   char c = '\0';
 
   switch (i->type) {
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_STRING:
+      return (size_t)i->state.pos < i->length ? i->string[i->state.pos] : '\0';
     case MPC_INPUT_FILE:
 
       c = fgetc(i->file);
@@ -562,6 +706,147 @@ static int mpc_input_eoi(mpc_input_t* i, char **o) {
   }
 }
 
+/*
+** Character class spans consume the longest run
+** of bytes in a 256-bit class in one go. The
+** class bitmap is laid out by low nibble: byte
+** `lo` of the first half holds bit `hi` for every
+** character `hi * 16 + lo` with `hi < 8`, and the
+** second half does the same for `hi >= 8`. That
+** lets SSSE3/AVX2 test 16 or 32 bytes at a time
+** with two shuffles by the low nibble and one by
+** the high nibble. NUL is never in a class so the
+** scan also stops at the end of a string.
+*/
+
+static int mpc_span_has(const unsigned char *rows, char c) {
+  unsigned char u = (unsigned char)c;
+  return (rows[(u >> 7) * 16 + (u & 15)] >> ((u >> 4) & 7)) & 1;
+}
+
+static void mpc_span_add(unsigned char *rows, char c) {
+  unsigned char u = (unsigned char)c;
+  if (u == 0) { return; }
+  rows[(u >> 7) * 16 + (u & 15)] |= (unsigned char)(1 << ((u >> 4) & 7));
+}
+
+static size_t mpc_span_scalar(const unsigned char *rows, const char *s, size_t n) {
+  size_t j = 0;
+  while (j < n && mpc_span_has(rows, s[j])) { j++; }
+  return j;
+}
+
+#ifdef MPC_SPAN_X86
+
+__attribute__((target("ssse3")))
+static size_t mpc_span_ssse3(const unsigned char *rows, const char *s, size_t n) {
+
+  size_t j;
+  unsigned m;
+  __m128i v, lo, hi, sel, row;
+  __m128i lo_rows = _mm_loadu_si128((const __m128i*)rows);
+  __m128i hi_rows = _mm_loadu_si128((const __m128i*)(rows + 16));
+  __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+  __m128i nibble = _mm_set1_epi8(0x0f);
+
+  for (j = 0; j + 16 <= n; j += 16) {
+    v = _mm_loadu_si128((const __m128i*)(s + j));
+    lo = _mm_and_si128(v, nibble);
+    hi = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+    sel = _mm_cmplt_epi8(v, _mm_setzero_si128());
+    row = _mm_or_si128(
+      _mm_andnot_si128(sel, _mm_shuffle_epi8(lo_rows, lo)),
+      _mm_and_si128(sel, _mm_shuffle_epi8(hi_rows, lo)));
+    row = _mm_and_si128(row, _mm_shuffle_epi8(bits, hi));
+    m = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(row, _mm_setzero_si128()));
+    if (m) { return j + __builtin_ctz(m); }
+  }
+
+  return j + mpc_span_scalar(rows, s + j, n - j);
+}
+
+__attribute__((target("avx2")))
+static size_t mpc_span_avx2(const unsigned char *rows, const char *s, size_t n) {
+
+  size_t j;
+  unsigned m;
+  __m256i v, lo, hi, row;
+  __m256i lo_rows = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)rows));
+  __m256i hi_rows = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(rows + 16)));
+  __m256i bits = _mm256_broadcastsi128_si256(
+    _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128));
+  __m256i nibble = _mm256_set1_epi8(0x0f);
+
+  for (j = 0; j + 32 <= n; j += 32) {
+    v = _mm256_loadu_si256((const __m256i*)(s + j));
+    lo = _mm256_and_si256(v, nibble);
+    hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+    row = _mm256_blendv_epi8(
+      _mm256_shuffle_epi8(lo_rows, lo),
+      _mm256_shuffle_epi8(hi_rows, lo), v);
+    row = _mm256_and_si256(row, _mm256_shuffle_epi8(bits, hi));
+    m = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(row, _mm256_setzero_si256()));
+    if (m) { return j + __builtin_ctz(m); }
+  }
+
+  return j + mpc_span_ssse3(rows, s + j, n - j);
+}
+
+#endif
+
+static size_t (*mpc_span_run)(const unsigned char *rows, const char *s, size_t n) = NULL;
+
+static size_t mpc_span(const unsigned char *rows, const char *s, size_t n) {
+  if (mpc_span_run == NULL) {
+    mpc_span_run = mpc_span_scalar;
+#ifdef MPC_SPAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) { mpc_span_run = mpc_span_ssse3; }
+    if (__builtin_cpu_supports("avx2"))  { mpc_span_run = mpc_span_avx2; }
+#endif
+  }
+  return mpc_span_run(rows, s, n);
+}
+
+static int mpc_input_span(mpc_input_t *i, const unsigned char *rows, char **o) {
+
+  size_t j, n = 0, slots = 16;
+  const char *s;
+  char c;
+
+  if (i->type == MPC_INPUT_STRING) {
+
+    s = i->string + i->state.pos;
+    n = mpc_span(rows, s, i->length - i->state.pos);
+
+    for (j = 0; j < n; j++) {
+      i->state.col++;
+      if (s[j] == '\n') {
+        i->state.col = 0;
+        i->state.row++;
+      }
+    }
+    i->state.pos += n;
+    if (n) { i->last = s[n-1]; }
+
+    *o = mpc_malloc(i, n + 1);
+    memcpy(*o, s, n);
+    (*o)[n] = '\0';
+    return n > 0;
+  }
+
+  *o = mpc_malloc(i, slots);
+  while (!mpc_input_terminated(i)) {
+    c = mpc_input_getc(i);
+    if (!mpc_span_has(rows, c)) { mpc_input_failure(i, c); break; }
+    mpc_input_success(i, c, NULL);
+    if (n + 1 == slots) { slots *= 2; *o = mpc_realloc(i, *o, slots); }
+    (*o)[n++] = c;
+  }
+  (*o)[n] = '\0';
+  return n > 0;
+}
+
 static mpc_state_t *mpc_input_state_copy(mpc_input_t *i) {
   mpc_state_t *r = mpc_malloc(i, sizeof(mpc_state_t));
   memcpy(r, &i->state, sizeof(mpc_state_t));
@@ -728,6 +1013,30 @@ static mpc_err_t *mpc_err_export(mpc_input_t *i, mpc_err_t *x) {
   return mpc_export(i, x);
 }
 
+static mpc_err_t *mpc_err_copy(mpc_err_t *x) {
+  int j;
+  mpc_err_t *y;
+  if (x == NULL) { return NULL; }
+  y = malloc(sizeof(mpc_err_t));
+  *y = *x;
+  y->filename = malloc(strlen(x->filename) + 1);
+  strcpy(y->filename, x->filename);
+  y->failure = NULL;
+  if (x->failure) {
+    y->failure = malloc(strlen(x->failure) + 1);
+    strcpy(y->failure, x->failure);
+  }
+  y->expected = NULL;
+  if (x->expected_num) {
+    y->expected = malloc(sizeof(char*) * x->expected_num);
+  }
+  for (j = 0; j < x->expected_num; j++) {
+    y->expected[j] = malloc(strlen(x->expected[j]) + 1);
+    strcpy(y->expected[j], x->expected[j]);
+  }
+  return y;
+}
+
 static int mpc_err_contains_expected(mpc_input_t *i, mpc_err_t *x, char *expected) {
   int j;
   (void)i;
@@ -878,6 +1187,283 @@ static mpc_err_t *mpc_err_merge(mpc_input_t *i, mpc_err_t *x, mpc_err_t *y) {
   return mpc_err_or(i, errs, 2);
 }
 
+/*
+** DFA Type
+**
+** Regexes compiled with `MPC_RE_DFA` become a
+** Thompson NFA whose DFA states are built lazily,
+** the first time each (state, character) edge is
+** taken. Once `MPC_DFA_STATES_MAX` states exist
+** the cache is flushed and refilled with only the
+** states the input actually visits.
+**
+** Matching is leftmost-longest rather than the
+** ordered, possessive matching that combinator
+** regexes do, so `a|ab` takes "ab" and `a*a` can
+** match at all. That is why it has to be asked for.
+*/
+
+enum {
+  MPC_NFA_SET   = 0,
+  MPC_NFA_SPLIT = 1,
+  MPC_NFA_MATCH = 2
+};
+
+enum {
+  MPC_DFA_BUCKETS    = 64,
+  MPC_DFA_STATES_MAX = 512
+};
+
+typedef struct {
+  int type;
+  int out0;
+  int out1;
+  unsigned char set[32];
+} mpc_nfa_node_t;
+
+typedef struct mpc_dstate_t {
+  int num;
+  int *nfa;
+  int accept;
+  struct mpc_dstate_t *chain;
+  struct mpc_dstate_t *next[256];
+} mpc_dstate_t;
+
+typedef struct {
+
+  int refs;
+  char *re;
+  char *m;
+
+  int entry;
+  int nodes_num;
+  int nodes_slots;
+  mpc_nfa_node_t *nodes;
+
+  int gen;
+  int *marks;
+  int *stack;
+  int *moves;
+  int *scratch;
+
+  int flushes;
+  int states_num;
+  mpc_dstate_t *start;
+  mpc_dstate_t *buckets[MPC_DFA_BUCKETS];
+
+} mpc_dfa_t;
+
+static int mpc_dfa_cmp(const void *a, const void *b) {
+  return *(const int*)a - *(const int*)b;
+}
+
+static int mpc_dfa_closure(mpc_dfa_t *d, int *from, int n, int *out) {
+
+  int j, k = 0, top = 0;
+  mpc_nfa_node_t *x;
+
+  d->gen++;
+  for (j = 0; j < n; j++) {
+    if (d->marks[from[j]] == d->gen) { continue; }
+    d->marks[from[j]] = d->gen;
+    d->stack[top++] = from[j];
+  }
+
+  while (top > 0) {
+    j = d->stack[--top];
+    x = &d->nodes[j];
+    if (x->type != MPC_NFA_SPLIT) { out[k++] = j; continue; }
+    if (d->marks[x->out0] != d->gen) {
+      d->marks[x->out0] = d->gen;
+      d->stack[top++] = x->out0;
+    }
+    if (d->marks[x->out1] != d->gen) {
+      d->marks[x->out1] = d->gen;
+      d->stack[top++] = x->out1;
+    }
+  }
+
+  qsort(out, k, sizeof(int), mpc_dfa_cmp);
+  return k;
+}
+
+static void mpc_dfa_flush(mpc_dfa_t *d) {
+  int j;
+  mpc_dstate_t *s, *t;
+  for (j = 0; j < MPC_DFA_BUCKETS; j++) {
+    for (s = d->buckets[j]; s; s = t) {
+      t = s->chain;
+      free(s->nfa);
+      free(s);
+    }
+    d->buckets[j] = NULL;
+  }
+  d->states_num = 0;
+  d->start = NULL;
+  d->flushes++;
+}
+
+static mpc_dstate_t *mpc_dfa_state(mpc_dfa_t *d, int *set, int n) {
+
+  int j;
+  unsigned long h = n;
+  mpc_dstate_t *s;
+
+  for (j = 0; j < n; j++) { h = h * 31 + set[j]; }
+  h = h % MPC_DFA_BUCKETS;
+
+  for (s = d->buckets[h]; s; s = s->chain) {
+    if (s->num == n && memcmp(s->nfa, set, sizeof(int) * n) == 0) { return s; }
+  }
+
+  if (d->states_num == MPC_DFA_STATES_MAX) { mpc_dfa_flush(d); }
+
+  s = calloc(1, sizeof(mpc_dstate_t));
+  s->num = n;
+  s->nfa = malloc(sizeof(int) * (n + 1));
+  memcpy(s->nfa, set, sizeof(int) * n);
+  for (j = 0; j < n; j++) {
+    if (d->nodes[set[j]].type == MPC_NFA_MATCH) { s->accept = 1; }
+  }
+  s->chain = d->buckets[h];
+  d->buckets[h] = s;
+  d->states_num++;
+  return s;
+}
+
+static mpc_dstate_t *mpc_dfa_start(mpc_dfa_t *d) {
+  int n;
+  if (d->start == NULL) {
+    n = mpc_dfa_closure(d, &d->entry, 1, d->scratch);
+    d->start = mpc_dfa_state(d, d->scratch, n);
+  }
+  return d->start;
+}
+
+static mpc_dstate_t *mpc_dfa_step(mpc_dfa_t *d, mpc_dstate_t *s, char c) {
+
+  int j, n = 0, flushes = d->flushes;
+  unsigned char u = (unsigned char)c;
+  mpc_nfa_node_t *x;
+  mpc_dstate_t *t;
+
+  for (j = 0; j < s->num; j++) {
+    x = &d->nodes[s->nfa[j]];
+    if (x->type == MPC_NFA_SET && (x->set[u / 8] & (1 << (u % 8)))) {
+      d->moves[n++] = x->out0;
+    }
+  }
+
+  n = mpc_dfa_closure(d, d->moves, n, d->scratch);
+  t = mpc_dfa_state(d, d->scratch, n);
+  if (d->flushes == flushes) { s->next[u] = t; }
+  return t;
+}
+
+static long mpc_dfa_match(mpc_dfa_t *d, const char *s, size_t l, long *far) {
+
+  long k, n;
+  mpc_dstate_t *x = mpc_dfa_start(d), *y;
+
+  n = x->accept ? 0 : -1;
+  for (k = 0; (size_t)k < l && s[k]; k++) {
+    y = x->next[(unsigned char)s[k]];
+    if (y == NULL) { y = mpc_dfa_step(d, x, s[k]); }
+    if (y->num == 0) { break; }
+    x = y;
+    if (x->accept) { n = k + 1; }
+  }
+
+  *far = k;
+  return n;
+}
+
+static void mpc_dfa_release(mpc_dfa_t *d) {
+  if (--d->refs > 0) { return; }
+  mpc_dfa_flush(d);
+  free(d->re);
+  free(d->m);
+  free(d->nodes);
+  free(d->marks);
+  free(d->stack);
+  free(d->moves);
+  free(d->scratch);
+  free(d);
+}
+
+/*
+** Strings are scanned in place. Other inputs are
+** scanned once under a mark to find the length
+** of the longest match and then re-read up to it.
+** Backtracking is forced on for that so the scan
+** can be undone even inside `mpc_predictive`.
+**
+** A failed match reports its error at the byte
+** the automaton died on, as the combinators it
+** replaces would, rather than at the token start.
+*/
+
+static mpc_err_t *mpc_input_dfa_err(mpc_input_t *i, mpc_dfa_t *d, long far) {
+
+  long j;
+  char c;
+  mpc_err_t *x;
+
+  if (i->suppress) { return NULL; }
+
+  mpc_input_backtrack_enable(i);
+  mpc_input_mark(i);
+  for (j = 0; j < far; j++) {
+    c = mpc_input_getc(i);
+    mpc_input_success(i, c, NULL);
+  }
+  x = mpc_err_new(i, d->m);
+  mpc_input_rewind(i);
+  mpc_input_backtrack_disable(i);
+  return x;
+}
+
+static int mpc_input_dfa(mpc_input_t *i, mpc_dfa_t *d, char **o, mpc_err_t **e) {
+
+  long j, n, far;
+  char c;
+  mpc_dstate_t *x, *y;
+
+  if (i->type == MPC_INPUT_STRING) {
+    n = mpc_dfa_match(d, i->string + i->state.pos, i->length - i->state.pos, &far);
+  } else {
+    mpc_input_backtrack_enable(i);
+    mpc_input_mark(i);
+    x = mpc_dfa_start(d);
+    n = x->accept ? 0 : -1;
+    for (j = 0; !mpc_input_terminated(i); j++) {
+      c = mpc_input_getc(i);
+      y = x->next[(unsigned char)c];
+      if (y == NULL) { y = mpc_dfa_step(d, x, c); }
+      if (y->num == 0) { mpc_input_failure(i, c); break; }
+      mpc_input_success(i, c, NULL);
+      x = y;
+      if (x->accept) { n = j + 1; }
+    }
+    far = j;
+    mpc_input_rewind(i);
+    mpc_input_backtrack_disable(i);
+  }
+
+  if (n < 0) {
+    *e = mpc_input_dfa_err(i, d, far);
+    return 0;
+  }
+
+  *o = mpc_malloc(i, n + 1);
+  for (j = 0; j < n; j++) {
+    (*o)[j] = mpc_input_getc(i);
+    mpc_input_success(i, (*o)[j], NULL);
+  }
+  (*o)[n] = '\0';
+  return 1;
+}
+
 /*
 ** Parser Type
 */
@@ -918,7 +1504,11 @@ enum {
   MPC_TYPE_SOI        = 27,
   MPC_TYPE_EOI        = 28,
 
-  MPC_TYPE_SEPBY1     = 29
+  MPC_TYPE_SEPBY1     = 29,
+
+  MPC_TYPE_MEMO       = 30,
+  MPC_TYPE_DFA        = 31,
+  MPC_TYPE_SPAN       = 32
 };
 
 typedef struct { char *m; } mpc_pdata_fail_t;
@@ -939,6 +1529,9 @@ typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdat
 typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_parser_t *sep; } mpc_pdata_sepby1;
+typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_copy_t cx; } mpc_pdata_memo_t;
+typedef struct { mpc_dfa_t *d; } mpc_pdata_dfa_t;
+typedef struct { int min; char *m; unsigned char rows[32]; } mpc_pdata_span_t;
 
 typedef union {
   mpc_pdata_fail_t fail;
@@ -959,6 +1552,9 @@ typedef union {
   mpc_pdata_and_t and;
   mpc_pdata_or_t or;
   mpc_pdata_sepby1 sepby1;
+  mpc_pdata_memo_t memo;
+  mpc_pdata_dfa_t dfa;
+  mpc_pdata_span_t span;
 } mpc_pdata_t;
 
 struct mpc_parser_t {
@@ -988,10 +1584,43 @@ static mpc_val_t *mpcf_input_strfold(mpc_input_t *i, int n, mpc_val_t **xs) {
   return xs[0];
 }
 
+/*
+** With `MPC_PARSE_AST_SPANS` leaf contents point
+** into the borrowed input instead of owning a
+** copy. A leaf is only repointed when the input
+** at that offset really holds its text, so
+** folded or rewritten contents stay owned.
+*/
+
+static int mpc_input_span_at(mpc_input_t *i, long pos, const char *c, size_t n) {
+  return i->spans && pos >= 0
+    && (size_t)pos + n <= i->length
+    && memcmp(i->string + pos, c, n) == 0;
+}
+
+static mpc_ast_t *mpc_ast_new_span(const char *contents, size_t length) {
+  mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
+  a->tag = malloc(1);
+  a->tag[0] = '\0';
+  a->contents = (char*)contents;
+  a->length = length;
+  a->span = 1;
+  a->state = mpc_state_new();
+  a->children_num = 0;
+  a->children = NULL;
+  return a;
+}
+
 static mpc_val_t *mpcf_input_state_ast(mpc_input_t *i, int n, mpc_val_t **xs) {
   mpc_state_t *s = ((mpc_state_t**)xs)[0];
   mpc_ast_t *a = ((mpc_ast_t**)xs)[1];
   a = mpc_ast_state(a, *s);
+  if (a && a->children_num == 0 && a->length
+  &&  mpc_input_span_at(i, s->pos, a->contents, a->length)) {
+    if (!a->span) { free(a->contents); }
+    a->contents = i->string + s->pos;
+    a->span = 1;
+  }
   mpc_free(i, s);
   (void) n;
   return a;
@@ -1018,7 +1647,13 @@ static mpc_val_t *mpcf_input_free(mpc_input_t *i, mpc_val_t *x) {
 }
 
 static mpc_val_t *mpcf_input_str_ast(mpc_input_t *i, mpc_val_t *c) {
-  mpc_ast_t *a = mpc_ast_new("", c);
+  mpc_ast_t *a;
+  size_t n = strlen(c);
+  if (n && mpc_input_span_at(i, i->state.pos - (long)n, c, n)) {
+    a = mpc_ast_new_span(i->string + i->state.pos - n, n);
+  } else {
+    a = mpc_ast_new("", c);
+  }
   mpc_free(i, c);
   return a;
 }
@@ -1038,6 +1673,125 @@ static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
   d(mpc_export(i, x));
 }
 
+/*
+** Memo Table
+**
+** Open addressing on (parser, position, flags).
+** The table doubles at half load for as long as
+** it stays under `max_bytes`. Past that, new
+** results are dropped rather than evicting old
+** ones, so a hit is always the first result.
+**
+** A miss records only the outcome and where it
+** ended. Values are deep copies, so one is only
+** kept once an entry is hit: the first hit runs
+** the parser again and keeps a copy of what it
+** returns. Most entries are never hit, and so
+** never cost more than their slot.
+**
+** Failures that ran into the recursion limit
+** are not stored, since at a shallower depth
+** the same parser might succeed.
+**
+** Skipping a parser on a hit also skips the
+** errors it merged into the running error, but
+** that merge already happened the first time
+** round and merging is idempotent.
+*/
+
+static int mpc_input_memo_flags(mpc_input_t *i) {
+  return (i->suppress > 0) | ((i->backtrack > 0) << 1) | (i->state.term << 2);
+}
+
+static size_t mpc_memo_hash(mpc_parser_t *p, long pos, int flags) {
+  size_t h = ((size_t)p >> 4) ^ ((size_t)pos * 2654435761u) ^ (size_t)flags;
+  return h ^ (h >> 16);
+}
+
+static mpc_memo_entry_t *mpc_input_memo_find(mpc_input_t *i, mpc_parser_t *p, long pos, int flags) {
+  size_t j;
+  mpc_memo_entry_t *m;
+  if (i->memo_slots == 0) { return NULL; }
+  j = mpc_memo_hash(p, pos, flags) & (i->memo_slots - 1);
+  while (1) {
+    m = &i->memo_table[j];
+    if (!m->p) { return m; }
+    if (m->p == p && m->pos == pos && m->flags == flags) { return m; }
+    j = (j + 1) & (i->memo_slots - 1);
+  }
+}
+
+static int mpc_input_memo_grow(mpc_input_t *i) {
+
+  size_t j, slots = i->memo_slots;
+  mpc_memo_entry_t *old = i->memo_table, *m;
+
+  i->memo_slots = slots ? slots * 2 : MPC_MEMO_SLOTS_MIN;
+  if (i->memo_slots * sizeof(mpc_memo_entry_t) > i->memo.max_bytes) {
+    i->memo_slots = slots;
+    return 0;
+  }
+
+  i->memo_table = calloc(i->memo_slots, sizeof(mpc_memo_entry_t));
+  for (j = 0; j < slots; j++) {
+    if (!old[j].p) { continue; }
+    m = mpc_input_memo_find(i, old[j].p, old[j].pos, old[j].flags);
+    *m = old[j];
+  }
+  free(old);
+
+  i->memo.bytes = i->memo_slots * sizeof(mpc_memo_entry_t);
+  return 1;
+}
+
+static void mpc_input_memo_store(mpc_input_t *i, mpc_parser_t *p, long pos, int flags, int x) {
+
+  mpc_memo_entry_t *m;
+
+  if ((i->memo_num + 1) * 2 > i->memo_slots && !mpc_input_memo_grow(i)) {
+    i->memo.dropped++;
+    return;
+  }
+
+  m = mpc_input_memo_find(i, p, pos, flags);
+  m->p = p;
+  m->pos = pos;
+  m->flags = flags;
+  m->success = x;
+  m->state = i->state;
+  m->last = i->last;
+  m->dx = p->data.memo.dx;
+  m->kept = 0;
+  m->r.output = NULL;
+  i->memo_num++;
+}
+
+static void mpc_input_memo_keep(mpc_input_t *i, mpc_parser_t *p, mpc_memo_entry_t *m, mpc_result_t *r) {
+  if (m->success) {
+    r->output = mpc_export(i, r->output);
+    m->r.output = r->output ? p->data.memo.cx(r->output) : NULL;
+  } else {
+    m->r.error = mpc_err_copy(r->error);
+  }
+  m->kept = 1;
+}
+
+static int mpc_input_memo_restore(mpc_input_t *i, mpc_parser_t *p, mpc_memo_entry_t *m, mpc_result_t *r) {
+
+  i->state = m->state;
+  i->last = m->last;
+  if (i->type == MPC_INPUT_FILE) {
+    fseek(i->file, i->state.pos, SEEK_SET);
+  }
+
+  if (m->success) {
+    r->output = m->r.output ? p->data.memo.cx(m->r.output) : NULL;
+  } else {
+    r->error = mpc_err_copy(m->r.error);
+  }
+  return m->success;
+}
+
 enum {
   MPC_PARSE_STACK_MIN = 4
 };
@@ -1067,12 +1821,15 @@ static mpc_result_t *mpc_grow_results(mpc_input_t *i, int j, mpc_result_t *resul
 
 static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
 
-  int j = 0, k = 0;
+  int j = 0, k = 0, seen;
+  long pos, fails;
   mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
   mpc_result_t *results;
+  mpc_memo_entry_t *m;
 
   if (depth == MPC_MAX_RECURSION_DEPTH)
   {
+    i->depth_fails++;
     MPC_FAILURE(mpc_err_fail(i, "Maximum recursion depth exceeded!"));
   }
 
@@ -1090,6 +1847,9 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
     case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&r->output));
     case MPC_TYPE_SOI:     MPC_PRIMITIVE(mpc_input_soi(i, (char**)&r->output));
     case MPC_TYPE_EOI:     MPC_PRIMITIVE(mpc_input_eoi(i, (char**)&r->output));
+    case MPC_TYPE_DFA:
+      if (mpc_input_dfa(i, p->data.dfa.d, (char**)&r->output, &r->error)) { MPC_SUCCESS(r->output); }
+      MPC_FAILURE(r->error);
 
     /* Other parsers */
 
@@ -1160,6 +1920,45 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
         MPC_FAILURE(r->error);
       }
 
+    case MPC_TYPE_MEMO:
+
+      if (i->type == MPC_INPUT_PIPE) {
+        return mpc_parse_run(i, p->data.memo.x, r, e, depth);
+      }
+
+      pos = i->state.pos;
+      k = mpc_input_memo_flags(i);
+      m = mpc_input_memo_find(i, p, pos, k);
+      if (m && m->p && m->kept) {
+        i->memo.hits++;
+        return mpc_input_memo_restore(i, p, m, r);
+      }
+
+      seen = m && m->p;
+      fails = i->depth_fails;
+      j = mpc_parse_run(i, p->data.memo.x, r, e, depth);
+      if (!j && i->depth_fails != fails) { return j; }
+
+      /* The run may have grown the table, so look again */
+      if (seen) {
+        i->memo.hits++;
+        m = mpc_input_memo_find(i, p, pos, k);
+        if (j == m->success) { mpc_input_memo_keep(i, p, m, r); }
+      } else {
+        i->memo.misses++;
+        mpc_input_memo_store(i, p, pos, k, j);
+      }
+      return j;
+
+    case MPC_TYPE_SPAN:
+      if (!mpc_input_span(i, p->data.span.rows, (char**)&r->output) && p->data.span.min) {
+        mpc_free(i, r->output);
+        MPC_FAILURE(mpc_err_many1(i,
+          p->data.span.m ? mpc_err_new(i, p->data.span.m) : NULL));
+      }
+      *e = mpc_err_merge(i, *e, p->data.span.m ? mpc_err_new(i, p->data.span.m) : NULL);
+      MPC_SUCCESS(r->output);
+
     /* Optional Parsers */
 
     /* TODO: Update Not Error Message */
@@ -1368,6 +2167,29 @@ int mpc_nparse(const char *filename, const char *string, size_t length, mpc_pars
   return x;
 }
 
+int mpc_nparse_borrowed(const char *filename, const char *string, size_t length, int flags, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_borrowed(filename, string, length);
+  i->spans = (flags & MPC_PARSE_AST_SPANS) != 0;
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+int mpc_parse_borrowed(const char *filename, const char *string, int flags, mpc_parser_t *p, mpc_result_t *r) {
+  return mpc_nparse_borrowed(filename, string, strlen(string), flags, p, r);
+}
+
+int mpc_parse_memo(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r, mpc_memo_t *m) {
+  int x;
+  mpc_input_t *i = mpc_input_new_string(filename, string);
+  i->memo.max_bytes = m->max_bytes;
+  x = mpc_parse_input(i, p, r);
+  *m = i->memo;
+  mpc_input_delete(i);
+  return x;
+}
+
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
   int x;
   mpc_input_t *i = mpc_input_new_file(filename, file);
@@ -1385,8 +2207,42 @@ int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result
 }
 
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
+  return mpc_parse_contents_mode(filename, MPC_PARSE_DEFAULT, p, r);
+}
+
+/*
+** Files are streamed unless `MPC_PARSE_IN_MEMORY`
+** asks for them to be read whole and scanned in
+** place. The buffer is freed before returning so
+** `MPC_PARSE_AST_SPANS` does not apply here.
+*/
+
+static char *mpc_file_read(FILE *f, size_t *length) {
+
+  char *buffer = malloc(4096), *grown;
+  size_t slots = 4096, n;
+
+  *length = 0;
+  while (buffer) {
+    n = fread(buffer + *length, 1, slots - *length, f);
+    *length += n;
+    if (n == 0) { break; }
+    if (*length == slots) {
+      slots *= 2;
+      grown = slots > *length ? realloc(buffer, slots) : NULL;
+      if (grown == NULL) { free(buffer); return NULL; }
+      buffer = grown;
+    }
+  }
+
+  return buffer;
+}
+
+int mpc_parse_contents_mode(const char *filename, int flags, mpc_parser_t *p, mpc_result_t *r) {
 
   FILE *f = fopen(filename, "rb");
+  char *buffer;
+  size_t length;
   int res;
 
   if (f == NULL) {
@@ -1395,8 +2251,24 @@ int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
     return 0;
   }
 
-  res = mpc_parse_file(filename, f, p, r);
+  if (!(flags & MPC_PARSE_IN_MEMORY)) {
+    res = mpc_parse_file(filename, f, p, r);
+    fclose(f);
+    return res;
+  }
+
+  buffer = mpc_file_read(f, &length);
+  if (buffer == NULL || ferror(f)) {
+    r->output = NULL;
+    r->error = mpc_err_file(filename, buffer ? "Unable to read file!" : "Out of memory!");
+    free(buffer);
+    fclose(f);
+    return 0;
+  }
   fclose(f);
+
+  res = mpc_nparse_borrowed(filename, buffer, length, MPC_PARSE_DEFAULT, p, r);
+  free(buffer);
   return res;
 }
 
@@ -1444,6 +2316,9 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
     case MPC_TYPE_APPLY:    mpc_undefine_unretained(p->data.apply.x, 0);    break;
     case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
     case MPC_TYPE_PREDICT:  mpc_undefine_unretained(p->data.predict.x, 0);  break;
+    case MPC_TYPE_MEMO:     mpc_undefine_unretained(p->data.memo.x, 0);     break;
+    case MPC_TYPE_DFA:      mpc_dfa_release(p->data.dfa.d);                  break;
+    case MPC_TYPE_SPAN:     free(p->data.span.m);                            break;
 
     case MPC_TYPE_MAYBE:
     case MPC_TYPE_NOT:
@@ -1557,6 +2432,15 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
     case MPC_TYPE_APPLY:    p->data.apply.x    = mpc_copy(a->data.apply.x);    break;
     case MPC_TYPE_APPLY_TO: p->data.apply_to.x = mpc_copy(a->data.apply_to.x); break;
     case MPC_TYPE_PREDICT:  p->data.predict.x  = mpc_copy(a->data.predict.x);  break;
+    case MPC_TYPE_MEMO:     p->data.memo.x     = mpc_copy(a->data.memo.x);     break;
+    case MPC_TYPE_DFA:      p->data.dfa.d->refs++;                           break;
+
+    case MPC_TYPE_SPAN:
+      if (a->data.span.m) {
+        p->data.span.m = malloc(strlen(a->data.span.m)+1);
+        strcpy(p->data.span.m, a->data.span.m);
+      }
+      break;
 
     case MPC_TYPE_MAYBE:
     case MPC_TYPE_NOT:
@@ -1924,6 +2808,15 @@ mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
   return p;
 }
 
+mpc_parser_t *mpc_memo(mpc_parser_t *a, mpc_dtor_t da, mpc_copy_t ca) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MEMO;
+  p->data.memo.x = a;
+  p->data.memo.dx = da;
+  p->data.memo.cx = ca;
+  return p;
+}
+
 mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_NOT;
@@ -2409,6 +3302,158 @@ static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
   return out;
 }
 
+static int mpc_nfa_node(mpc_dfa_t *d, int type, int out0, int out1) {
+  mpc_nfa_node_t *x;
+  if (d->nodes_num == d->nodes_slots) {
+    d->nodes_slots = d->nodes_slots ? d->nodes_slots * 2 : 16;
+    d->nodes = realloc(d->nodes, sizeof(mpc_nfa_node_t) * d->nodes_slots);
+  }
+  x = &d->nodes[d->nodes_num];
+  x->type = type;
+  x->out0 = out0;
+  x->out1 = out1;
+  memset(x->set, 0, sizeof(x->set));
+  return d->nodes_num++;
+}
+
+static void mpc_nfa_set(mpc_dfa_t *d, int s, char c, int on) {
+  unsigned char u = (unsigned char)c;
+  if (on) { d->nodes[s].set[u / 8] |=  (1 << (u % 8)); }
+  else    { d->nodes[s].set[u / 8] &= ~(1 << (u % 8)); }
+}
+
+/*
+** Builds the NFA for a compiled regex parser so
+** that a match carries on into `next`, and gives
+** back its entry node. Anything that is not plain
+** character matching - anchors, lookahead, user
+** folds - gives -1 and the regex stays as it is.
+*/
+
+static int mpc_nfa_build(mpc_dfa_t *d, mpc_parser_t *p, int next) {
+
+  int j, s, t;
+  const char *c;
+
+  if (next < 0) { return -1; }
+
+  switch (p->type) {
+
+    case MPC_TYPE_EXPECT: return mpc_nfa_build(d, p->data.expect.x, next);
+    case MPC_TYPE_LIFT:   return p->data.lift.lf == mpcf_ctor_str ? next : -1;
+
+    case MPC_TYPE_ANY:
+      s = mpc_nfa_node(d, MPC_NFA_SET, next, 0);
+      for (j = 1; j < 256; j++) { mpc_nfa_set(d, s, (char)j, 1); }
+      return s;
+
+    case MPC_TYPE_SINGLE:
+      s = mpc_nfa_node(d, MPC_NFA_SET, next, 0);
+      mpc_nfa_set(d, s, p->data.single.x, 1);
+      return s;
+
+    case MPC_TYPE_RANGE:
+      s = mpc_nfa_node(d, MPC_NFA_SET, next, 0);
+      for (j = p->data.range.x; j <= p->data.range.y; j++) { mpc_nfa_set(d, s, (char)j, 1); }
+      return s;
+
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+      s = mpc_nfa_node(d, MPC_NFA_SET, next, 0);
+      if (p->type == MPC_TYPE_NONEOF) {
+        for (j = 1; j < 256; j++) { mpc_nfa_set(d, s, (char)j, 1); }
+      }
+      for (c = p->data.string.x; *c; c++) {
+        mpc_nfa_set(d, s, *c, p->type == MPC_TYPE_ONEOF);
+      }
+      return s;
+
+    case MPC_TYPE_STRING:
+      for (j = (int)strlen(p->data.string.x) - 1; j >= 0; j--) {
+        next = mpc_nfa_node(d, MPC_NFA_SET, next, 0);
+        mpc_nfa_set(d, next, p->data.string.x[j], 1);
+      }
+      return next;
+
+    case MPC_TYPE_AND:
+      if (p->data.and.f != mpcf_strfold) { return -1; }
+      for (j = p->data.and.n-1; j >= 0; j--) {
+        next = mpc_nfa_build(d, p->data.and.xs[j], next);
+      }
+      return next;
+
+    case MPC_TYPE_OR:
+      if (p->data.or.n == 0) { return -1; }
+      s = mpc_nfa_build(d, p->data.or.xs[p->data.or.n-1], next);
+      for (j = p->data.or.n-2; j >= 0 && s >= 0; j--) {
+        t = mpc_nfa_build(d, p->data.or.xs[j], next);
+        s = t < 0 ? -1 : mpc_nfa_node(d, MPC_NFA_SPLIT, t, s);
+      }
+      return s;
+
+    case MPC_TYPE_MAYBE:
+      if (p->data.not.lf != mpcf_ctor_str) { return -1; }
+      t = mpc_nfa_build(d, p->data.not.x, next);
+      return t < 0 ? -1 : mpc_nfa_node(d, MPC_NFA_SPLIT, t, next);
+
+    case MPC_TYPE_SPAN:
+      s = mpc_nfa_node(d, MPC_NFA_SPLIT, 0, next);
+      t = mpc_nfa_node(d, MPC_NFA_SET, s, 0);
+      for (j = 1; j < 256; j++) {
+        if (mpc_span_has(p->data.span.rows, (char)j)) { mpc_nfa_set(d, t, (char)j, 1); }
+      }
+      d->nodes[s].out0 = t;
+      return p->data.span.min ? t : s;
+
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      if (p->data.repeat.f != mpcf_strfold) { return -1; }
+      s = mpc_nfa_node(d, MPC_NFA_SPLIT, 0, next);
+      t = mpc_nfa_build(d, p->data.repeat.x, s);
+      if (t < 0) { return -1; }
+      d->nodes[s].out0 = t;
+      return p->type == MPC_TYPE_MANY ? s : t;
+
+    case MPC_TYPE_COUNT:
+      if (p->data.repeat.f != mpcf_strfold) { return -1; }
+      for (j = 0; j < p->data.repeat.n; j++) {
+        next = mpc_nfa_build(d, p->data.repeat.x, next);
+      }
+      return next;
+
+    default: return -1;
+  }
+
+}
+
+static mpc_parser_t *mpc_re_dfa(mpc_parser_t *a, const char *re) {
+
+  mpc_parser_t *p;
+  mpc_dfa_t *d = calloc(1, sizeof(mpc_dfa_t));
+
+  d->refs = 1;
+  d->entry = mpc_nfa_build(d, a, mpc_nfa_node(d, MPC_NFA_MATCH, 0, 0));
+  if (d->entry < 0) {
+    mpc_dfa_release(d);
+    return a;
+  }
+
+  d->re = malloc(strlen(re) + 1);
+  strcpy(d->re, re);
+  d->m = malloc(strlen(re) + 3);
+  sprintf(d->m, "/%s/", re);
+  d->marks = calloc(d->nodes_num, sizeof(int));
+  d->stack = malloc(sizeof(int) * d->nodes_num);
+  d->moves = malloc(sizeof(int) * d->nodes_num);
+  d->scratch = malloc(sizeof(int) * d->nodes_num);
+  mpc_delete(a);
+
+  p = mpc_undefined();
+  p->type = MPC_TYPE_DFA;
+  p->data.dfa.d = d;
+  return p;
+}
+
 mpc_parser_t *mpc_re(const char *re) {
   return mpc_re_mode(re, MPC_RE_DEFAULT);
 }
@@ -2476,6 +3521,8 @@ mpc_parser_t *mpc_re_mode(const char *re, int mode) {
 
   mpc_optimise(r.output);
 
+  if (mode & MPC_RE_DFA) { r.output = mpc_re_dfa(r.output, re); }
+
   return r.output;
 
 }
@@ -2751,6 +3798,10 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   }
 
   if (p->type == MPC_TYPE_ANY) { printf("<.>"); }
+  if (p->type == MPC_TYPE_DFA) { printf("/%s/", p->data.dfa.d->re); }
+  if (p->type == MPC_TYPE_SPAN) {
+    printf("%s%s", p->data.span.m ? p->data.span.m : "<class>", p->data.span.min ? "+" : "*");
+  }
   if (p->type == MPC_TYPE_SATISFY) { printf("<f>"); }
 
   if (p->type == MPC_TYPE_SINGLE) {
@@ -2809,6 +3860,7 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { mpc_print_unretained(p->data.memo.x, 0); }
 
   if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
   if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
@@ -2944,7 +3996,7 @@ void mpc_ast_delete(mpc_ast_t *a) {
 
   free(a->children);
   free(a->tag);
-  free(a->contents);
+  if (!a->span) { free(a->contents); }
   free(a);
 
 }
@@ -2952,7 +4004,7 @@ void mpc_ast_delete(mpc_ast_t *a) {
 static void mpc_ast_delete_no_children(mpc_ast_t *a) {
   free(a->children);
   free(a->tag);
-  free(a->contents);
+  if (!a->span) { free(a->contents); }
   free(a);
 }
 
@@ -2963,8 +4015,10 @@ mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
   a->tag = malloc(strlen(tag) + 1);
   strcpy(a->tag, tag);
 
-  a->contents = malloc(strlen(contents) + 1);
+  a->length = strlen(contents);
+  a->contents = malloc(a->length + 1);
   strcpy(a->contents, contents);
+  a->span = 0;
 
   a->state = mpc_state_new();
 
@@ -2974,6 +4028,27 @@ mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
 
 }
 
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a) {
+
+  int i;
+  mpc_ast_t *r;
+
+  if (a == NULL) { return a; }
+
+  r = mpc_ast_new(a->tag, a->span ? "" : a->contents);
+  if (a->span) {
+    free(r->contents);
+    r->contents = a->contents;
+    r->length = a->length;
+    r->span = 1;
+  }
+  r->state = a->state;
+  for (i = 0; i < a->children_num; i++) {
+    mpc_ast_add_child(r, mpc_ast_copy(a->children[i]));
+  }
+  return r;
+}
+
 mpc_ast_t *mpc_ast_build(int n, const char *tag, ...) {
 
   mpc_ast_t *a = mpc_ast_new(tag, "");
@@ -3010,7 +4085,8 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
   int i;
 
   if (strcmp(a->tag, b->tag) != 0) { return 0; }
-  if (strcmp(a->contents, b->contents) != 0) { return 0; }
+  if (a->length != b->length) { return 0; }
+  if (memcmp(a->contents, b->contents, a->length) != 0) { return 0; }
   if (a->children_num != b->children_num) { return 0; }
 
   for (i = 0; i < a->children_num; i++) {
@@ -3067,11 +4143,11 @@ static void mpc_ast_print_depth(mpc_ast_t *a, int d, FILE *fp) {
 
   for (i = 0; i < d; i++) { fprintf(fp, "  "); }
 
-  if (strlen(a->contents)) {
-    fprintf(fp, "%s:%lu:%lu '%s'\n", a->tag,
+  if (a->length) {
+    fprintf(fp, "%s:%lu:%lu '%.*s'\n", a->tag,
       (long unsigned int)(a->state.row+1),
       (long unsigned int)(a->state.col+1),
-      a->contents);
+      (int)a->length, a->contents);
   } else {
     fprintf(fp, "%s \n", a->tag);
   }
@@ -3380,6 +4456,7 @@ mpc_parser_t *mpca_and(int n, ...) {
 }
 
 mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpc_total(a, (mpc_dtor_t)mpc_ast_delete); }
+mpc_parser_t *mpca_memo(mpc_parser_t *a) { return mpc_memo(a, (mpc_dtor_t)mpc_ast_delete, (mpc_copy_t)mpc_ast_copy); }
 
 /*
 ** Grammar Parser
@@ -3490,6 +4567,7 @@ static mpc_val_t *mpcaf_fold_regex(int n, mpc_val_t **xs) {
   (void)n;
   if (strchr(m, 'm')) { mode |= MPC_RE_MULTILINE; }
   if (strchr(m, 's')) { mode |= MPC_RE_DOTALL; }
+  if (st->flags & MPCA_LANG_REGEX_DFA) { mode |= MPC_RE_DFA; }
   y = mpcf_unescape_regex(y);
   p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_re_mode(y, mode) : mpc_tok(mpc_re_mode(y, mode));
   free(y);
@@ -3711,6 +4789,7 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
     if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
     if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
     mpc_optimise(stmt->grammar);
+    if (st->flags & MPCA_LANG_MEMOISE) { stmt->grammar = mpca_memo(stmt->grammar); }
     mpc_define(left, stmt->grammar);
     free(stmt->ident);
     free(stmt->name);
@@ -3904,6 +4983,7 @@ static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { return 1 + mpc_nodecount_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { return 1 + mpc_nodecount_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { return 1 + mpc_nodecount_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { return 1 + mpc_nodecount_unretained(p->data.memo.x, 0); }
 
   if (p->type == MPC_TYPE_CHECK)    { return 1 + mpc_nodecount_unretained(p->data.check.x, 0); }
   if (p->type == MPC_TYPE_CHECK_WITH) { return 1 + mpc_nodecount_unretained(p->data.check_with.x, 0); }
@@ -3948,10 +5028,45 @@ void mpc_stats(mpc_parser_t* p) {
   printf("Node Count: %i\n", mpc_nodecount_unretained(p, 1));
 }
 
+/*
+** Fills a span class from a single character
+** parser, giving back 0 if `p` is anything else.
+*/
+
+static int mpc_optimise_class(mpc_parser_t *p, unsigned char *rows) {
+
+  int j;
+  const char *c;
+
+  if (p->retained) { return 0; }
+
+  switch (p->type) {
+    case MPC_TYPE_ANY:
+      for (j = 1; j < 256; j++) { mpc_span_add(rows, (char)j); }
+      return 1;
+    case MPC_TYPE_SINGLE:
+      mpc_span_add(rows, p->data.single.x);
+      return 1;
+    case MPC_TYPE_RANGE:
+      for (j = p->data.range.x; j <= p->data.range.y; j++) { mpc_span_add(rows, (char)j); }
+      return 1;
+    case MPC_TYPE_ONEOF:
+      for (c = p->data.string.x; *c; c++) { mpc_span_add(rows, *c); }
+      return 1;
+    case MPC_TYPE_NONEOF:
+      for (j = 1; j < 256; j++) {
+        if (!strchr(p->data.string.x, (char)j)) { mpc_span_add(rows, (char)j); }
+      }
+      return 1;
+    default: return 0;
+  }
+}
+
 static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
 
   int i, n, m;
-  mpc_parser_t *t;
+  mpc_parser_t *t, *u;
+  unsigned char rows[32];
 
   if (p->retained && !force) { return; }
 
@@ -3963,6 +5078,7 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_CHECK)      { mpc_optimise_unretained(p->data.check.x, 0); }
   if (p->type == MPC_TYPE_CHECK_WITH) { mpc_optimise_unretained(p->data.check_with.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)    { mpc_optimise_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)       { mpc_optimise_unretained(p->data.memo.x, 0); }
   if (p->type == MPC_TYPE_NOT)        { mpc_optimise_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MAYBE)      { mpc_optimise_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MANY)       { mpc_optimise_unretained(p->data.repeat.x, 0); }
@@ -4098,6 +5214,28 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       continue;
     }
 
+    /* Collapse `many` of a character class into a span */
+    if ((p->type == MPC_TYPE_MANY || p->type == MPC_TYPE_MANY1)
+    &&  p->data.repeat.f == mpcf_strfold) {
+      t = p->data.repeat.x;
+      u = t;
+      while (u->type == MPC_TYPE_EXPECT && !u->retained) { u = u->data.expect.x; }
+      memset(rows, 0, sizeof(rows));
+      if (mpc_optimise_class(u, rows)) {
+        m = p->type == MPC_TYPE_MANY1;
+        p->type = MPC_TYPE_SPAN;
+        p->data.span.min = m;
+        p->data.span.m = NULL;
+        if (u != t) {
+          p->data.span.m = t->data.expect.m;
+          t->data.expect.m = NULL;
+        }
+        memcpy(p->data.span.rows, rows, sizeof(rows));
+        mpc_delete(t);
+        continue;
+      }
+    }
+
     /* Merge re rhs `and` */
     if (p->type == MPC_TYPE_AND
     &&  p->data.and.f == mpcf_strfold
@@ -71,12 +71,49 @@ int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
 
+/*
+** Memo table limits and counters for a single
+** parse. `bytes` is the table footprint. Values
+** are copied only for entries that get hit, and
+** those copies are not counted.
+*/
+
+typedef struct {
+  size_t max_bytes;
+  size_t bytes;
+  long hits;
+  long misses;
+  long dropped;
+} mpc_memo_t;
+
+int mpc_parse_memo(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r, mpc_memo_t *m);
+
+/*
+** Borrowed parses scan the caller's buffer in
+** place and need not be NUL terminated. With
+** `MPC_PARSE_AST_SPANS` AST leaves point into it
+** too, so the buffer must outlive the result.
+** `MPC_PARSE_IN_MEMORY` reads a whole file into
+** memory rather than streaming it.
+*/
+
+enum {
+  MPC_PARSE_DEFAULT   = 0,
+  MPC_PARSE_AST_SPANS = 1,
+  MPC_PARSE_IN_MEMORY = 2
+};
+
+int mpc_parse_borrowed(const char *filename, const char *string, int flags, mpc_parser_t *p, mpc_result_t *r);
+int mpc_nparse_borrowed(const char *filename, const char *string, size_t length, int flags, mpc_parser_t *p, mpc_result_t *r);
+int mpc_parse_contents_mode(const char *filename, int flags, mpc_parser_t *p, mpc_result_t *r);
+
 /*
 ** Function Types
 */
 
 typedef void(*mpc_dtor_t)(mpc_val_t*);
 typedef mpc_val_t*(*mpc_ctor_t)(void);
+typedef mpc_val_t*(*mpc_copy_t)(mpc_val_t*);
 
 typedef mpc_val_t*(*mpc_apply_t)(mpc_val_t*);
 typedef mpc_val_t*(*mpc_apply_to_t)(mpc_val_t*,void*);
@@ -147,6 +184,7 @@ mpc_parser_t *mpc_or(int n, ...);
 mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...);
 
 mpc_parser_t *mpc_predictive(mpc_parser_t *a);
+mpc_parser_t *mpc_memo(mpc_parser_t *a, mpc_dtor_t da, mpc_copy_t ca);
 
 /*
 ** Common Parsers
@@ -267,12 +305,21 @@ mpc_val_t *mpcf_strfold(int n, mpc_val_t** xs);
 ** Regular Expression Parsers
 */
 
+/*
+** `MPC_RE_DFA` builds the automaton lazily and
+** caches its states inside the parser while it
+** runs, so a DFA regex (or any parser using one,
+** e.g. via `MPCA_LANG_REGEX_DFA`) must not be
+** used by two parses at once.
+*/
+
 enum {
   MPC_RE_DEFAULT   = 0,
   MPC_RE_M         = 1,
   MPC_RE_S         = 2,
   MPC_RE_MULTILINE = 1,
-  MPC_RE_DOTALL    = 2
+  MPC_RE_DOTALL    = 2,
+  MPC_RE_DFA       = 4
 };
 
 mpc_parser_t *mpc_re(const char *re);
@@ -282,15 +329,24 @@ mpc_parser_t *mpc_re_mode(const char *re, int mode);
 ** AST
 */
 
+/*
+** `contents` holds `length` bytes. Span nodes
+** (`span` set) point into a borrowed input at
+** `state.pos` and are not NUL terminated.
+*/
+
 typedef struct mpc_ast_t {
   char *tag;
   char *contents;
   mpc_state_t state;
   int children_num;
   struct mpc_ast_t** children;
+  long length;
+  int span;
 } mpc_ast_t;
 
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents);
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a);
 mpc_ast_t *mpc_ast_build(int n, const char *tag, ...);
 mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a);
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a);
@@ -341,6 +397,7 @@ mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t);
 mpc_parser_t *mpca_root(mpc_parser_t *a);
 mpc_parser_t *mpca_state(mpc_parser_t *a);
 mpc_parser_t *mpca_total(mpc_parser_t *a);
+mpc_parser_t *mpca_memo(mpc_parser_t *a);
 
 mpc_parser_t *mpca_not(mpc_parser_t *a);
 mpc_parser_t *mpca_maybe(mpc_parser_t *a);
@@ -355,7 +412,9 @@ mpc_parser_t *mpca_and(int n, ...);
 enum {
   MPCA_LANG_DEFAULT              = 0,
   MPCA_LANG_PREDICTIVE           = 1,
-  MPCA_LANG_WHITESPACE_SENSITIVE = 2
+  MPCA_LANG_WHITESPACE_SENSITIVE = 2,
+  MPCA_LANG_MEMOISE              = 4,
+  MPCA_LANG_REGEX_DFA            = 8
 };
 
 mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...);
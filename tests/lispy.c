@@ -0,0 +1,1519 @@
+/* The interpreter is compiled into the test binary with its main renamed,
+ * so the tests can reach its static functions and state. */
+#define main lispy_main
+#include "../lispy.c"
+#undef main
+
+#include "ptest.h"
+
+/* Each test runs in a fresh global env. */
+static lenv *test_env() {
+  lenv *e = lenv_new();
+  lenv_add_builtins(e);
+  gc.root = e;
+  return e;
+}
+
+static void test_env_delete(lenv *e) {
+  lenv_delete(e);
+  gc.root = 0;
+  arena_reset();
+}
+
+/* Evaluates the expressions in src in order and returns the value of the
+ * last one, or the syntax error if src does not read. */
+static lval *run(lenv *e, char *src) {
+  lval *exprs = lval_read("<test>", src);
+  if (lval_type(exprs) == LTYPE_ERR) {
+    return exprs;
+  }
+  lval *x = lval_sexp();
+  while (exprs->count > 0) {
+    lval_delete(x);
+    x = lval_eval(e, lval_pop(exprs, 0));
+  }
+  lval_delete(exprs);
+  return x;
+}
+
+/* Whether src evaluates to a value equal to that of expected. */
+static bool run_is(lenv *e, char *src, char *expected) {
+  lval *x = run(e, src);
+  lval *y = run(e, expected);
+  bool eq = lval_eq(x, y);
+  if (!eq) {
+    printf("    got ");
+    lval_print(x);
+    printf(", expected ");
+    lval_print(y);
+    printf("\n");
+  }
+  lval_delete(x);
+  lval_delete(y);
+  return eq;
+}
+
+/* Whether src evaluates to an error whose message contains msg. */
+static bool run_err(lenv *e, char *src, char *msg) {
+  lval *x = run(e, src);
+  bool ok = lval_type(x) == LTYPE_ERR && strstr(x->err, msg);
+  if (!ok) {
+    printf("    got ");
+    lval_print(x);
+    printf(", expected an error containing \"%s\"\n", msg);
+  }
+  lval_delete(x);
+  return ok;
+}
+
+PT_FUNC(test_tail_self) {
+  lenv *e = test_env();
+  PT_ASSERT(run_is(e,
+                   "(def {loop} (\\ {n acc}"
+                   "  {if (== n 0) {acc} {loop (- n 1) (+ acc 2)}}))"
+                   "(loop 1000000 0)",
+                   "2000000"));
+  test_env_delete(e);
+}
+
+PT_FUNC(test_tail_mutual) {
+  lenv *e = test_env();
+  PT_ASSERT(run_is(e,
+                   "(def {even} (\\ {n} {if (== n 0) {1} {odd (- n 1)}}))"
+                   "(def {odd} (\\ {n} {if (== n 0) {0} {even (- n 1)}}))"
+                   "(list (even 300001) (odd 300001))",
+                   "{0 1}"));
+  test_env_delete(e);
+}
+
+PT_FUNC(test_tail_eval) {
+  lenv *e = test_env();
+  PT_ASSERT(run_is(e,
+                   "(def {count} (\\ {n}"
+                   "  {if (== n 0) {0} {eval {count (- n 1)}}}))"
+                   "(count 500000)",
+                   "0"));
+  test_env_delete(e);
+}
+
+/* A frame left by a tail call stays visible to code that looks its names
+ * up dynamically, whether through eval or through a further call. */
+PT_FUNC(test_tail_keeps_frame_for_eval) {
+  lenv *e = test_env();
+  PT_ASSERT(run_is(e,
+                   "(def {g} (\\ {_} {eval {x}}))"
+                   "(def {f2} (\\ {x} {g 0}))"
+                   "(def {f} (\\ {_} {f2 42}))"
+                   "(f 0)",
+                   "42"));
+  test_env_delete(e);
+}
+
+PT_FUNC(test_tail_keeps_frame_for_callee) {
+  lenv *e = test_env();
+  PT_ASSERT(run_is(e,
+                   "(def {hh} (\\ {_} {+ y 1}))"
+                   "(def {h} (\\ {_} {hh 0}))"
+                   "(def {j2} (\\ {y} {h 0}))"
+                   "(def {j} (\\ {_} {j2 5}))"
+                   "(j 0)",
+                   "6"));
+  test_env_delete(e);
+}
+
+PT_FUNC(test_tail_shadowed_frame) {
+  lenv *e = test_env();
+  PT_ASSERT(run_is(e,
+                   "(def {f} (\\ {x} {if (== x 0) {eval {x}} {f (- x 1)}}))"
+                   "(f 10)",
+                   "0"));
+  test_env_delete(e);
+}
+
+/* Returns the number of live frames, for tests to call from Lisp. */
+static lval *test_live_frames(lenv *e, lval *v) {
+  long n = 0;
+  for (lgc *h = gc.heap.next; h != &gc.heap; h = h->next) {
+    n += h->kind == GC_ENV;
+  }
+  lval_delete(v);
+  return lval_num(n);
+}
+
+/* Frames left by tail calls between functions with different formals are
+ * merged into one carried frame, so the loop runs in constant memory. */
+PT_FUNC(test_tail_mutual_distinct) {
+  lenv *e = test_env();
+  lenv_add_builtin(e, "live-frames", test_live_frames);
+  lval_delete(run(e, "(def {ev} (\\ {n} {if (== n 0) {live-frames {}}"
+                     "                                {od (- n 1)}}))"
+                     "(def {od} (\\ {m} {if (== m 0) {live-frames {}}"
+                     "                                {ev (- m 1)}}))"));
+  lval *few = run(e, "(ev 10)"), *many = run(e, "(ev 200000)");
+  PT_ASSERT(lval_type(few) == LTYPE_NUM && lval_numval(few) < 8);
+  PT_ASSERT(lval_eq(few, many));
+  lval_delete(few);
+  lval_delete(many);
+  test_env_delete(e);
+}
+
+/* The carried frame keeps the newest binding of each name. */
+PT_FUNC(test_tail_carry_newest) {
+  lenv *e = test_env();
+  PT_ASSERT(run_is(e,
+                   "(def {d} (\\ {z} {list x y z}))"
+                   "(def {c} (\\ {x} {d 3}))"
+                   "(def {b} (\\ {y} {c 2}))"
+                   "(def {a} (\\ {x} {b 1}))"
+                   "(a 0)",
+                   "{2 1 3}"));
+  test_env_delete(e);
+}
+
+PT_FUNC(test_tail_error) {
+  lenv *e = test_env();
+  PT_ASSERT(run_err(e,
+                    "(def {g} (\\ {a} {a}))"
+                    "(def {f} (\\ {x} {g x x}))"
+                    "(f 1)",
+                    "too many args"));
+  test_env_delete(e);
+}
+
+PT_SUITE(suite_tail) {
+  PT_REG(test_tail_self);
+  PT_REG(test_tail_mutual);
+  PT_REG(test_tail_eval);
+  PT_REG(test_tail_keeps_frame_for_eval);
+  PT_REG(test_tail_keeps_frame_for_callee);
+  PT_REG(test_tail_shadowed_frame);
+  PT_REG(test_tail_mutual_distinct);
+  PT_REG(test_tail_carry_newest);
+  PT_REG(test_tail_error);
+}
+
+/* Whether reading src fails with exactly msg. */
+static bool read_err(char *src, char *msg) {
+  lval *x = lval_read("<stdin>", src);
+  bool ok = lval_type(x) == LTYPE_ERR && streq(x->err, msg);
+  if (!ok) {
+    printf("    got ");
+    lval_print(x);
+    printf("\n");
+  }
+  lval_delete(x);
+  return ok;
+}
+
+PT_FUNC(test_reader_atoms) {
+  lval *x = lval_read("<test>", "42 -7 1.5 -0.25 - -x abc ; comment\n+");
+  PT_ASSERT(lval_type(x) == LTYPE_SEXP && x->count == 8);
+  PT_ASSERT(lval_numval(x->cell[0]) == 42);
+  PT_ASSERT(lval_numval(x->cell[1]) == -7);
+  PT_ASSERT(lval_type(x->cell[2]) == LTYPE_DBL && x->cell[2]->dbl == 1.5);
+  PT_ASSERT(lval_type(x->cell[3]) == LTYPE_DBL && x->cell[3]->dbl == -0.25);
+  PT_ASSERT(lval_type(x->cell[4]) == LTYPE_SYM &&
+            streq(x->cell[4]->sym->name, "-"));
+  PT_ASSERT(streq(x->cell[5]->sym->name, "-x"));
+  PT_ASSERT(x->cell[6]->sym == lsym_intern("abc"));
+  PT_ASSERT(streq(x->cell[7]->sym->name, "+"));
+  lval_delete(x);
+}
+
+PT_FUNC(test_reader_lists) {
+  lval *x = lval_read("<test>", "(a {b (c)} {})");
+  PT_ASSERT(x->count == 1);
+  lval *l = x->cell[0];
+  PT_ASSERT(lval_type(l) == LTYPE_SEXP && l->count == 3);
+  PT_ASSERT(lval_type(l->cell[1]) == LTYPE_QEXP && l->cell[1]->count == 2);
+  PT_ASSERT(lval_type(l->cell[1]->cell[1]) == LTYPE_SEXP);
+  PT_ASSERT(lval_type(l->cell[2]) == LTYPE_QEXP && l->cell[2]->count == 0);
+  lval_delete(x);
+}
+
+PT_FUNC(test_reader_strings) {
+  lval *x = lval_read("<test>", "\"a\\n\\\"b\\0c\" \"\"");
+  lval *s = lval_str("a\n\"b\0c", 6);
+  lval *empty = lval_str("", 0);
+  PT_ASSERT(x->count == 2);
+  PT_ASSERT(lval_eq(x->cell[0], s));
+  PT_ASSERT(lval_eq(x->cell[1], empty));
+  lval_delete(x);
+  lval_delete(s);
+  lval_delete(empty);
+}
+
+PT_FUNC(test_reader_errors) {
+  PT_ASSERT(read_err("(+ 1", "<stdin>:1:5: error: expected number, string, "
+                             "symbol, '(', '{' or ')' at end of input"));
+  PT_ASSERT(read_err("{1\n 2", "<stdin>:2:3: error: expected number, "
+                               "string, symbol, '(', '{' or '}' at end of "
+                               "input"));
+  PT_ASSERT(read_err("(1 . 2)", "<stdin>:1:4: error: expected number, "
+                                "string, symbol, '(' or '{' at '.'"));
+  PT_ASSERT(read_err(")", "<stdin>:1:1: error: expected number, string, "
+                          "symbol, '(' or '{' at ')'"));
+  PT_ASSERT(read_err("\"abc", "<stdin>:1:5: error: expected '\"' at end "
+                              "of input"));
+}
+
+PT_FUNC(test_reader_depth) {
+  char src[LREAD_MAX_DEPTH + 2];
+  memset(src, '(', sizeof(src) - 1);
+  src[sizeof(src) - 1] = 0;
+  lval *x = lval_read("<stdin>", src);
+  PT_ASSERT(lval_type(x) == LTYPE_ERR &&
+            strstr(x->err, "Maximum recursion depth exceeded!"));
+  lval_delete(x);
+}
+
+/* Float literals that underflow read as zero; ones that overflow fail. */
+PT_FUNC(test_reader_range) {
+  char src[410];
+  strcpy(src, "0.");
+  memset(src + 2, '0', 400);
+  strcpy(src + 402, "1");
+  lval *x = lval_read("<stdin>", src);
+  PT_ASSERT(x->count == 1 && lval_type(x->cell[0]) == LTYPE_DBL &&
+            x->cell[0]->dbl == 0);
+  lval_delete(x);
+  strcpy(src, "0.");
+  memset(src + 2, '0', 310);
+  strcpy(src + 312, "1");
+  x = lval_read("<stdin>", src);
+  PT_ASSERT(x->count == 1 && lval_type(x->cell[0]) == LTYPE_DBL &&
+            x->cell[0]->dbl > 0 && x->cell[0]->dbl < 1e-310);
+  lval_delete(x);
+  src[0] = '1';
+  memset(src + 1, '0', 400);
+  strcpy(src + 401, ".0");
+  x = lval_read("<stdin>", src);
+  PT_ASSERT(x->count == 1 && lval_type(x->cell[0]) == LTYPE_ERR &&
+            strstr(x->cell[0]->err, "Not a number"));
+  lval_delete(x);
+}
+
+PT_SUITE(suite_reader) {
+  PT_REG(test_reader_atoms);
+  PT_REG(test_reader_lists);
+  PT_REG(test_reader_strings);
+  PT_REG(test_reader_errors);
+  PT_REG(test_reader_depth);
+  PT_REG(test_reader_range);
+}
+
+/* Reference counting never frees a list that holds itself. */
+static void gc_make_cycle() {
+  lval *q = lval_qexp();
+  q = lval_add(q, lval_num(1));
+  q = lval_add(q, lval_ref(q));
+  lval_delete(q);
+}
+
+PT_FUNC(test_gc_frees_cycles) {
+  lenv *e = test_env();
+  size_t objects = gc.objects, freed = gc.freed;
+  gc_make_cycle();
+  PT_ASSERT(gc.objects == objects + 1);
+  gc_collect();
+  PT_ASSERT(gc.objects == objects);
+  PT_ASSERT(gc.freed == freed + 1);
+  test_env_delete(e);
+}
+
+PT_FUNC(test_gc_keeps_reachable) {
+  lenv *e = test_env();
+  lval *x = run(e, "(def {xs} {1 2 {3 4}})"
+                   "(def {f} (\\ {n} {join xs (list n)}))"
+                   "(def {m} (map {1 10 2 20}))");
+  lval_delete(x);
+  gc_collect();
+  PT_ASSERT(run_is(e, "(f 5)", "{1 2 {3 4} 5}"));
+  PT_ASSERT(run_is(e, "(get m 2)", "20"));
+  test_env_delete(e);
+}
+
+PT_FUNC(test_gc_safepoint) {
+  lenv *e = test_env();
+  size_t collections = gc.collections;
+  gc_make_cycle();
+  gc_safepoint();
+  PT_ASSERT(gc.collections == collections);
+  gc.enabled = true;
+  gc.threshold = 0;
+  gc_safepoint();
+  PT_ASSERT(gc.collections == collections + 1);
+  PT_ASSERT(gc.threshold >= GC_MIN_HEAP);
+  gc.enabled = false;
+  PT_ASSERT(run_is(e, "(len (gc-stats {}))", "7"));
+  test_env_delete(e);
+}
+
+/* A top-level load collects between forms. After the first form the
+ * forms still to run are held only by the load itself. */
+PT_FUNC(test_gc_load) {
+  char path[] = "/tmp/lispy-test-XXXXXX";
+  int fd = mkstemp(path);
+  FILE *f = fdopen(fd, "w");
+  fputs("(def {xs} {1 2 3})\n"
+        "(def {ys} (join xs xs))\n"
+        "(def {n} (len ys))\n",
+        f);
+  fclose(f);
+
+  lenv *e = test_env();
+  size_t collections = gc.collections;
+  gc.enabled = true;
+  gc.threshold = 0;
+  lval_delete(lval_load(e, path, true));
+  gc.enabled = false;
+  gc.threshold = GC_MIN_HEAP;
+  PT_ASSERT(gc.collections > collections);
+  PT_ASSERT(run_is(e, "n", "6"));
+  PT_ASSERT(run_is(e, "ys", "{1 2 3 1 2 3}"));
+  test_env_delete(e);
+  remove(path);
+}
+
+PT_SUITE(suite_gc) {
+  PT_REG(test_gc_frees_cycles);
+  PT_REG(test_gc_keeps_reachable);
+  PT_REG(test_gc_safepoint);
+  PT_REG(test_gc_load);
+}
+
+static uint32_t test_rand() {
+  static uint64_t x = 88172645463325252ULL;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return (uint32_t)x;
+}
+
+/* Random limbs, biased towards runs of all-zero and all-one bits, which
+ * exercise the carry and quotient correction paths. */
+static lbig test_big(size_t len) {
+  lbig r = lbig_alloc(len);
+  for (size_t i = 0; i < len; i++) {
+    uint32_t x = test_rand();
+    r.d[i] = x % 5 == 0 ? 0 : x % 5 == 1 ? 0xffffffff : test_rand();
+  }
+  if (len > 0 && r.d[len - 1] == 0) {
+    r.d[len - 1] = 1;
+  }
+  return r;
+}
+
+/* Schoolbook product, as a reference for lbig_mul_mag. */
+static void test_mul_ref(uint32_t *r, const uint32_t *a, size_t an,
+                         const uint32_t *b, size_t bn) {
+  memset(r, 0, sizeof(*r) * (an + bn));
+  for (size_t i = 0; i < an; i++) {
+    uint64_t carry = 0;
+    for (size_t j = 0; j < bn; j++) {
+      carry += (uint64_t)a[i] * b[j] + r[i + j];
+      r[i + j] = (uint32_t)carry;
+      carry >>= 32;
+    }
+    r[i + bn] = (uint32_t)carry;
+  }
+}
+
+PT_FUNC(test_big_promote) {
+  lenv *e = test_env();
+  lval *x = run(e, "(+ 9223372036854775807 1)");
+  PT_ASSERT(lval_type(x) == LTYPE_BIG);
+  lval_delete(x);
+  PT_ASSERT(run_is(e, "(+ 9223372036854775807 1)", "9223372036854775808"));
+  PT_ASSERT(run_is(e, "(* 4294967296 4294967296)", "18446744073709551616"));
+  PT_ASSERT(run_is(e, "(- -9223372036854775807 2)", "-9223372036854775809"));
+  PT_ASSERT(
+      run_is(e, "(/ -9223372036854775808 -1)", "9223372036854775808"));
+  test_env_delete(e);
+}
+
+PT_FUNC(test_big_demote) {
+  lenv *e = test_env();
+  lval *x = run(e, "(- 9223372036854775808 1)");
+  PT_ASSERT(lval_type(x) == LTYPE_NUM && lval_numval(x) == LONG_MAX);
+  lval_delete(x);
+  x = run(e, "(- 0 9223372036854775808)");
+  PT_ASSERT(lval_type(x) == LTYPE_NUM && lval_numval(x) == LONG_MIN);
+  lval_delete(x);
+  x = run(e, "(/ 100000000000000000000000 100000000000000000000)");
+  PT_ASSERT(lval_type(x) == LTYPE_NUM && lval_numval(x) == 1000);
+  lval_delete(x);
+  test_env_delete(e);
+}
+
+PT_FUNC(test_big_arith) {
+  lenv *e = test_env();
+  PT_ASSERT(run_is(e, "(/ -100000000000000000000 3)", "-33333333333333333333"));
+  PT_ASSERT(run_is(e, "(- 100000000000000000000)", "-100000000000000000000"));
+  PT_ASSERT(run_is(e, "(< 9223372036854775807 9223372036854775808)", "1"));
+  PT_ASSERT(run_is(e, "(> -9223372036854775809 -9223372036854775808)", "0"));
+  lval *x = run(e, "(+ 0.5 18446744073709551616)");
+  PT_ASSERT(lval_type(x) == LTYPE_DBL && x->dbl == 18446744073709551616.0);
+  lval_delete(x);
+  PT_ASSERT(run_err(e, "(/ 100000000000000000000 0)", "Division by zero"));
+  test_env_delete(e);
+}
+
+PT_FUNC(test_big_parse) {
+  lbig a = lbig_parse("18446744073709551616");
+  PT_ASSERT(a.len == 3 && a.d[0] == 0 && a.d[1] == 0 && a.d[2] == 1);
+  PT_ASSERT(!a.neg);
+  lbig z = lbig_parse("-0000");
+  PT_ASSERT(z.len == 0 && !z.neg);
+  free(a.d);
+  free(z.d);
+}
+
+/* Products on both sides of LBIG_KARATSUBA, balanced and unbalanced. */
+PT_FUNC(test_big_mul) {
+  static const size_t sizes[][2] = {{1, 1},   {31, 31},  {32, 32}, {33, 32},
+                                    {64, 40}, {100, 33}, {97, 97}, {200, 65},
+                                    {257, 32}};
+  for (size_t k = 0; k < sizeof(sizes) / sizeof(*sizes); k++) {
+    size_t an = sizes[k][0], bn = sizes[k][1];
+    lbig a = test_big(an), b = test_big(bn);
+    uint32_t *r = malloc(sizeof(*r) * (an + bn));
+    uint32_t *ref = malloc(sizeof(*ref) * (an + bn));
+    lbig_mul_mag(r, a.d, an, b.d, bn);
+    test_mul_ref(ref, a.d, an, b.d, bn);
+    PT_ASSERT(memcmp(r, ref, sizeof(*r) * (an + bn)) == 0);
+    free(a.d);
+    free(b.d);
+    free(r);
+    free(ref);
+  }
+}
+
+/* Checks q * v <= u < (q + 1) * v for the quotient of random operands. */
+PT_FUNC(test_big_div) {
+  for (int k = 0; k < 200; k++) {
+    size_t vn = 1 + test_rand() % 20, un = vn + test_rand() % 20;
+    lbig u = test_big(un), v = test_big(vn);
+    lbig q = lbig_div(&u, &v);
+    lbig lo = lbig_mul(&q, &v);
+    lbig hi = lbig_add(&lo, &v, false);
+    PT_ASSERT(lbig_cmp(&lo, &u) <= 0);
+    PT_ASSERT(lbig_cmp(&u, &hi) < 0);
+    free(u.d);
+    free(v.d);
+    free(q.d);
+    free(lo.d);
+    free(hi.d);
+  }
+}
+
+PT_SUITE(suite_big) {
+  PT_REG(test_big_promote);
+  PT_REG(test_big_demote);
+  PT_REG(test_big_arith);
+  PT_REG(test_big_parse);
+  PT_REG(test_big_mul);
+  PT_REG(test_big_div);
+}
+
+PT_FUNC(test_map_basic) {
+  lenv *e = test_env();
+  PT_ASSERT(run_is(e, "(get (map {1 10 \"a\" 20}) \"a\")", "20"));
+  PT_ASSERT(run_is(e, "(get (map {1 10}) 1.0)", "10"));
+  PT_ASSERT(run_is(e, "(get (map {1 10}) 2 -1)", "-1"));
+  PT_ASSERT(run_err(e, "(get (map {1 10}) 2)", "key not found"));
+  PT_ASSERT(run_is(e, "(len (map {1 10 1 20}))", "1"));
+  PT_ASSERT(run_is(e, "(get (map {1 10 1 20}) 1)", "20"));
+  PT_ASSERT(run_is(e, "(== (map {1 2 3 4}) (map {3 4 1 2}))", "1"));
+  PT_ASSERT(run_is(e, "(== (map {1 2 3 4}) (map {3 4 1 5}))", "0"));
+  PT_ASSERT(run_err(e, "(map {1 2 3})", "alternating keys and values"));
+  test_env_delete(e);
+}
+
+PT_FUNC(test_map_persistent) {
+  lenv *e = test_env();
+  lval *x = run(e, "(def {fill} (\\ {m n}"
+                   "  {if (== n 0) {m} {fill (assoc m n (* n n)) (- n 1)}}))"
+                   "(def {m} (fill (map {}) 2000))"
+                   "(def {m2} (dissoc m 1 2 3 5000))"
+                   "(def {check} (\\ {m n}"
+                   "  {if (== n 3) {1}"
+                   "    {if (== (get m n) (* n n)) {check m (- n 1)} {0}}}))");
+  lval_delete(x);
+  PT_ASSERT(run_is(e, "(len m)", "2000"));
+  PT_ASSERT(run_is(e, "(len m2)", "1997"));
+  PT_ASSERT(run_is(e, "(check m 2000)", "1"));
+  PT_ASSERT(run_is(e, "(check m2 2000)", "1"));
+  PT_ASSERT(run_is(e, "(get m 2)", "4"));
+  PT_ASSERT(run_is(e, "(get m2 2 -1)", "-1"));
+  PT_ASSERT(run_is(e, "(len (keys m2))", "1997"));
+  PT_ASSERT(run_is(e, "(len (pairs m2))", "3994"));
+  PT_ASSERT(run_is(e, "(== (dissoc m2) m2)", "1"));
+  test_env_delete(e);
+}
+
+/* Inserts key k with value -k under a chosen hash, consuming n. */
+static lhamt *test_assoc(lhamt *n, size_t hash, long k) {
+  bool added;
+  lhamt_slot s = {.hash = hash, .key = lval_num(k), .val = lval_num(-k)};
+  lhamt *r = lhamt_assoc(n, 0, s, &added);
+  lhamt_release(n);
+  return r;
+}
+
+static lhamt *test_dissoc(lhamt *n, size_t hash, long k, bool *removed) {
+  lval *key = lval_num(k);
+  lhamt *r = lhamt_dissoc(n, 0, hash, key, removed);
+  lhamt_release(n);
+  return r;
+}
+
+static bool test_get(lhamt *n, size_t hash, long k) {
+  lval *x = lhamt_get(n, hash, lval_num(k));
+  return x && lval_numval(x) == -k;
+}
+
+/* Keys whose hashes agree in every bit share a collision node; keys that
+ * agree only in their low bits are pushed down to where they differ. */
+PT_FUNC(test_map_collisions) {
+  size_t full = 0x1234, part = 0x1234 | (size_t)1 << 40;
+  lhamt *n = 0;
+  for (long k = 1; k <= 5; k++) {
+    n = test_assoc(n, full, k);
+  }
+  n = test_assoc(n, part, 6);
+  for (long k = 1; k <= 5; k++) {
+    PT_ASSERT(test_get(n, full, k));
+    PT_ASSERT(!test_get(n, part, k));
+  }
+  PT_ASSERT(test_get(n, part, 6));
+  PT_ASSERT(!test_get(n, full, 6));
+  PT_ASSERT(!test_get(n, full, 7));
+
+  n = test_assoc(n, full, 3);
+  PT_ASSERT(test_get(n, full, 3));
+
+  bool removed;
+  n = test_dissoc(n, full, 7, &removed);
+  PT_ASSERT(!removed);
+  n = test_dissoc(n, part, 1, &removed);
+  PT_ASSERT(!removed);
+  for (long k = 1; k <= 5; k++) {
+    n = test_dissoc(n, full, k, &removed);
+    PT_ASSERT(removed);
+    PT_ASSERT(!test_get(n, full, k));
+  }
+  /* The last entry is pulled back up to the root. */
+  PT_ASSERT(n && n->count == 1 && n->slots[0].key);
+  PT_ASSERT(test_get(n, part, 6));
+  n = test_dissoc(n, part, 6, &removed);
+  PT_ASSERT(removed && !n);
+}
+
+PT_SUITE(suite_map) {
+  PT_REG(test_map_basic);
+  PT_REG(test_map_persistent);
+  PT_REG(test_map_collisions);
+}
+
+PT_FUNC(test_sym_interned) {
+  lsym *a = lsym_intern("interned");
+  char name[] = "interned";
+  PT_ASSERT(lsym_intern(name) == a);
+  PT_ASSERT(lsym_intern("interned2") != a);
+  lval *x = lval_sym("interned");
+  lval *r = lval_read("<test>", "interned");
+  PT_ASSERT(x->sym == a && r->cell[0]->sym == a);
+  PT_ASSERT(lval_eq(x, r->cell[0]));
+  lval_delete(x);
+  lval_delete(r);
+}
+
+/* Enough names to grow the table several times, all still found. */
+PT_FUNC(test_sym_table_grows) {
+  lsym *syms[2000];
+  char name[32];
+  for (int i = 0; i < 2000; i++) {
+    snprintf(name, sizeof(name), "sym-%d", i);
+    syms[i] = lsym_intern(name);
+  }
+  bool ok = true;
+  for (int i = 0; i < 2000; i++) {
+    snprintf(name, sizeof(name), "sym-%d", i);
+    ok = ok && lsym_intern(name) == syms[i] && streq(syms[i]->name, name);
+  }
+  PT_ASSERT(ok);
+}
+
+PT_SUITE(suite_sym) {
+  PT_REG(test_sym_interned);
+  PT_REG(test_sym_table_grows);
+}
+
+PT_FUNC(test_env_hashed_globals) {
+  lenv *e = test_env();
+  PT_ASSERT(lenv_hashed(e));
+  char src[64];
+  for (int i = 0; i < 500; i++) {
+    snprintf(src, sizeof(src), "(def {g%d} %d)", i, i * 3);
+    lval_delete(run(e, src));
+  }
+  bool ok = true;
+  for (int i = 0; i < 500; i++) {
+    snprintf(src, sizeof(src), "g%d", i);
+    lval *x = run(e, src);
+    ok = ok && lval_type(x) == LTYPE_NUM && lval_numval(x) == i * 3;
+    lval_delete(x);
+  }
+  PT_ASSERT(ok);
+  PT_ASSERT(run_is(e, "(def {g7} 1) g7", "1"));
+  PT_ASSERT(run_err(e, "g500", "Unbound symbol g500"));
+  test_env_delete(e);
+}
+
+/* Frames start as packed arrays and switch to hashing past
+ * LENV_LINEAR_MAX bindings. */
+PT_FUNC(test_env_frames) {
+  lenv *e = test_env();
+  PT_ASSERT(run_is(e,
+                   "(def {f} (\\ {a b c d e f g h i j k l}"
+                   "  {list a e l (= {m} 13) m}))"
+                   "(f 1 2 3 4 5 6 7 8 9 10 11 12)",
+                   "{1 5 12 () 13}"));
+  PT_ASSERT(run_is(e, "(def {g} (\\ {a b} {list b a})) (g 1 2)", "{2 1}"));
+  lenv *small = lenv_new();
+  small->par = e;
+  lval *k[LENV_LINEAR_MAX + 1];
+  char name[16];
+  for (int i = 0; i <= LENV_LINEAR_MAX; i++) {
+    snprintf(name, sizeof(name), "local%d", i);
+    k[i] = lval_sym(name);
+    lenv_put(small, k[i], lval_num(i));
+    PT_ASSERT(lenv_hashed(small) == (i == LENV_LINEAR_MAX));
+  }
+  bool ok = true;
+  for (int i = 0; i <= LENV_LINEAR_MAX; i++) {
+    lval **slot = lenv_find(small, k[i]->sym);
+    ok = ok && slot && lval_numval(*slot) == i;
+    lval_delete(k[i]);
+  }
+  PT_ASSERT(ok);
+  PT_ASSERT(lsym_intern("local0")->nlocal == 1);
+  lenv_delete(small);
+  PT_ASSERT(lsym_intern("local0")->nlocal == 0);
+  test_env_delete(e);
+}
+
+PT_SUITE(suite_env) {
+  PT_REG(test_env_hashed_globals);
+  PT_REG(test_env_frames);
+}
+
+PT_FUNC(test_resolve_addresses) {
+  lenv *e = test_env();
+  lval *f = run(e, "(\\ {a & b} {+ a (len b) (\\ {c} {list a c}) z})");
+  PT_ASSERT(lval_type(f) == LTYPE_FUN);
+  lval **c = f->body->cell;
+  PT_ASSERT(c[0]->depth == -1);
+  PT_ASSERT(c[1]->depth == 0 && c[1]->slot == 0);
+  PT_ASSERT(c[2]->cell[1]->depth == 0 && c[2]->cell[1]->slot == 1);
+  lval **inner = c[3]->cell[2]->cell;
+  PT_ASSERT(inner[1]->depth == 1 && inner[1]->slot == 0);
+  PT_ASSERT(inner[2]->depth == 0 && inner[2]->slot == 0);
+  PT_ASSERT(c[4]->depth == -1);
+  lval_delete(f);
+  test_env_delete(e);
+}
+
+PT_FUNC(test_resolve_nested) {
+  lenv *e = test_env();
+  PT_ASSERT(run_is(e, "((\\ {x} {(\\ {y} {+ x y}) 1}) 10)", "11"));
+  test_env_delete(e);
+}
+
+/* Lookups stay dynamic: an address that does not match the frames the
+ * call actually runs in falls back to searching them by name. */
+PT_FUNC(test_resolve_dynamic) {
+  lenv *e = test_env();
+  lval_delete(run(e, "(def {mk} (\\ {x} {\\ {y} {+ x y}}))"));
+  PT_ASSERT(run_err(e, "((mk 1) 2)", "Unbound symbol x"));
+  PT_ASSERT(run_is(e, "(def {x} 100) ((mk 1) 2)", "102"));
+  PT_ASSERT(run_is(e,
+                   "(def {outer} (\\ {x} {mid (\\ {y} {+ x y})}))"
+                   "(def {mid} (\\ {f} {(\\ {a} {f 1}) 50}))"
+                   "(outer 1)",
+                   "2"));
+  PT_ASSERT(run_is(e,
+                   "(def {shadow} (\\ {f} {(\\ {x} {f 1}) 50}))"
+                   "(def {outer2} (\\ {x} {shadow (\\ {y} {+ x y})}))"
+                   "(outer2 1)",
+                   "51"));
+  test_env_delete(e);
+}
+
+/* Frames too large to scan are hashed, so their slots are not the formals'
+ * positions and lookups go by name. */
+PT_FUNC(test_resolve_hashed_frame) {
+  lenv *e = test_env();
+  PT_ASSERT(run_is(e, "((\\ {a b c d e f g h i} {list a i}) 1 2 3 4 5 6 7 8 9)",
+                   "{1 9}"));
+  PT_ASSERT(run_is(e,
+                   "((\\ {a b c d e f g h i} {(\\ {j} {+ e j}) 10})"
+                   " 1 2 3 4 5 6 7 8 9)",
+                   "15"));
+  test_env_delete(e);
+}
+
+PT_SUITE(suite_resolve) {
+  PT_REG(test_resolve_addresses);
+  PT_REG(test_resolve_nested);
+  PT_REG(test_resolve_hashed_frame);
+  PT_REG(test_resolve_dynamic);
+}
+
+PT_FUNC(test_vm_compiled_once) {
+  lenv *e = test_env();
+  char *src = "(\\ {x y} {+ (* x 2) (- y 1) (len {x y})})";
+  lval *x = run(e, src);
+  lval_delete(run(e, "(def {f} (\\ {x y} {+ (* x 2) (- y 1) (len {x y})}))"
+                     "(def {g} f)"));
+  lval *f = run(e, "f"), *g = run(e, "g");
+  lcode *code = f->code;
+  PT_ASSERT(code && g->code == code);
+  PT_ASSERT(OP_CODE(code->ops[code->count - 1]) == OP_RET);
+  PT_ASSERT(OP_CODE(code->ops[code->count - 2]) == OP_TAIL);
+  PT_ASSERT(code->depth >= 4);
+
+  bool ok = true;
+  for (long i = 0; i < 100; i++) {
+    lval *args = lval_sexp();
+    args = lval_add(args, lval_ref(f));
+    args = lval_add(args, lval_num(i));
+    args = lval_add(args, lval_num(i));
+    lval *r = lval_eval(e, args);
+    ok = ok && lval_numval(r) == 3 * i + 1;
+    lval_delete(r);
+  }
+  PT_ASSERT(ok);
+  PT_ASSERT(f->code == code && lval_eq(f->body, x->body));
+  lval_delete(x);
+  lval_delete(f);
+  lval_delete(g);
+  test_env_delete(e);
+}
+
+PT_FUNC(test_vm_errors) {
+  lenv *e = test_env();
+  PT_ASSERT(run_err(e, "((\\ {x} {+ x (head {})}) 1)", "empty list"));
+  PT_ASSERT(run_err(e, "((\\ {x} {+ (x 1) 2}) 1)", "Not a function"));
+  PT_ASSERT(run_err(e, "((\\ {x} {+ x nope}) 1)", "Unbound symbol nope"));
+  PT_ASSERT(run_is(e, "((\\ {x} {x}) 7)", "7"));
+  PT_ASSERT(run_is(e, "((\\ {x} {}) 7)", "()"));
+  test_env_delete(e);
+}
+
+PT_SUITE(suite_vm) {
+  PT_REG(test_vm_compiled_once);
+  PT_REG(test_vm_errors);
+}
+
+PT_FUNC(test_cow_mut) {
+  lval *q = lval_add(lval_qexp(), lval_num(1));
+  PT_ASSERT(lval_mut(q) == q && q->refs == 1);
+  lval_ref(q);
+  lval *p = lval_mut(q);
+  PT_ASSERT(p != q && q->refs == 1 && p->refs == 1);
+  PT_ASSERT(lval_eq(p, q));
+  p = lval_add(p, lval_num(2));
+  PT_ASSERT(q->count == 1 && p->count == 2);
+  lval_delete(p);
+  lval_delete(q);
+}
+
+PT_FUNC(test_cow_shared_lookup) {
+  lenv *e = test_env();
+  lval_delete(run(e, "(def {a} {1 2 {3 4}})"));
+  lval *x = run(e, "a");
+  lval *bound = *lenv_find(e, lsym_intern("a"));
+  PT_ASSERT(x == bound && x->refs == 2);
+  lval_delete(x);
+  PT_ASSERT(bound->refs == 1);
+  test_env_delete(e);
+}
+
+/* Builtins that change a list leave every other holder of it alone. */
+PT_FUNC(test_cow_builtins) {
+  lenv *e = test_env();
+  PT_ASSERT(run_is(e,
+                   "(def {a} {1 2 {3 4}})"
+                   "(def {b} (tail a))"
+                   "(def {c} (head a))"
+                   "(def {d} (join a {5}))"
+                   "(def {f} (\\ {xs} {tail xs}))"
+                   "(def {g} (f a))"
+                   "(eval (head (tail (tail a))))"
+                   "(list a b c d g)",
+                   "{{1 2 {3 4}} {2 {3 4}} {1} {1 2 {3 4} 5} {2 {3 4}}}"));
+  test_env_delete(e);
+}
+
+PT_SUITE(suite_cow) {
+  PT_REG(test_cow_mut);
+  PT_REG(test_cow_shared_lookup);
+  PT_REG(test_cow_builtins);
+}
+
+PT_FUNC(test_slab_reuse) {
+  void *a = slab_alloc(40);
+  void *b = slab_alloc(40);
+  PT_ASSERT(a != b);
+  PT_ASSERT((uintptr_t)a % SLAB_ALIGN == 0 && (uintptr_t)b % SLAB_ALIGN == 0);
+  slab_release(a, 40);
+  PT_ASSERT(slab_alloc(33) == a);
+  slab_release(a, 40);
+  slab_release(b, 40);
+  void *big = slab_alloc(SLAB_CLASSES * SLAB_ALIGN + 1);
+  PT_ASSERT(big != 0);
+  slab_release(big, SLAB_CLASSES * SLAB_ALIGN + 1);
+}
+
+PT_FUNC(test_arena) {
+  arena_reset();
+  larena_mark m = arena_mark();
+  char *a = arena_alloc(10);
+  char *b = arena_alloc(1);
+  PT_ASSERT((uintptr_t)a % 16 == 0 && b == a + 16);
+  larena_mark m2 = arena_mark();
+  char *c = arena_alloc(ARENA_CHUNK);
+  memset(c, 1, ARENA_CHUNK);
+  arena_release(m2);
+  PT_ASSERT(arena_alloc(1) == b + 16);
+  arena_release(m);
+  PT_ASSERT(arena_alloc(10) == a);
+  arena_reset();
+}
+
+/* Every value and env built and dropped by an evaluation goes back to
+ * the heap it came from. */
+PT_FUNC(test_alloc_balanced) {
+  lenv *e = test_env();
+  lval_delete(run(e, "(def {f} (\\ {n acc}"
+                     "  {if (== n 0) {acc} {f (- n 1) (join acc {n})}}))"));
+  size_t objects = gc.objects, bytes = gc.bytes;
+  lval_delete(run(e, "(f 1000 {})"));
+  lval_delete(run(e, "(tail (list 1 2 3 (vec 4) (map {5 6}) \"s\" 1.5))"));
+  PT_ASSERT(gc.objects == objects && gc.bytes == bytes);
+  test_env_delete(e);
+}
+
+PT_SUITE(suite_alloc) {
+  PT_REG(test_slab_reuse);
+  PT_REG(test_arena);
+  PT_REG(test_alloc_balanced);
+}
+
+PT_FUNC(test_fix_range) {
+  size_t objects = gc.objects;
+  long fixed[] = {0, 1, -1, LFIX_MAX, LFIX_MIN};
+  for (size_t i = 0; i < sizeof(fixed) / sizeof(*fixed); i++) {
+    lval *x = lval_num(fixed[i]);
+    PT_ASSERT(lval_is_fix(x) && lval_numval(x) == fixed[i]);
+  }
+  PT_ASSERT(gc.objects == objects);
+  long boxed[] = {LFIX_MAX + 1, LFIX_MIN - 1, LONG_MAX, LONG_MIN};
+  for (size_t i = 0; i < sizeof(boxed) / sizeof(*boxed); i++) {
+    lval *x = lval_num(boxed[i]);
+    PT_ASSERT(!lval_is_fix(x) && lval_type(x) == LTYPE_NUM);
+    PT_ASSERT(lval_numval(x) == boxed[i]);
+    lval_delete(x);
+  }
+  PT_ASSERT(gc.objects == objects);
+}
+
+/* Boxed and immediate numbers are interchangeable. */
+PT_FUNC(test_fix_boundary) {
+  lenv *e = test_env();
+  PT_ASSERT(run_is(e, "(+ 4611686018427387903 1)", "4611686018427387904"));
+  PT_ASSERT(run_is(e, "(- 4611686018427387904 1)", "4611686018427387903"));
+  PT_ASSERT(run_is(e, "(== (- 4611686018427387904 1) 4611686018427387903)",
+                   "1"));
+  PT_ASSERT(run_is(e, "(< 4611686018427387903 4611686018427387904)", "1"));
+  PT_ASSERT(run_is(e,
+                   "(get (map {4611686018427387904 1})"
+                   "     (+ 4611686018427387903 1))",
+                   "1"));
+  PT_ASSERT(run_is(e, "(- -4611686018427387904 1)", "-4611686018427387905"));
+  test_env_delete(e);
+}
+
+PT_SUITE(suite_fix) {
+  PT_REG(test_fix_range);
+  PT_REG(test_fix_boundary);
+}
+
+PT_FUNC(test_arith_nary) {
+  lenv *e = test_env();
+  PT_ASSERT(run_is(e, "(+ 1 2 3 4)", "10"));
+  PT_ASSERT(run_is(e, "(- 5)", "-5"));
+  PT_ASSERT(run_is(e, "(- 10 1 2 3)", "4"));
+  PT_ASSERT(run_is(e, "(* 2 3 4)", "24"));
+  PT_ASSERT(run_is(e, "(/ 100 2 5)", "10"));
+  PT_ASSERT(run_is(e, "(/ -7 2)", "-3"));
+  PT_ASSERT(run_err(e, "(/ 1 0)", "Division by zero"));
+  PT_ASSERT(run_err(e, "(+ 1 {2})", "'+' expected Number, got Q-Expression"));
+  lval *x = builtin_add(e, lval_sexp());
+  PT_ASSERT(lval_type(x) == LTYPE_ERR && streq(x->err, "No args for +"));
+  lval_delete(x);
+  test_env_delete(e);
+}
+
+/* Sums n copies of the operands in xs through builtin_add. */
+static lval *test_sum(long *xs, size_t nxs, size_t n) {
+  lval *v = lval_sexp();
+  for (size_t i = 0; i < n; i++) {
+    v = lval_add(v, lval_num(xs[i % nxs]));
+  }
+  return builtin_add(0, v);
+}
+
+/* Sums run over more than one block, overflow a long partway through,
+ * and end either back within range or beyond it. */
+PT_FUNC(test_arith_sum_blocks) {
+  size_t n = LARITH_BLOCK * 3 + 5;
+  long ones[] = {1};
+  lval *x = test_sum(ones, 1, n);
+  PT_ASSERT(lval_type(x) == LTYPE_NUM && lval_numval(x) == (long)n);
+  lval_delete(x);
+
+  long swing[] = {LFIX_MAX, LFIX_MAX, LFIX_MAX, -LFIX_MAX, -LFIX_MAX,
+                  -LFIX_MAX};
+  x = test_sum(swing, 6, 6 * LARITH_BLOCK + 1);
+  PT_ASSERT(lval_type(x) == LTYPE_NUM && lval_numval(x) == LFIX_MAX);
+  lval_delete(x);
+
+  long boxed[] = {LONG_MAX, LONG_MIN + 1, 7};
+  x = test_sum(boxed, 3, 3 * LARITH_BLOCK);
+  PT_ASSERT(lval_type(x) == LTYPE_NUM && lval_numval(x) == 7 * LARITH_BLOCK);
+  lval_delete(x);
+
+  long big[] = {LFIX_MAX};
+  x = test_sum(big, 1, LARITH_BLOCK + 1);
+  lbig want = lbig_from_long(LFIX_MAX);
+  lbig k = lbig_from_long(LARITH_BLOCK + 1);
+  lbig prod = lbig_mul(&want, &k);
+  PT_ASSERT(lval_type(x) == LTYPE_BIG && lbig_cmp(&x->big, &prod) == 0);
+  lval_delete(x);
+  free(want.d);
+  free(k.d);
+  free(prod.d);
+
+  long negative[] = {LONG_MIN, -1};
+  x = test_sum(negative, 2, 2);
+  PT_ASSERT(lval_type(x) == LTYPE_BIG);
+  lval_delete(x);
+}
+
+PT_SUITE(suite_arith) {
+  PT_REG(test_arith_nary);
+  PT_REG(test_arith_sum_blocks);
+}
+
+PT_FUNC(test_cells_grow) {
+  lval *q = lval_qexp();
+  for (long i = 0; i < 1000; i++) {
+    q = lval_add(q, lval_num(i));
+  }
+  PT_ASSERT(q->count == 1000 && q->cap == 1024);
+  bool ok = true;
+  for (long i = 0; i < 1000; i++) {
+    ok = ok && lval_numval(q->cell[i]) == i;
+  }
+  PT_ASSERT(ok);
+  lval_delete(q);
+}
+
+/* Popping the head moves the start of the live cells rather than the
+ * cells; appends reuse the freed space once it outweighs the rest. */
+PT_FUNC(test_cells_pop_head) {
+  lval *q = lval_qexp();
+  for (long i = 0; i < 8; i++) {
+    q = lval_add(q, lval_num(i));
+  }
+  lval **mem = q->mem;
+  for (long i = 0; i < 5; i++) {
+    PT_ASSERT(lval_numval(lval_pop(q, 0)) == i);
+  }
+  PT_ASSERT(q->cell == mem + 5 && q->count == 3);
+  q = lval_add(q, lval_num(8));
+  PT_ASSERT(q->mem == mem && q->cell == mem && q->cap == 8);
+  PT_ASSERT(lval_numval(lval_pop(q, 2)) == 7);
+  bool ok = q->count == 3;
+  long want[] = {5, 6, 8};
+  for (size_t i = 0; ok && i < 3; i++) {
+    ok = lval_numval(q->cell[i]) == want[i];
+  }
+  PT_ASSERT(ok);
+  while (q->count > 0) {
+    lval_pop(q, 0);
+  }
+  PT_ASSERT(q->cell == q->mem);
+  lval_delete(q);
+}
+
+PT_FUNC(test_cells_builtins) {
+  lenv *e = test_env();
+  PT_ASSERT(run_is(e,
+                   "(def {build} (\\ {n acc}"
+                   "  {if (== n 0) {acc} {build (- n 1) (join acc {n})}}))"
+                   "(def {drain} (\\ {xs n}"
+                   "  {if (== (len xs) 0) {n} {drain (tail xs) (+ n 1)}}))"
+                   "(drain (build 2000 {}) 0)",
+                   "2000"));
+  PT_ASSERT(run_is(e, "(tail (tail (join {1 2} {3} {} {4 5})))", "{3 4 5}"));
+  test_env_delete(e);
+}
+
+PT_SUITE(suite_cells) {
+  PT_REG(test_cells_grow);
+  PT_REG(test_cells_pop_head);
+  PT_REG(test_cells_builtins);
+}
+
+PT_FUNC(test_frames_copy_shares) {
+  lenv *e = test_env();
+  lval *f = run(e, "(\\ {x} {+ x 1})");
+  lval *g = lval_copy(f);
+  PT_ASSERT(g != f && g->formals == f->formals && g->body == f->body &&
+            g->code == f->code);
+  lval_delete(g);
+  lval_delete(f);
+  test_env_delete(e);
+}
+
+/* Each call binds into its own frame, which goes away with the call. */
+PT_FUNC(test_frames_per_call) {
+  lenv *e = test_env();
+  lval_delete(run(e, "(def {fact} (\\ {n}"
+                     "  {if (== n 0) {1} {* n (fact (- n 1))}}))"
+                     "(def {f} (\\ {x} {= {seen} x}))"));
+  size_t objects = gc.objects;
+  PT_ASSERT(run_is(e, "(fact 20)", "2432902008176640000"));
+  PT_ASSERT(run_is(e, "(f 1)", "()"));
+  PT_ASSERT(run_err(e, "seen", "Unbound symbol seen"));
+  PT_ASSERT(gc.objects == objects);
+  PT_ASSERT(lsym_intern("n")->nlocal == 0);
+  test_env_delete(e);
+}
+
+PT_SUITE(suite_frames) {
+  PT_REG(test_frames_copy_shares);
+  PT_REG(test_frames_per_call);
+}
+
+PT_FUNC(test_partial_apply) {
+  lenv *e = test_env();
+  lval_delete(run(e, "(def {add3} (\\ {a b c} {+ a b c}))"
+                     "(def {p} (add3 1))"
+                     "(def {q} (p 2))"));
+  PT_ASSERT(run_is(e, "(q 3)", "6"));
+  PT_ASSERT(run_is(e, "(p 10 20)", "31"));
+  PT_ASSERT(run_is(e, "(add3 1 2 3)", "6"));
+  PT_ASSERT(run_is(e, "(== (add3 1) p)", "1"));
+  PT_ASSERT(run_is(e, "(== (add3 2) p)", "0"));
+  PT_ASSERT(run_err(e, "(p 1 2 3)", "too many args, got 4, expected 3"));
+
+  lval *add3 = run(e, "add3"), *q = run(e, "q");
+  PT_ASSERT(q->target == add3 && !q->formals && !q->body && !q->code);
+  PT_ASSERT(q->bound->count == 2);
+  lval_delete(add3);
+  lval_delete(q);
+  test_env_delete(e);
+}
+
+PT_FUNC(test_partial_variadic) {
+  lenv *e = test_env();
+  lval_delete(run(e, "(def {f} (\\ {x & xs} {list x xs}))"
+                     "(def {all} (\\ {& xs} {xs}))"
+                     "(def {g} (\\ {a b & rest} {list a b rest}))"));
+  PT_ASSERT(run_is(e, "(f 1 2 3)", "{1 {2 3}}"));
+  PT_ASSERT(run_is(e, "(f 1)", "{1 {}}"));
+  PT_ASSERT(run_is(e, "(all 1 2)", "{1 2}"));
+  PT_ASSERT(run_is(e, "((g 1) 2 3 4)", "{1 2 {3 4}}"));
+  PT_ASSERT(run_is(e, "((g 1) 2)", "{1 2 {}}"));
+  PT_ASSERT(run_err(e, "(\\ {x &} {x})", "'&' must be followed"));
+  PT_ASSERT(run_err(e, "(\\ {& x y} {x})", "'&' must be followed"));
+  test_env_delete(e);
+}
+
+PT_SUITE(suite_partial) {
+  PT_REG(test_partial_apply);
+  PT_REG(test_partial_variadic);
+}
+
+/* Whether some OP_LOAD site of c has a cache entry valid right now. */
+static bool test_ic_cached(lcode *c) {
+  for (size_t i = 0; i < c->nconsts; i++) {
+    if (c->ics[i].version == lenv_version && c->ics[i].val) {
+      return true;
+    }
+  }
+  return false;
+}
+
+PT_FUNC(test_ic_redefine) {
+  lenv *e = test_env();
+  lval_delete(run(e, "(def {f} (\\ {x} {+ x g}))"
+                     "(def {g} 1)"));
+  PT_ASSERT(run_is(e, "(f 1)", "2"));
+  lval *f = run(e, "f");
+  PT_ASSERT(test_ic_cached(f->code));
+  size_t version = lenv_version;
+  PT_ASSERT(run_is(e, "(f 1)", "2"));
+  PT_ASSERT(lenv_version == version);
+
+  lval_delete(run(e, "(def {g} 10)"));
+  PT_ASSERT(!test_ic_cached(f->code));
+  PT_ASSERT(run_is(e, "(f 1)", "11"));
+  PT_ASSERT(test_ic_cached(f->code));
+  lval_delete(run(e, "(def {g} {a b})"));
+  PT_ASSERT(run_err(e, "(f 1)", "expected Number"));
+  lval_delete(f);
+  test_env_delete(e);
+}
+
+PT_FUNC(test_ic_shadowed) {
+  lenv *e = test_env();
+  lval_delete(run(e, "(def {f} (\\ {x} {+ x g}))"
+                     "(def {h} (\\ {g} {f 0}))"
+                     "(def {k} (\\ {y} {tail (list (= {g} y) (f 0))}))"
+                     "(def {g} 1)"));
+  PT_ASSERT(run_is(e, "(f 0)", "1"));
+  PT_ASSERT(run_is(e, "(h 5)", "5"));
+  PT_ASSERT(run_is(e, "(f 0)", "1"));
+  PT_ASSERT(run_is(e, "(k 7)", "{7}"));
+  PT_ASSERT(run_is(e, "(f 0)", "1"));
+  PT_ASSERT(lsym_intern("g")->nlocal == 0);
+  test_env_delete(e);
+}
+
+PT_SUITE(suite_ic) {
+  PT_REG(test_ic_redefine);
+  PT_REG(test_ic_shadowed);
+}
+
+/* Whether c holds a constant equal to the value of src. */
+static bool test_has_const(lenv *e, lcode *c, char *src) {
+  lval *x = run(e, src);
+  bool found = false;
+  for (size_t i = 0; !found && i < c->nconsts; i++) {
+    found = lval_eq(c->consts[i], x);
+  }
+  lval_delete(x);
+  return found;
+}
+
+PT_FUNC(test_fold_arith) {
+  lenv *e = test_env();
+  lval_delete(run(e, "(def {f} (\\ {x} {* x (* 60 60 24)}))"));
+  lval *f = run(e, "f");
+  PT_ASSERT(f->code->ndeps == 1 && f->code->fallback);
+  PT_ASSERT(test_has_const(e, f->code, "86400"));
+  PT_ASSERT(!test_has_const(e, f->code, "60"));
+  PT_ASSERT(run_is(e, "(f 2)", "172800"));
+
+  /* A call from a frame binding * and a redefinition of * both run the
+   * unfolded body. */
+  lval_delete(run(e, "(def {w} (\\ {*} {f 1}))"));
+  PT_ASSERT(run_is(e, "(w -)", "25"));
+  PT_ASSERT(run_is(e, "(f 2)", "172800"));
+  lval_delete(run(e, "(def {*} -)"));
+  PT_ASSERT(run_is(e, "(f 2)", "26"));
+  lval_delete(f);
+
+  lval *g = run(e, "(\\ {*} {* 2 3})");
+  PT_ASSERT(!g->code->fallback && !test_has_const(e, g->code, "6"));
+  lval_delete(g);
+  PT_ASSERT(run_is(e, "((\\ {*} {* 2 3}) +)", "5"));
+  PT_ASSERT(run_err(e, "((\\ {x} {/ x 0}) 1)", "Division by zero"));
+  PT_ASSERT(run_err(e, "((\\ {x} {/ 1 0}) 1)", "Division by zero"));
+  test_env_delete(e);
+}
+
+PT_FUNC(test_fold_lists) {
+  lenv *e = test_env();
+  lval_delete(
+      run(e, "(def {h} (\\ {x} {join (head {1 2 3}) (tail {4 5 6}) x}))"));
+  lval *h = run(e, "h");
+  PT_ASSERT(h->code->ndeps == 2);
+  PT_ASSERT(test_has_const(e, h->code, "{1}"));
+  PT_ASSERT(test_has_const(e, h->code, "{5 6}"));
+  PT_ASSERT(run_is(e, "(h {7})", "{1 5 6 7}"));
+  lval_delete(run(e, "(def {head} tail)"));
+  PT_ASSERT(run_is(e, "(h {7})", "{2 3 5 6 7}"));
+  lval_delete(h);
+  test_env_delete(e);
+}
+
+PT_FUNC(test_fold_if) {
+  lenv *e = test_env();
+  lval_delete(run(e, "(def {g} (\\ {x} {if (> 2 1) {+ x 1} {head {}}}))"));
+  lval *g = run(e, "g");
+  PT_ASSERT(g->code->fallback);
+  PT_ASSERT(!test_has_const(e, g->code, "{head {}}"));
+  PT_ASSERT(run_is(e, "(g 1)", "2"));
+  lval_delete(run(e, "(def {>} <)"));
+  PT_ASSERT(run_err(e, "(g 1)", "empty"));
+  lval_delete(g);
+  test_env_delete(e);
+}
+
+PT_SUITE(suite_fold) {
+  PT_REG(test_fold_arith);
+  PT_REG(test_fold_lists);
+  PT_REG(test_fold_if);
+}
+
+PT_FUNC(test_dbl_arith) {
+  lenv *e = test_env();
+  PT_ASSERT(run_is(e, "(+ 1 2.5)", "3.5"));
+  PT_ASSERT(run_is(e, "(* 1.5 2)", "3.0"));
+  PT_ASSERT(run_is(e, "(- 0.5)", "-0.5"));
+  PT_ASSERT(run_is(e, "(/ 1 4.0)", "0.25"));
+  PT_ASSERT(run_is(e, "(== 3 3.0)", "1"));
+  PT_ASSERT(run_is(e, "(< 2 2.5)", "1"));
+
+  lval *x = run(e, "(/ 7 2)");
+  PT_ASSERT(lval_type(x) == LTYPE_NUM && lval_numval(x) == 3);
+  lval_delete(x);
+  x = run(e, "(+ 1.0 1)");
+  PT_ASSERT(lval_type(x) == LTYPE_DBL && x->dbl == 2);
+  lval_delete(x);
+  x = run(e, "(/ -1.0 0)");
+  PT_ASSERT(lval_type(x) == LTYPE_DBL && isinf(x->dbl) && x->dbl < 0);
+  lval_delete(x);
+  x = run(e, "(/ 0.0 0)");
+  PT_ASSERT(lval_type(x) == LTYPE_DBL && isnan(x->dbl));
+  lval_delete(x);
+  PT_ASSERT(run_is(e, "(== (/ 0.0 0) (/ 0.0 0))", "0"));
+  PT_ASSERT(run_err(e, "(/ 1 0)", "Division by zero"));
+  test_env_delete(e);
+}
+
+/* Integers are compared with floats exactly, so == stays transitive. */
+PT_FUNC(test_dbl_compare) {
+  lenv *e = test_env();
+  PT_ASSERT(run_is(e, "(== 9007199254740993 9007199254740992.0)", "0"));
+  PT_ASSERT(run_is(e, "(== 9007199254740993 9007199254740992)", "0"));
+  PT_ASSERT(run_is(e, "(> 9007199254740993 9007199254740992.0)", "1"));
+  PT_ASSERT(run_is(e, "(< 9007199254740992.0 9007199254740993)", "1"));
+  PT_ASSERT(run_is(e, "(== 9007199254740992 9007199254740992.0)", "1"));
+  PT_ASSERT(run_is(e, "(== 100000000000000000000 100000000000000000000.0)",
+                   "1"));
+  PT_ASSERT(run_is(e, "(> 100000000000000000001 100000000000000000000.0)",
+                   "1"));
+  PT_ASSERT(run_is(e, "(< -100000000000000000001 -100000000000000000000.0)",
+                   "1"));
+  PT_ASSERT(run_is(e, "(list (< 3 3.5) (> 4 3.5) (< -4 -3.5) (> -3 -3.5))",
+                   "{1 1 1 1}"));
+  PT_ASSERT(run_is(e, "(list (== 0 -0.0) (< -1 -0.5) (> 0 -0.5))", "{1 1 1}"));
+  PT_ASSERT(run_is(e, "(< 100000000000000000000000 (/ 1.0 0))", "1"));
+  PT_ASSERT(run_is(e, "(> 1 (/ -1.0 0))", "1"));
+  PT_ASSERT(run_is(e, "(== 1 (/ 0.0 0))", "0"));
+  lval *big = run(e, "9223372036854775808.0");
+  lbig b = lbig_from_double(big->dbl);
+  PT_ASSERT(b.len == 2 && b.d[0] == 0 && b.d[1] == 0x80000000 && !b.neg);
+  free(b.d);
+  lval_delete(big);
+  test_env_delete(e);
+}
+
+PT_FUNC(test_nvec_ops) {
+  lenv *e = test_env();
+  PT_ASSERT(run_is(e, "(+ (nvec 1 2 3) (nvec 4 5 6))", "(nvec 5 7 9)"));
+  PT_ASSERT(run_is(e, "(* 2 (nvec 1 2 3) 0.5)", "(nvec 1 2 3)"));
+  PT_ASSERT(run_is(e, "(- 10 (nvec 1 2))", "(nvec 9 8)"));
+  PT_ASSERT(run_is(e, "(- (nvec 1 2))", "(nvec -1 -2)"));
+  lval *x = run(e, "(/ (nvec 1 -1 0) 0)");
+  PT_ASSERT(lval_type(x) == LTYPE_NVEC && x->len == 3);
+  PT_ASSERT(x->data[0] == INFINITY && x->data[1] == -INFINITY);
+  PT_ASSERT(isnan(x->data[2]));
+  lval_delete(x);
+  PT_ASSERT(run_is(e, "(sum (iota 100))", "4950.0"));
+  PT_ASSERT(run_is(e, "(dot (iota 5) (iota 5))", "30.0"));
+  PT_ASSERT(run_is(e, "(len (+ (iota 1001) 1))", "1001"));
+  PT_ASSERT(run_is(e, "(sum (iota 0))", "0.0"));
+  PT_ASSERT(run_is(e, "(dot (iota 0) (iota 0))", "0.0"));
+  PT_ASSERT(run_is(e, "(+ (iota 0) 1 (iota 0))", "(iota 0)"));
+  PT_ASSERT(run_err(e, "(+ (iota 3) (iota 4))", "differ in length"));
+  PT_ASSERT(run_err(e, "(dot (iota 3) (iota 4))", "differ in length"));
+  PT_ASSERT(run_err(e, "(nvec 1 {2})", "'nvec' expected Number"));
+  test_env_delete(e);
+}
+
+/* Checks a kernel set against larith_apply for every op, every pair of
+ * scalar flags and lengths around the vector width. Empty inputs are
+ * passed as null pointers, which the kernels must not read. */
+static bool test_nvec_kernels(
+    void (*map)(enum larith, double *, const double *, bool, const double *,
+                bool, size_t),
+    double (*dot)(const double *, const double *, bool, size_t)) {
+  double a[19], b[19], out[19];
+  for (size_t i = 0; i < 19; i++) {
+    a[i] = (double)i * 1.5 - 7;
+    b[i] = (double)(i % 5) + 0.25;
+  }
+  bool ok = true;
+  for (size_t n = 0; n < 19; n++) {
+    for (int op = LARITH_ADD; op <= LARITH_DIV; op++) {
+      for (int flags = 0; flags < 4; flags++) {
+        bool as = flags & 1, bs = flags & 2;
+        map(op, out, n ? a : 0, as, n ? b : 0, bs, n);
+        for (size_t i = 0; i < n; i++) {
+          ok = ok && out[i] == larith_apply(op, a[as ? 0 : i], b[bs ? 0 : i]);
+        }
+      }
+    }
+    for (int bs = 0; bs < 2; bs++) {
+      double r = 0;
+      for (size_t i = 0; i < n; i++) {
+        r += a[i] * b[bs ? 0 : i];
+      }
+      ok = ok && fabs(dot(n ? a : 0, n ? b : 0, bs, n) - r) < 1e-9;
+    }
+  }
+  return ok;
+}
+
+PT_FUNC(test_nvec_kernels_base) {
+  PT_ASSERT(test_nvec_kernels(lvec_map_base, lvec_dot_base));
+}
+
+PT_FUNC(test_nvec_kernels_avx2) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    PT_ASSERT(test_nvec_kernels(lvec_map_avx2, lvec_dot_avx2));
+  }
+#endif
+}
+
+PT_SUITE(suite_nvec) {
+  PT_REG(test_dbl_arith);
+  PT_REG(test_dbl_compare);
+  PT_REG(test_nvec_ops);
+  PT_REG(test_nvec_kernels_base);
+  PT_REG(test_nvec_kernels_avx2);
+}
+
+PT_FUNC(test_vec_access) {
+  lenv *e = test_env();
+  lval_delete(run(e, "(def {v} (vec 10 {a} 30 40))"));
+  PT_ASSERT(run_is(e, "(len v)", "4"));
+  PT_ASSERT(run_is(e, "(nth v 0)", "10"));
+  PT_ASSERT(run_is(e, "(nth v 1)", "{a}"));
+  PT_ASSERT(run_is(e, "(nth v 3)", "40"));
+  PT_ASSERT(run_is(e, "(slice v 1 3)", "(vec {a} 30)"));
+  PT_ASSERT(run_is(e, "(nth (slice v 2 4) 1)", "40"));
+  PT_ASSERT(run_is(e, "(len (slice v 2 2))", "0"));
+  PT_ASSERT(run_is(e, "(== (slice v 0 2) (vec 10 {a}))", "1"));
+  PT_ASSERT(run_err(e, "(nth v 4)", "index must be a Number below 4"));
+  PT_ASSERT(run_err(e, "(nth v -1)", "index must be a Number"));
+  PT_ASSERT(run_err(e, "(nth (slice v 1 1) 0)", "below 0"));
+  PT_ASSERT(run_err(e, "(slice v 3 2)", "0 <= start <= end <= 4"));
+  PT_ASSERT(run_err(e, "(slice v 0 5)", "0 <= start <= end <= 4"));
+
+  lval *v = run(e, "v"), *s = run(e, "(slice v 1 3)");
+  PT_ASSERT(s->vbuf == v->vbuf && s->voff == 1 && s->vlen == 2);
+  lval_delete(s);
+  lval_delete(v);
+  test_env_delete(e);
+}
+
+PT_FUNC(test_vec_push) {
+  lenv *e = test_env();
+  lval_delete(run(e, "(def {v} (vec 1 2))"
+                     "(def {a} (push v 3))"
+                     "(def {b} (push v 4))"
+                     "(def {c} (push a 5))"
+                     "(def {d} (push (slice a 0 1) 6))"));
+  PT_ASSERT(run_is(e, "v", "(vec 1 2)"));
+  PT_ASSERT(run_is(e, "a", "(vec 1 2 3)"));
+  PT_ASSERT(run_is(e, "b", "(vec 1 2 4)"));
+  PT_ASSERT(run_is(e, "c", "(vec 1 2 3 5)"));
+  PT_ASSERT(run_is(e, "d", "(vec 1 6)"));
+
+  lval *v = run(e, "v"), *a = run(e, "a"), *b = run(e, "b");
+  lval *c = run(e, "c");
+  PT_ASSERT(a->vbuf == v->vbuf && c->vbuf == v->vbuf && b->vbuf != v->vbuf);
+  lval_delete(v);
+  lval_delete(a);
+  lval_delete(b);
+  lval_delete(c);
+
+  lval_delete(run(e, "(def {build} (\\ {n acc}"
+                     "  {if (== n 0) {acc} {build (- n 1) (push acc n)}}))"
+                     "(def {w} (build 1000 (slice (vec 0) 0 0)))"));
+  PT_ASSERT(run_is(e, "(len w)", "1000"));
+  PT_ASSERT(run_is(e, "(nth w 0)", "1000"));
+  PT_ASSERT(run_is(e, "(nth w 999)", "1"));
+  PT_ASSERT(run_err(e, "(push {1} 2)", "'push' expected Vector"));
+  test_env_delete(e);
+}
+
+PT_SUITE(suite_vec) {
+  PT_REG(test_vec_access);
+  PT_REG(test_vec_push);
+}
+
+PT_FUNC(test_str_access) {
+  lenv *e = test_env();
+  lval_delete(run(e, "(def {s} \"h\\tllo\")"));
+  PT_ASSERT(run_is(e, "(len s)", "5"));
+  PT_ASSERT(run_is(e, "(nth s 1)", "\"\\t\""));
+  PT_ASSERT(run_is(e, "(slice s 2 5)", "\"llo\""));
+  PT_ASSERT(run_is(e, "(nth (bytes s) 0)", "104"));
+  PT_ASSERT(run_is(e, "(string (bytes s))", "s"));
+  PT_ASSERT(run_is(e, "(== (bytes s) s)", "0"));
+  PT_ASSERT(run_is(e, "(len \"\")", "0"));
+  PT_ASSERT(run_err(e, "(nth s 5)", "below 5"));
+  PT_ASSERT(run_err(e, "(string s)", "'string' expected Bytes"));
+  PT_ASSERT(run_err(e, "(bytes (bytes s))", "'bytes' expected String"));
+
+  lval *x = run(e, "s"), *y = run(e, "(bytes (slice s 1 4))");
+  PT_ASSERT(y->sbuf == x->sbuf && y->soff == x->soff + 1 && y->slen == 3);
+  lval_delete(x);
+  lval_delete(y);
+  test_env_delete(e);
+}
+
+PT_FUNC(test_str_concat) {
+  lenv *e = test_env();
+  lval_delete(run(e, "(def {s} \"ab\")"
+                     "(def {x} (concat s \"c\"))"
+                     "(def {y} (concat s \"d\" \"e\"))"
+                     "(def {z} (concat (slice x 0 1) \"z\"))"));
+  PT_ASSERT(run_is(e, "s", "\"ab\""));
+  PT_ASSERT(run_is(e, "x", "\"abc\""));
+  PT_ASSERT(run_is(e, "y", "\"abde\""));
+  PT_ASSERT(run_is(e, "z", "\"az\""));
+  PT_ASSERT(run_is(e, "(concat s)", "\"ab\""));
+  PT_ASSERT(run_is(e, "(concat (bytes s) (bytes \"c\"))", "(bytes x)"));
+  PT_ASSERT(run_err(e, "(concat s (bytes s))", "'concat' expected String"));
+  PT_ASSERT(run_err(e, "(concat 1)", "'concat' expected String"));
+
+  lval_delete(run(e, "(def {build} (\\ {n acc}"
+                     "  {if (== n 0) {acc}"
+                     "   {build (- n 1) (concat acc \"xy\")}}))"
+                     "(def {w} (build 5000 \"\"))"));
+  PT_ASSERT(run_is(e, "(len w)", "10000"));
+  PT_ASSERT(run_is(e, "(slice w 9996 10000)", "\"xyxy\""));
+  lval *w = run(e, "w");
+  PT_ASSERT(w->sbuf->cap < 4 * w->slen);
+  lval_delete(w);
+  test_env_delete(e);
+}
+
+PT_SUITE(suite_str) {
+  PT_REG(test_str_access);
+  PT_REG(test_str_concat);
+}
@@ -0,0 +1,465 @@
+/* The parser library is compiled into the test binary so the tests can
+ * reach its static kernels and parser types. Each optimised mode is
+ * checked against the plain parser on the same input. */
+#include "../mpc.c"
+
+#include "ptest.h"
+
+/* An expression grammar whose alternatives share their prefixes, so the
+ * plain parser backtracks over the same rules at the same positions. */
+typedef struct test_lang test_lang;
+struct test_lang {
+  mpc_parser_t *number, *factor, *term, *expr, *prog;
+};
+
+static test_lang test_lang_new(int flags) {
+  test_lang l = {
+      mpc_new("number"), mpc_new("factor"), mpc_new("term"),
+      mpc_new("expr"),   mpc_new("prog"),
+  };
+  mpc_err_t *err =
+      mpca_lang(flags,
+                " number : /-?[0-9]+/ ;                                  "
+                " factor : <number> | '(' <expr> ')' ;                   "
+                " term   : <factor> '*' <term> | <factor> '/' <term>     "
+                "        | <factor> ;                                    "
+                " expr   : <term> '+' <expr> | <term> '-' <expr>         "
+                "        | <term> ;                                      "
+                " prog   : /^/ <expr> /$/ ;                              ",
+                l.number, l.factor, l.term, l.expr, l.prog, NULL);
+  if (err) {
+    mpc_err_print(err);
+    mpc_err_delete(err);
+  }
+  return l;
+}
+
+static void test_lang_delete(test_lang l) {
+  mpc_cleanup(5, l.number, l.factor, l.term, l.expr, l.prog);
+}
+
+static char *test_inputs[] = {
+    "1",         "1 + 2 * 3",  "(1 + 2) * (3 - 4) / 5", "((((-1))))",
+    "1 +",       "1 + * 2",    "(1 + 2",                "1 2",
+    "",          "((1)) * (",  "7 * 8 * 9 + x",
+};
+
+/* A long product of sums, built into buf. Nesting is kept shallow since
+ * the plain parser takes time exponential in it. */
+static char *test_long_input(char *buf, size_t n) {
+  char *p = buf;
+  for (size_t i = 0; i < n; i++) {
+    p += sprintf(p, "(%zu + %zu) * ", i, i);
+  }
+  sprintf(p, "0");
+  return buf;
+}
+
+static bool test_state_eq(mpc_state_t a, mpc_state_t b) {
+  return a.pos == b.pos && a.row == b.row && a.col == b.col;
+}
+
+static bool test_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
+  if (!mpc_ast_eq(a, b) || !test_state_eq(a->state, b->state)) {
+    return false;
+  }
+  for (int i = 0; i < a->children_num; i++) {
+    if (!test_ast_eq(a->children[i], b->children[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Whether two errors are at the same place, and if msg is set, whether
+ * they also print the same. */
+static bool test_err_eq(mpc_err_t *a, mpc_err_t *b, bool msg) {
+  bool same = test_state_eq(a->state, b->state) && a->received == b->received;
+  if (msg) {
+    char *sa = mpc_err_string(a), *sb = mpc_err_string(b);
+    same = same && strcmp(sa, sb) == 0;
+    if (!same) {
+      printf("    got %s    expected %s", sb, sa);
+    }
+    free(sa);
+    free(sb);
+  }
+  return same;
+}
+
+/* Whether two parses of the same input had the same outcome: equal ASTs,
+ * or equal errors as by test_err_eq. Frees both results. */
+static bool test_same_ast(int xa, mpc_result_t *a, int xb, mpc_result_t *b,
+                          bool msg) {
+  bool same = xa == xb;
+  if (xa && xb) {
+    same = test_ast_eq(a->output, b->output);
+  } else if (!xa && !xb) {
+    same = test_err_eq(a->error, b->error, msg);
+  }
+  if (xa) {
+    mpc_ast_delete(a->output);
+  } else {
+    mpc_err_delete(a->error);
+  }
+  if (xb) {
+    mpc_ast_delete(b->output);
+  } else {
+    mpc_err_delete(b->error);
+  }
+  return same;
+}
+
+/* As test_same_ast for parsers that return strings. */
+static bool test_same_str(int xa, mpc_result_t *a, int xb, mpc_result_t *b,
+                          bool msg) {
+  bool same = xa == xb;
+  if (xa && xb) {
+    same = strcmp(a->output, b->output) == 0;
+  } else if (!xa && !xb) {
+    same = test_err_eq(a->error, b->error, msg);
+  }
+  if (xa) {
+    free(a->output);
+  } else {
+    mpc_err_delete(a->error);
+  }
+  if (xb) {
+    free(b->output);
+  } else {
+    mpc_err_delete(b->error);
+  }
+  return same;
+}
+
+/* Parses src with plain and with memo, whose table is capped at max
+ * bytes, and returns the memo counters, or all -1 if the outcomes
+ * differ. */
+static mpc_memo_t test_memo_parse(test_lang plain, test_lang memo, char *src,
+                                  size_t max) {
+  mpc_result_t a, b;
+  mpc_memo_t m = {.max_bytes = max};
+  int xa = mpc_parse("<test>", src, plain.prog, &a);
+  int xb = mpc_parse_memo("<test>", src, memo.prog, &b, &m);
+  if (!test_same_ast(xa, &a, xb, &b, true)) {
+    return (mpc_memo_t){-1, -1, -1, -1, -1};
+  }
+  return m;
+}
+
+PT_FUNC(test_memo_same) {
+  test_lang plain = test_lang_new(MPCA_LANG_DEFAULT);
+  test_lang memo = test_lang_new(MPCA_LANG_MEMOISE);
+  bool ok = true;
+  for (size_t i = 0; i < sizeof(test_inputs) / sizeof(*test_inputs); i++) {
+    mpc_memo_t m = test_memo_parse(plain, memo, test_inputs[i], 1 << 20);
+    ok = ok && m.hits >= 0 && m.dropped == 0;
+  }
+  PT_ASSERT(ok);
+
+  mpc_memo_t m = test_memo_parse(plain, memo, "(1 + 2) * (3 - 4) / 5", 1 << 20);
+  PT_ASSERT(m.hits > 0 && m.misses > 0 && m.dropped == 0);
+  PT_ASSERT(m.bytes > 0 && m.bytes <= 1 << 20);
+
+  /* The plain grammar never touches a memo table. */
+  mpc_result_t r;
+  m = (mpc_memo_t){.max_bytes = 1 << 20};
+  PT_ASSERT(mpc_parse_memo("<test>", "1 + 2", plain.prog, &r, &m));
+  PT_ASSERT(m.hits == 0 && m.misses == 0 && m.bytes == 0);
+  mpc_ast_delete(r.output);
+  test_lang_delete(plain);
+  test_lang_delete(memo);
+}
+
+/* A table that cannot grow drops the entries that do not fit without
+ * changing the outcome of the parse. */
+PT_FUNC(test_memo_cap) {
+  test_lang plain = test_lang_new(MPCA_LANG_DEFAULT);
+  test_lang memo = test_lang_new(MPCA_LANG_MEMOISE);
+  static char buf[4096];
+  char *src = test_long_input(buf, 100);
+
+  mpc_memo_t full = test_memo_parse(plain, memo, src, 1 << 20);
+  PT_ASSERT(full.hits > 0 && full.dropped == 0);
+
+  size_t min = MPC_MEMO_SLOTS_MIN * sizeof(mpc_memo_entry_t);
+  mpc_memo_t m = test_memo_parse(plain, memo, src, min);
+  PT_ASSERT(m.bytes == min && m.dropped > 0);
+  PT_ASSERT(m.hits > 0 && m.hits < full.hits);
+
+  m = test_memo_parse(plain, memo, src, 0);
+  PT_ASSERT(m.bytes == 0 && m.hits == 0 && m.dropped > 0);
+
+  buf[strlen(buf) - 1] = '\0';
+  m = test_memo_parse(plain, memo, src, min);
+  PT_ASSERT(m.dropped > 0);
+  m = test_memo_parse(plain, memo, src, 1 << 20);
+  PT_ASSERT(m.hits > 0);
+  test_lang_delete(plain);
+  test_lang_delete(memo);
+}
+
+/* Regexes on which leftmost-longest and ordered, possessive matching
+ * agree, so the DFA must match exactly what the combinators match. */
+static char *test_regexes[] = {
+    "ab+c", "[a-z]*[0-9]", "(ab|a)c", "ab|cd", "x?y{2}z", "[^;\n]+;", ".b*",
+};
+
+static char *test_regex_inputs[] = {
+    "abbbc", "abbbd", "ac", "abc9", "abcd9", "aac", "abab", "xyyz",
+    "yyz",   "xyz",   "",   "a\nb;", "q;",   "bbbb", "abc",
+};
+
+PT_FUNC(test_dfa_same) {
+  bool ok = true;
+  for (size_t i = 0; i < sizeof(test_regexes) / sizeof(*test_regexes); i++) {
+    mpc_parser_t *nfa = mpc_re(test_regexes[i]);
+    mpc_parser_t *dfa = mpc_re_mode(test_regexes[i], MPC_RE_DFA);
+    ok = ok && dfa->type == MPC_TYPE_DFA;
+    for (size_t j = 0;
+         j < sizeof(test_regex_inputs) / sizeof(*test_regex_inputs); j++) {
+      mpc_result_t a, b;
+      int xa = mpc_parse("<test>", test_regex_inputs[j], nfa, &a);
+      int xb = mpc_parse("<test>", test_regex_inputs[j], dfa, &b);
+      ok = test_same_str(xa, &a, xb, &b, false) && ok;
+    }
+    mpc_delete(nfa);
+    mpc_delete(dfa);
+  }
+  PT_ASSERT(ok);
+}
+
+/* Where the two disagree, the DFA takes the longest match. */
+PT_FUNC(test_dfa_longest) {
+  char *cases[][3] = {{"a|ab", "abc", "ab"}, {"a*a", "aaa", "aaa"}};
+  for (size_t i = 0; i < 2; i++) {
+    mpc_parser_t *dfa = mpc_re_mode(cases[i][0], MPC_RE_DFA);
+    mpc_result_t r;
+    PT_ASSERT(mpc_parse("<test>", cases[i][1], dfa, &r));
+    PT_ASSERT(strcmp(r.output, cases[i][2]) == 0);
+    free(r.output);
+    mpc_delete(dfa);
+  }
+}
+
+/* A DFA that dies partway through a token reports the failure at the
+ * first character it could not take, as the backtracking matcher does.
+ * Its message names the regex rather than the characters it expected, so
+ * only the positions are compared. */
+PT_FUNC(test_dfa_partial) {
+  mpc_parser_t *nfa = mpc_re("ab+c");
+  mpc_parser_t *dfa = mpc_re_mode("ab+c", MPC_RE_DFA);
+  mpc_result_t a, b;
+  int xa = mpc_parse("<test>", "abbbd", nfa, &a);
+  int xb = mpc_parse("<test>", "abbbd", dfa, &b);
+  PT_ASSERT(!xa && !xb);
+  PT_ASSERT(b.error->state.pos == 4 && b.error->state.col == 4);
+  PT_ASSERT(b.error->received == 'd');
+  PT_ASSERT(test_same_str(xa, &a, xb, &b, false));
+
+  xa = mpc_parse("<test>", "ab\nc", nfa, &a);
+  xb = mpc_parse("<test>", "ab\nc", dfa, &b);
+  PT_ASSERT(!xb && b.error->state.pos == 2);
+  PT_ASSERT(test_same_str(xa, &a, xb, &b, false));
+  mpc_delete(nfa);
+  mpc_delete(dfa);
+
+  test_lang plain = test_lang_new(MPCA_LANG_DEFAULT);
+  test_lang fast = test_lang_new(MPCA_LANG_REGEX_DFA);
+  bool ok = true;
+  for (size_t i = 0; i < sizeof(test_inputs) / sizeof(*test_inputs); i++) {
+    xa = mpc_parse("<test>", test_inputs[i], plain.prog, &a);
+    xb = mpc_parse("<test>", test_inputs[i], fast.prog, &b);
+    ok = test_same_ast(xa, &a, xb, &b, false) && ok;
+  }
+  PT_ASSERT(ok);
+  test_lang_delete(plain);
+  test_lang_delete(fast);
+}
+
+/* Single character parsers of each kind the span rewrite accepts. */
+static mpc_parser_t *test_class(int i) {
+  switch (i) {
+  case 0:
+    return mpc_oneof("abc");
+  case 1:
+    return mpc_noneof("x\n");
+  case 2:
+    return mpc_range('0', '9');
+  case 3:
+    return mpc_expect(mpc_oneof("\x80\xff a"), "class");
+  case 4:
+    return mpc_char(' ');
+  default:
+    return mpc_any();
+  }
+}
+
+static char test_alphabet[] = "abcx09 \n\x80\xff";
+
+PT_FUNC(test_span_same) {
+  static char buf[2048];
+  bool ok = true, spans = true;
+  srand(1);
+  for (int c = 0; c < 6; c++) {
+    for (int min = 0; min < 2; min++) {
+      mpc_parser_t *plain = min ? mpc_many1(mpcf_strfold, test_class(c))
+                                : mpc_many(mpcf_strfold, test_class(c));
+      mpc_parser_t *span = mpc_copy(plain);
+      mpc_optimise(span);
+      spans = spans && span->type == MPC_TYPE_SPAN;
+      for (int k = 0; k < 200; k++) {
+        size_t n = k < 100 ? (size_t)k : (size_t)rand() % sizeof(buf);
+        int run = rand() % 3;
+        for (size_t j = 0; j < n; j++) {
+          buf[j] = run ? test_alphabet[c == 2 ? 4 : 0]
+                       : test_alphabet[rand() % (sizeof(test_alphabet) - 1)];
+          run = run && rand() % 50;
+        }
+        buf[n] = '\0';
+        mpc_result_t a, b;
+        int xa = mpc_parse("<test>", buf, plain, &a);
+        int xb = mpc_parse("<test>", buf, span, &b);
+        ok = test_same_str(xa, &a, xb, &b, true) && ok;
+      }
+      mpc_delete(plain);
+      mpc_delete(span);
+    }
+  }
+  PT_ASSERT(spans);
+  PT_ASSERT(ok);
+}
+
+/* Checks a span kernel against the bitmap for random classes and inputs
+ * of every length up to a few vector widths. */
+static bool test_span_kernel(size_t (*span)(const unsigned char *, const char *,
+                                            size_t)) {
+  unsigned char rows[32];
+  char s[100];
+  bool ok = true;
+  srand(2);
+  for (int k = 0; k < 2000; k++) {
+    memset(rows, 0, sizeof(rows));
+    int members = rand() % 64;
+    for (int j = 0; j < members; j++) {
+      mpc_span_add(rows, (char)(rand() % 256));
+    }
+    size_t n = (size_t)rand() % sizeof(s);
+    for (size_t j = 0; j < n; j++) {
+      s[j] = (char)(rand() % 256);
+      while (rand() % 8 && j + 1 < n && members) {
+        s[j] = (char)(rand() % 256);
+        if (mpc_span_has(rows, s[j])) {
+          break;
+        }
+      }
+    }
+    ok = ok && span(rows, s, n) == mpc_span_scalar(rows, s, n);
+  }
+  return ok;
+}
+
+PT_FUNC(test_span_kernels) {
+  unsigned char rows[32] = {0};
+  mpc_span_add(rows, 'a');
+  mpc_span_add(rows, '\0');
+  PT_ASSERT(mpc_span_has(rows, 'a') && !mpc_span_has(rows, '\0'));
+  PT_ASSERT(mpc_span_scalar(rows, "aaab", 4) == 3);
+#ifdef MPC_SPAN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("ssse3")) {
+    PT_ASSERT(test_span_kernel(mpc_span_ssse3));
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    PT_ASSERT(test_span_kernel(mpc_span_avx2));
+  }
+#endif
+}
+
+/* Whether every leaf of a points into the n bytes at s. */
+static bool test_ast_spans(mpc_ast_t *a, const char *s, size_t n) {
+  if (a->children_num == 0 && a->length > 0) {
+    return a->span && a->contents >= s && a->contents + a->length <= s + n;
+  }
+  for (int i = 0; i < a->children_num; i++) {
+    if (!test_ast_spans(a->children[i], s, n)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+PT_FUNC(test_borrowed_same) {
+  test_lang l = test_lang_new(MPCA_LANG_DEFAULT);
+  bool ok = true, spans = true;
+  for (size_t i = 0; i < sizeof(test_inputs) / sizeof(*test_inputs); i++) {
+    char *src = test_inputs[i];
+    for (int flags = 0; flags < 2; flags++) {
+      mpc_result_t a, b;
+      int xa = mpc_parse("<test>", src, l.prog, &a);
+      int xb = mpc_parse_borrowed("<test>", src, flags, l.prog, &b);
+      if (xb && flags & MPC_PARSE_AST_SPANS) {
+        spans = spans && test_ast_spans(b.output, src, strlen(src));
+      }
+      ok = test_same_ast(xa, &a, xb, &b, true) && ok;
+    }
+  }
+  PT_ASSERT(ok);
+  PT_ASSERT(spans);
+
+  /* Only length bytes are read, and copies of the AST share the spans. */
+  char buf[] = {'1', ' ', '+', ' ', '2', '*'};
+  mpc_result_t a, b;
+  int xa = mpc_parse("<test>", "1 + 2", l.prog, &a);
+  int xb = mpc_nparse_borrowed("<test>", buf, 5, MPC_PARSE_AST_SPANS, l.prog,
+                               &b);
+  PT_ASSERT(xb);
+  mpc_ast_t *c = mpc_ast_copy(b.output);
+  PT_ASSERT(test_ast_spans(c, buf, 5));
+  PT_ASSERT(xa && test_ast_eq(a.output, c));
+  mpc_ast_delete(a.output);
+  mpc_ast_delete(b.output);
+  mpc_ast_delete(c);
+  test_lang_delete(l);
+}
+
+PT_FUNC(test_borrowed_contents) {
+  test_lang l = test_lang_new(MPCA_LANG_DEFAULT);
+  char path[] = "/tmp/mpc_test_XXXXXX";
+  int fd = mkstemp(path);
+  FILE *f = fdopen(fd, "w");
+  fputs("(1 + 2) *\n(3 - ", f);
+  fclose(f);
+
+  mpc_result_t a, b;
+  int xa = mpc_parse_contents(path, l.prog, &a);
+  int xb = mpc_parse_contents_mode(path, MPC_PARSE_IN_MEMORY, l.prog, &b);
+  PT_ASSERT(!xa && b.error->state.row == 1);
+  PT_ASSERT(test_same_ast(xa, &a, xb, &b, true));
+
+  f = fopen(path, "w");
+  fputs("(1 + 2) *\n(3 - 4)", f);
+  fclose(f);
+  xa = mpc_parse_contents(path, l.prog, &a);
+  xb = mpc_parse_contents_mode(path, MPC_PARSE_IN_MEMORY, l.prog, &b);
+  PT_ASSERT(xa);
+  PT_ASSERT(test_same_ast(xa, &a, xb, &b, true));
+  remove(path);
+
+  xb = mpc_parse_contents_mode(path, MPC_PARSE_IN_MEMORY, l.prog, &b);
+  PT_ASSERT(!xb);
+  mpc_err_delete(b.error);
+  test_lang_delete(l);
+}
+
+PT_SUITE(suite_mpc) {
+  PT_REG(test_memo_same);
+  PT_REG(test_memo_cap);
+  PT_REG(test_dfa_same);
+  PT_REG(test_dfa_longest);
+  PT_REG(test_dfa_partial);
+  PT_REG(test_span_same);
+  PT_REG(test_span_kernels);
+  PT_REG(test_borrowed_same);
+  PT_REG(test_borrowed_contents);
+}
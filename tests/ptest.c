@@ -0,0 +1,53 @@
+#include "ptest.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define PT_MAX_TESTS 1024
+
+typedef struct pt_test pt_test;
+struct pt_test {
+  void (*func)(void);
+  const char *name;
+  const char *suite;
+};
+
+static pt_test tests[PT_MAX_TESTS];
+static size_t ntests;
+static size_t nasserts;
+static bool failed;
+
+void pt_assert(bool ok, const char *expr, const char *func, const char *file,
+               int line) {
+  nasserts++;
+  if (!ok) {
+    failed = true;
+    printf("    %s:%d: %s: assertion failed: %s\n", file, line, func, expr);
+  }
+}
+
+void pt_add_test(void (*func)(void), const char *name, const char *suite) {
+  if (ntests == PT_MAX_TESTS) {
+    fprintf(stderr, "ptest: more than %d tests\n", PT_MAX_TESTS);
+    exit(2);
+  }
+  tests[ntests++] = (pt_test){.func = func, .name = name, .suite = suite};
+}
+
+void pt_add_suite(void (*func)(void)) { func(); }
+
+int pt_run(void) {
+  int nfailed = 0;
+  const char *suite = 0;
+  for (size_t i = 0; i < ntests; i++) {
+    if (tests[i].suite != suite) {
+      suite = tests[i].suite;
+      printf("%s\n", suite);
+    }
+    failed = false;
+    tests[i].func();
+    printf("  %-40s %s\n", tests[i].name, failed ? "FAIL" : "ok");
+    nfailed += failed;
+  }
+  printf("%zu tests, %zu assertions, %d failed\n", ntests, nasserts, nfailed);
+  return nfailed;
+}
@@ -0,0 +1,21 @@
+#ifndef ptest_h
+#define ptest_h
+
+#include <stdbool.h>
+
+/* A minimal unit test runner. Suites register their tests with PT_REG and
+ * are themselves registered with pt_add_suite; pt_run runs every test and
+ * returns the number that failed. */
+#define PT_SUITE(name) void name(void)
+#define PT_FUNC(name) static void name(void)
+#define PT_REG(name) pt_add_test(name, #name, __func__)
+#define PT_ASSERT(expr)                                                        \
+  pt_assert((expr), #expr, __func__, __FILE__, __LINE__)
+
+void pt_assert(bool ok, const char *expr, const char *func, const char *file,
+               int line);
+void pt_add_test(void (*func)(void), const char *name, const char *suite);
+void pt_add_suite(void (*func)(void));
+int pt_run(void);
+
+#endif
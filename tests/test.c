@@ -0,0 +1,50 @@
+#include "ptest.h"
+
+void suite_tail(void);
+void suite_reader(void);
+void suite_gc(void);
+void suite_big(void);
+void suite_map(void);
+void suite_sym(void);
+void suite_env(void);
+void suite_resolve(void);
+void suite_vm(void);
+void suite_cow(void);
+void suite_alloc(void);
+void suite_fix(void);
+void suite_arith(void);
+void suite_cells(void);
+void suite_frames(void);
+void suite_partial(void);
+void suite_ic(void);
+void suite_fold(void);
+void suite_nvec(void);
+void suite_vec(void);
+void suite_str(void);
+void suite_mpc(void);
+
+int main(void) {
+  pt_add_suite(suite_tail);
+  pt_add_suite(suite_reader);
+  pt_add_suite(suite_gc);
+  pt_add_suite(suite_big);
+  pt_add_suite(suite_map);
+  pt_add_suite(suite_sym);
+  pt_add_suite(suite_env);
+  pt_add_suite(suite_resolve);
+  pt_add_suite(suite_vm);
+  pt_add_suite(suite_cow);
+  pt_add_suite(suite_alloc);
+  pt_add_suite(suite_fix);
+  pt_add_suite(suite_arith);
+  pt_add_suite(suite_cells);
+  pt_add_suite(suite_frames);
+  pt_add_suite(suite_partial);
+  pt_add_suite(suite_ic);
+  pt_add_suite(suite_fold);
+  pt_add_suite(suite_nvec);
+  pt_add_suite(suite_vec);
+  pt_add_suite(suite_str);
+  pt_add_suite(suite_mpc);
+  return pt_run() ? 1 : 0;
+}